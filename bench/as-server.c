@@ -0,0 +1,638 @@
+/*
+ * Copyright (c) 2009 Tilman Sauerbeck (tilman at xmms org)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* a stand-in for an AudioScrobbler 1.2 server, for load tests.
+ * it accepts any user, hands out a new session id on each handshake
+ * (which ends that user's previous session) and
+ * answers now-playing and submission requests, optionally after a delay
+ * and with errors injected. the accounting is printed as JSON when it's
+ * stopped with SIGINT or SIGTERM, and is also available at /stats.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#define MAX_CLIENTS 64
+
+typedef enum {
+	REPLY_OK,
+	REPLY_BADSESSION,
+	REPLY_FAILED,
+	REPLY_NONE
+} Reply;
+
+typedef struct {
+	int fd;
+
+	char *in;
+	size_t in_length, in_allocated;
+
+	/* the reply to the current request, sent at 'reply_at' */
+	char *out;
+	size_t out_length, out_sent;
+	int64_t reply_at;
+
+	/* the request won't be answered, the client has to time out */
+	bool silent;
+} Client;
+
+static struct {
+	unsigned long connections, handshakes, now_playing, submissions;
+	unsigned long items, bad_session, failed, timeouts;
+
+	/* arrival times of submission requests, in microseconds */
+	int64_t *arrivals;
+	int arrivals_count, arrivals_allocated;
+
+	int64_t first_request, last_reply;
+} stats;
+
+static Client clients[MAX_CLIENTS];
+static int port = 18080;
+static int latency; /* milliseconds */
+static int bad_session_rate, failed_rate, timeout_rate; /* percent */
+static bool chunked;
+#define MAX_USERS 1024
+
+/* the current session of each user */
+static struct {
+	char user[64];
+	char session[32];
+} users[MAX_USERS];
+static volatile sig_atomic_t keep_running = true;
+
+static int64_t
+now_usec ()
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+
+	return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+signal_handler (int sig)
+{
+	keep_running = false;
+}
+
+static void
+record_arrival (int64_t t)
+{
+	if (stats.arrivals_count == stats.arrivals_allocated) {
+		stats.arrivals_allocated = stats.arrivals_allocated * 2 + 1024;
+		stats.arrivals = realloc (stats.arrivals, stats.arrivals_allocated *
+		                                          sizeof (int64_t));
+	}
+
+	stats.arrivals[stats.arrivals_count++] = t;
+}
+
+static int
+compare (const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+/* 'cycle' is the time from one submission request to the next, ie the
+ * time the client needs for a whole round trip, including our latency.
+ */
+static int
+format_stats (char *buf, size_t size)
+{
+	int64_t *cycles = NULL;
+	int n = stats.arrivals_count - 1;
+	double elapsed = 0, p50 = 0, p99 = 0;
+
+	if (stats.first_request && stats.last_reply > stats.first_request)
+		elapsed = (stats.last_reply - stats.first_request) / 1e6;
+
+	if (n > 0) {
+		cycles = malloc (n * sizeof (int64_t));
+
+		for (int i = 0; i < n; i++)
+			cycles[i] = stats.arrivals[i + 1] - stats.arrivals[i];
+
+		qsort (cycles, n, sizeof (int64_t), compare);
+
+		p50 = cycles[n / 2] / 1e3;
+		p99 = cycles[(int) (n * 0.99)] / 1e3;
+
+		free (cycles);
+	}
+
+	return snprintf (buf, size,
+	                 "{\n"
+	                 "  \"connections\": %lu,\n"
+	                 "  \"handshakes\": %lu,\n"
+	                 "  \"now_playing\": %lu,\n"
+	                 "  \"submissions\": %lu,\n"
+	                 "  \"items\": %lu,\n"
+	                 "  \"bad_session\": %lu,\n"
+	                 "  \"failed\": %lu,\n"
+	                 "  \"timeouts\": %lu,\n"
+	                 "  \"elapsed_s\": %.3f,\n"
+	                 "  \"requests_per_s\": %.1f,\n"
+	                 "  \"items_per_s\": %.1f,\n"
+	                 "  \"cycle_ms\": { \"p50\": %.3f, \"p99\": %.3f }\n"
+	                 "}\n",
+	                 stats.connections, stats.handshakes, stats.now_playing,
+	                 stats.submissions, stats.items, stats.bad_session,
+	                 stats.failed, stats.timeouts, elapsed,
+	                 elapsed ? stats.submissions / elapsed : 0,
+	                 elapsed ? stats.items / elapsed : 0, p50, p99);
+}
+
+static void
+set_reply (Client *c, const char *status, const char *body)
+{
+	size_t length = strlen (body);
+
+	free (c->out);
+	c->out = malloc (length + 256);
+
+	if (chunked && length > 1) {
+		/* split the body into two chunks */
+		size_t half = length / 2;
+
+		c->out_length = sprintf (c->out,
+		                         "HTTP/1.1 %s\r\n"
+		                         "Content-Type: text/plain\r\n"
+		                         "Transfer-Encoding: chunked\r\n\r\n"
+		                         "%zx\r\n%.*s\r\n%zx\r\n%s\r\n0\r\n\r\n",
+		                         status, half, (int) half, body,
+		                         length - half, body + half);
+	} else {
+		c->out_length = sprintf (c->out,
+		                         "HTTP/1.1 %s\r\n"
+		                         "Content-Type: text/plain\r\n"
+		                         "Content-Length: %zu\r\n\r\n%s",
+		                         status, length, body);
+	}
+
+	c->out_sent = 0;
+	c->reply_at = now_usec () + latency * 1000;
+}
+
+/* returns the value of the parameter 'name' in 'query' */
+static bool
+get_param (const char *query, const char *name, char *value, size_t size)
+{
+	size_t length = strlen (name);
+
+	for (const char *p = query; p; p = strchr (p, '&')) {
+		size_t n;
+
+		if (*p == '&' || *p == '?')
+			p++;
+
+		if (strncmp (p, name, length) || p[length] != '=')
+			continue;
+
+		p += length + 1;
+		n = strcspn (p, "& \r\n");
+
+		if (n >= size)
+			n = size - 1;
+
+		memcpy (value, p, n);
+		value[n] = 0;
+
+		return true;
+	}
+
+	return false;
+}
+
+static Reply
+pick_reply (const char *body)
+{
+	char s[sizeof (users[0].session)];
+	int i, r = rand () % 100;
+
+	if (!get_param (body, "s", s, sizeof (s)))
+		s[0] = 0;
+
+	for (i = 0; i < MAX_USERS; i++)
+		if (s[0] && !strcmp (s, users[i].session))
+			break;
+
+	if (i == MAX_USERS) {
+		stats.bad_session++;
+		return REPLY_BADSESSION;
+	}
+
+	if (r < bad_session_rate) {
+		/* the session is gone for real */
+		stats.bad_session++;
+		users[i].session[0] = 0;
+		return REPLY_BADSESSION;
+	}
+
+	r -= bad_session_rate;
+
+	if (r < failed_rate) {
+		stats.failed++;
+		return REPLY_FAILED;
+	}
+
+	r -= failed_rate;
+
+	if (r < timeout_rate) {
+		stats.timeouts++;
+		return REPLY_NONE;
+	}
+
+	return REPLY_OK;
+}
+
+static void
+answer (Client *c, Reply reply)
+{
+	switch (reply) {
+		case REPLY_OK:
+			set_reply (c, "200 OK", "OK\n");
+			break;
+		case REPLY_BADSESSION:
+			set_reply (c, "200 OK", "BADSESSION\n");
+			break;
+		case REPLY_FAILED:
+			set_reply (c, "200 OK", "FAILED injected failure\n");
+			break;
+		case REPLY_NONE:
+			c->silent = true;
+			break;
+	}
+}
+
+static unsigned long
+count_items (const char *body)
+{
+	unsigned long n = !strncmp (body, "a[", 2);
+
+	for (const char *p = body; (p = strstr (p, "&a[")); p++)
+		n++;
+
+	return n;
+}
+
+static void
+handle_request (Client *c, const char *method, const char *path,
+                const char *body)
+{
+	int64_t now = now_usec ();
+	char buf[1024];
+
+	if (!stats.first_request)
+		stats.first_request = now;
+
+	if (!strcmp (method, "GET") && strstr (path, "hs=true")) {
+		char user[sizeof (users[0].user)];
+		int i;
+
+		if (!get_param (strchr (path, '?'), "u", user, sizeof (user)))
+			user[0] = 0;
+
+		/* the user's slot, or the first free one. once all slots
+		 * are taken, the last one is shared.
+		 */
+		for (i = 0; i < MAX_USERS - 1; i++)
+			if (!users[i].user[0] || !strcmp (users[i].user, user))
+				break;
+
+		strcpy (users[i].user, user);
+
+		stats.handshakes++;
+		snprintf (users[i].session, sizeof (users[i].session),
+		          "session%lu", stats.handshakes);
+		snprintf (buf, sizeof (buf),
+		          "OK\n%s\nhttp://127.0.0.1:%i/np\n"
+		          "http://127.0.0.1:%i/submit\n", users[i].session,
+		          port, port);
+		set_reply (c, "200 OK", buf);
+	} else if (!strcmp (method, "GET") && !strcmp (path, "/stats")) {
+		format_stats (buf, sizeof (buf));
+		set_reply (c, "200 OK", buf);
+		c->reply_at = now;
+	} else if (!strcmp (method, "POST") && !strcmp (path, "/np")) {
+		stats.now_playing++;
+		answer (c, pick_reply (body));
+	} else if (!strcmp (method, "POST") && !strcmp (path, "/submit")) {
+		Reply reply = pick_reply (body);
+
+		stats.submissions++;
+		record_arrival (now);
+
+		if (reply == REPLY_OK)
+			stats.items += count_items (body);
+
+		answer (c, reply);
+	} else {
+		set_reply (c, "404 Not Found", "not found\n");
+	}
+}
+
+/* handles the first request in the client's buffer if it's complete.
+ * returns false if the connection should be closed.
+ */
+static bool
+parse_request (Client *c)
+{
+	char method[8], path[512], *end, *p;
+	size_t header_length, content_length = 0;
+
+	c->in[c->in_length] = 0;
+
+	end = strstr (c->in, "\r\n\r\n");
+
+	if (!end)
+		return c->in_length < c->in_allocated - 1;
+
+	header_length = end + 4 - c->in;
+
+	if (sscanf (c->in, "%7s %511s", method, path) != 2)
+		return false;
+
+	for (p = c->in; p && p < end; p = strstr (p, "\r\n")) {
+		p += (*p == '\r') ? 2 : 0;
+
+		if (!strncasecmp (p, "Content-Length:", 15))
+			content_length = strtoul (p + 15, NULL, 10);
+	}
+
+	if (header_length + content_length > c->in_allocated - 1)
+		return false;
+
+	if (c->in_length < header_length + content_length)
+		return true;
+
+	/* terminate the body, but remember what's after it */
+	char next = c->in[header_length + content_length];
+
+	c->in[header_length + content_length] = 0;
+	handle_request (c, method, path, c->in + header_length);
+	c->in[header_length + content_length] = next;
+
+	c->in_length -= header_length + content_length;
+	memmove (c->in, c->in + header_length + content_length, c->in_length);
+
+	return true;
+}
+
+static void
+client_close (Client *c)
+{
+	close (c->fd);
+	free (c->in);
+	free (c->out);
+
+	memset (c, 0, sizeof (Client));
+	c->fd = -1;
+}
+
+static void
+client_read (Client *c)
+{
+	ssize_t n;
+
+	n = read (c->fd, c->in + c->in_length, c->in_allocated - 1 -
+	                                       c->in_length);
+
+	if (n <= 0) {
+		client_close (c);
+		return;
+	}
+
+	c->in_length += n;
+
+	if (!c->out && !c->silent && !parse_request (c))
+		client_close (c);
+}
+
+static void
+client_write (Client *c)
+{
+	ssize_t n;
+
+	n = write (c->fd, c->out + c->out_sent, c->out_length - c->out_sent);
+
+	if (n <= 0) {
+		client_close (c);
+		return;
+	}
+
+	c->out_sent += n;
+
+	if (c->out_sent < c->out_length)
+		return;
+
+	free (c->out);
+	c->out = NULL;
+	stats.last_reply = now_usec ();
+
+	/* there might be another request waiting */
+	if (c->in_length && !parse_request (c))
+		client_close (c);
+}
+
+static void
+usage (const char *name)
+{
+	fprintf (stderr,
+	         "usage: %s [-p port] [-l latency] [-b percent] [-f percent]\n"
+	         "       [-t percent] [-c] [-s seed] [-P pidfile]\n"
+	         "  -l  milliseconds to wait before each reply\n"
+	         "  -b  share of requests answered with BADSESSION\n"
+	         "  -f  share of requests answered with FAILED\n"
+	         "  -t  share of requests that aren't answered at all\n"
+	         "  -c  send chunked replies\n"
+	         "  -P  write the pid to this file once we're listening\n",
+	         name);
+}
+
+int
+main (int argc, char **argv)
+{
+	struct sockaddr_in addr = { 0 };
+	struct sigaction sa = { .sa_handler = signal_handler };
+	struct pollfd fds[MAX_CLIENTS + 1];
+	const char *pidfile = NULL;
+	char buf[1024];
+	int listener, opt, on = 1;
+
+	while ((opt = getopt (argc, argv, "p:l:b:f:t:cs:P:")) != -1) {
+		switch (opt) {
+			case 'p':
+				port = atoi (optarg);
+				break;
+			case 'l':
+				latency = atoi (optarg);
+				break;
+			case 'b':
+				bad_session_rate = atoi (optarg);
+				break;
+			case 'f':
+				failed_rate = atoi (optarg);
+				break;
+			case 't':
+				timeout_rate = atoi (optarg);
+				break;
+			case 'c':
+				chunked = true;
+				break;
+			case 's':
+				srand (atoi (optarg));
+				break;
+			case 'P':
+				pidfile = optarg;
+				break;
+			default:
+				usage (argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+
+	sigaction (SIGINT, &sa, NULL);
+	sigaction (SIGTERM, &sa, NULL);
+	signal (SIGPIPE, SIG_IGN);
+
+	listener = socket (AF_INET, SOCK_STREAM, 0);
+	setsockopt (listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof (on));
+
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons (port);
+	addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+	if (bind (listener, (struct sockaddr *) &addr, sizeof (addr)) ||
+	    listen (listener, 16)) {
+		perror ("cannot listen");
+		return EXIT_FAILURE;
+	}
+
+	if (pidfile) {
+		FILE *fp = fopen (pidfile, "w");
+
+		if (fp) {
+			fprintf (fp, "%i\n", (int) getpid ());
+			fclose (fp);
+		}
+	}
+
+	for (int i = 0; i < MAX_CLIENTS; i++)
+		clients[i].fd = -1;
+
+	while (keep_running) {
+		int64_t now = now_usec (), next = -1;
+		int timeout = -1;
+
+		fds[0].fd = listener;
+		fds[0].events = POLLIN;
+
+		for (int i = 0; i < MAX_CLIENTS; i++) {
+			Client *c = &clients[i];
+
+			fds[i + 1].fd = c->fd;
+			fds[i + 1].events = POLLIN;
+			fds[i + 1].revents = 0;
+
+			if (!c->out)
+				continue;
+
+			if (c->reply_at <= now)
+				fds[i + 1].events |= POLLOUT;
+			else if (next == -1 || c->reply_at < next)
+				next = c->reply_at;
+		}
+
+		if (next != -1)
+			timeout = (next - now + 999) / 1000;
+
+		if (poll (fds, MAX_CLIENTS + 1, timeout) == -1) {
+			if (errno == EINTR)
+				continue;
+
+			perror ("poll");
+			break;
+		}
+
+		if (fds[0].revents & POLLIN) {
+			int fd = accept (listener, NULL, NULL);
+			int i;
+
+			for (i = 0; i < MAX_CLIENTS && clients[i].fd != -1; i++)
+				;
+
+			if (fd == -1) {
+				/* nothing to do */
+			} else if (i == MAX_CLIENTS) {
+				close (fd);
+			} else {
+				stats.connections++;
+				clients[i].fd = fd;
+				clients[i].in_allocated = 64 * 1024;
+				clients[i].in = malloc (clients[i].in_allocated);
+			}
+		}
+
+		for (int i = 0; i < MAX_CLIENTS; i++) {
+			Client *c = &clients[i];
+
+			if (c->fd == -1 || fds[i + 1].fd != c->fd)
+				continue;
+
+			if (fds[i + 1].revents & POLLOUT)
+				client_write (c);
+
+			if (c->fd != -1 &&
+			    fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR))
+				client_read (c);
+		}
+	}
+
+	for (int i = 0; i < MAX_CLIENTS; i++)
+		if (clients[i].fd != -1)
+			client_close (&clients[i]);
+
+	close (listener);
+
+	format_stats (buf, sizeof (buf));
+	fputs (buf, stdout);
+
+	free (stats.arrivals);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,93 @@
+#!/bin/sh
+#
+# drain load test: fills a server's journal with N scrobbles, lets
+# "xmms2-scrobbler --drain" send them to the stand-in server in
+# bin/as-server and prints the server's accounting.
+#
+# usage: drain.sh [N [ENGINE [AS-SERVER OPTIONS...]]]
+#
+# ENGINE is "threads", "multi" or "pool". PORT sets the port to use,
+# SERVERS the number of servers that get N scrobbles each. IMPORT
+# adds that many more with --import while the first ones are being
+# sent, eg
+#   PORT=18181 sh bench/drain.sh 10000 threads -l 20 -f 5
+#   SERVERS=300 sh bench/drain.sh 100 pool
+#   IMPORT=100 sh bench/drain.sh 20 pool -f 50
+
+set -e
+
+count=${1:-10000}
+engine=${2:-threads}
+[ $# -gt 0 ] && shift
+[ $# -gt 0 ] && shift
+
+port=${PORT:-18180}
+servers=${SERVERS:-1}
+import=${IMPORT:-0}
+dir=$(mktemp -d "${TMPDIR:-/tmp}/xmms2-scrobbler-drain.XXXXXX")
+conf=$dir/xmms2/clients/xmms2-scrobbler
+
+trap 'rm -rf "$dir"' EXIT
+
+mkdir -p "$conf"
+printf 'engine: %s\nrequest_timeout: 2\n' "$engine" > "$conf/config"
+
+for i in $(seq 1 "$servers"); do
+	mkdir -p "$conf/standin$i"
+
+	printf 'user: bench%s\npassword: bench\nhandshake_url: http://127.0.0.1:%s/\n' \
+	       "$i" "$port" > "$conf/standin$i/config"
+
+	awk -v n="$count" 'BEGIN {
+		for (i = 0; i < n; i++)
+			printf "+a[0]=Artist+%d&t[0]=Title+%d&i[0]=%d&o[0]=P&r[0]=" \
+			       "&l[0]=240&b[0]=Album&n[0]=&m[0]=\n", i, i, 1234567890 + i
+	}' > "$conf/standin$i/journal"
+done
+
+bin/as-server -p "$port" -P "$dir/pid" "$@" > "$dir/stats" &
+server=$!
+
+while [ ! -s "$dir/pid" ]; do
+	kill -0 $server
+	sleep 0.05
+done
+
+if [ "$import" -gt 0 ]; then
+	awk -v n="$import" 'BEGIN {
+		for (i = 0; i < n; i++)
+			printf "Artist %d\tImported %d\tAlbum\t240\t%d\n",
+			       i, i, 1234567890 + i
+	}' > "$dir/import"
+
+	set -- --import "$dir/import"
+else
+	set -- --drain
+fi
+
+XDG_CONFIG_HOME=$dir bin/xmms2-scrobbler "$@" > /dev/null &
+scrobbler=$!
+
+# the largest number of threads and the most virtual memory it used
+peak=0 vm=0
+
+while kill -0 $scrobbler 2> /dev/null; do
+	set -- $(awk '/^Threads:/ { t = $2 } /^VmSize:/ { v = $2 }
+	              END { print t + 0, v + 0 }' \
+	             /proc/$scrobbler/status 2> /dev/null || echo 0 0)
+	[ "$1" -gt $peak ] && peak=$1
+	[ "$2" -gt $vm ] && vm=$2
+	sleep 0.05
+done
+
+wait $scrobbler
+
+kill -INT $server
+wait $server
+
+echo "drained $((count + import)) entries per server from $servers servers" \
+     "with the $engine engine, $(cat "$conf"/standin*/journal | grep -c . || true)" \
+     "left in the journals"
+[ -d /proc/self ] &&
+	echo "at most $peak threads and $((vm / 1024)) MiB of virtual memory"
+cat "$dir/stats"
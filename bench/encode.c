@@ -0,0 +1,249 @@
+/*
+ * Copyright (c) 2009 Tilman Sauerbeck (tilman at xmms org)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* checks that every url encoder the cpu supports gives the same output
+ * as the original one, then measures their throughput.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "strbuf.h"
+
+#define GOODCHAR(a) ((((a) >= 'a') && ((a) <= 'z')) || \
+                     (((a) >= 'A') && ((a) <= 'Z')) || \
+                     (((a) >= '0') && ((a) <= '9')) || \
+                     ((a) == ':') || \
+                     ((a) == '/') || \
+                     ((a) == '-') || \
+                     ((a) == '.') || \
+                     ((a) == '_'))
+
+static const struct {
+	const char *name;
+	StrBufEncoder encoder;
+} encoders[] = {
+	{ "scalar", STRBUF_ENCODER_SCALAR },
+	{ "sse2", STRBUF_ENCODER_SSE2 },
+	{ "avx2", STRBUF_ENCODER_AVX2 }
+};
+
+#define N_ENCODERS (sizeof (encoders) / sizeof (encoders[0]))
+
+/* the encoder strbuf_append_encoded used to be */
+static char *
+reference_encode (char *dest, const uint8_t *src)
+{
+	static const char hex[16] = "0123456789abcdef";
+
+	for (; *src; src++) {
+		if (GOODCHAR (*src)) {
+			*dest++ = *src;
+		} else if (*src == ' ') {
+			*dest++ = '+';
+		} else {
+			*dest++ = '%';
+			*dest++ = hex[((*src & 0xf0) >> 4)];
+			*dest++ = hex[(*src & 0x0f)];
+		}
+	}
+
+	*dest = 0;
+
+	return dest;
+}
+
+static double
+now ()
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+check_one (StrBuf *sb, const uint8_t *input)
+{
+	static char expected[3 * 4096 + 1];
+
+	reference_encode (expected, input);
+
+	/* start at an odd offset so the stores are unaligned */
+	strbuf_truncate (sb, 0);
+	strbuf_append (sb, "x");
+	strbuf_append_encoded (sb, input);
+
+	if (strcmp (sb->buf + 1, expected)) {
+		fprintf (stderr, "mismatch for \"%s\":\n  got      %s\n"
+		         "  expected %s\n", input, sb->buf + 1, expected);
+		return 1;
+	}
+
+	return 0;
+}
+
+/* every string of one and two bytes, every byte value at every position
+ * of strings up to 96 bytes long (which covers the tails after each
+ * vector block) and random strings of random length.
+ */
+static int
+check (void)
+{
+	StrBuf *sb = strbuf_new ();
+	uint8_t input[4096 + 1];
+	int errors = 0;
+
+	for (int a = 1; a < 256; a++) {
+		input[0] = a;
+		input[1] = 0;
+		errors += check_one (sb, input);
+
+		for (int b = 1; b < 256; b++) {
+			input[1] = b;
+			input[2] = 0;
+			errors += check_one (sb, input);
+		}
+	}
+
+	for (int len = 1; len <= 96; len++) {
+		for (int pos = 0; pos < len; pos++) {
+			memset (input, 'a', len);
+			input[len] = 0;
+
+			for (int c = 1; c < 256; c++) {
+				input[pos] = c;
+				errors += check_one (sb, input);
+			}
+		}
+	}
+
+	srand (1);
+
+	for (int i = 0; i < 10000 && errors < 10; i++) {
+		int len = rand () % 4096;
+
+		for (int j = 0; j < len; j++)
+			input[j] = 1 + rand () % 255;
+
+		input[len] = 0;
+		errors += check_one (sb, input);
+	}
+
+	strbuf_free (sb);
+
+	return errors;
+}
+
+static void
+fill (uint8_t *buf, size_t len, const char *alphabet)
+{
+	size_t n = strlen (alphabet);
+
+	for (size_t i = 0; i < len; i++)
+		buf[i] = alphabet[rand () % n];
+
+	buf[len] = 0;
+}
+
+static void
+measure (const char *name, const uint8_t *input, int iterations)
+{
+	StrBuf *sb = strbuf_new ();
+	size_t len = strlen ((const char *) input);
+
+	printf ("%-8s", name);
+
+	for (int e = 0; e < N_ENCODERS; e++) {
+		double start, elapsed;
+
+		if (!strbuf_set_encoder (encoders[e].encoder))
+			continue;
+
+		start = now ();
+
+		for (int i = 0; i < iterations; i++) {
+			strbuf_truncate (sb, 0);
+			strbuf_append_encoded (sb, input);
+		}
+
+		elapsed = now () - start;
+
+		printf ("  %s %8.1f MB/s", encoders[e].name,
+		        len * (double) iterations / elapsed / 1e6);
+	}
+
+	printf ("\n");
+
+	strbuf_free (sb);
+}
+
+int
+main (int argc, char **argv)
+{
+	uint8_t *input;
+	size_t len = 4096;
+	int iterations = 20000;
+
+	if (argc > 1)
+		iterations = atoi (argv[1]);
+
+	for (int e = 0; e < N_ENCODERS; e++) {
+		int errors;
+
+		if (!strbuf_set_encoder (encoders[e].encoder)) {
+			printf ("encoder %s: not supported\n", encoders[e].name);
+			continue;
+		}
+
+		errors = check ();
+		printf ("encoder %s: %s\n", encoders[e].name,
+		        errors ? "MISMATCH" : "ok");
+
+		if (errors)
+			return EXIT_FAILURE;
+	}
+
+	input = malloc (len + 1);
+	srand (1);
+
+	/* artist and title like text, text with the occasional
+	 * non-ascii character and text that needs escaping throughout.
+	 */
+	fill (input, len, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJ ");
+	measure ("ascii", input, iterations);
+
+	fill (input, len, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJ \xc3\xb6");
+	measure ("latin", input, iterations);
+
+	fill (input, len, "\xe3\x81\x82\xe3\x82\x8b&=+");
+	measure ("escaped", input, iterations);
+
+	strbuf_set_encoder (STRBUF_ENCODER_AUTO);
+	free (input);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2009 Tilman Sauerbeck (tilman at xmms org)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* measures how many submissions per second can be added to a journal
+ * with the different sync policies.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "journal.h"
+
+static const char *line =
+	"a[0]=Some+Artist&t[0]=Some+Title&i[0]=1234567890&o[0]=P&r[0]="
+	"&l[0]=240&b[0]=Some+Album&n[0]=&m[0]=";
+
+static double
+now ()
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+run (const char *filename, int sync_interval, int count)
+{
+	Journal *j;
+	double start, elapsed;
+	int length = strlen (line);
+
+	unlink (filename);
+
+	journal_init (sync_interval);
+	j = journal_open (filename, NULL, NULL);
+
+	start = now ();
+
+	for (int i = 0; i < count; i++) {
+		journal_append (j, line, length);
+		journal_commit (j);
+	}
+
+	elapsed = now () - start;
+
+	journal_close (j);
+	journal_shutdown ();
+
+	printf ("sync_interval %5i: %10.0f enqueues/s\n",
+	        sync_interval, count / elapsed);
+}
+
+int
+main (int argc, char **argv)
+{
+	static const int intervals[] = { 0, 10, 100, 1000, -1 };
+	const char *tmpdir;
+	char dir[PATH_MAX], filename[PATH_MAX + 16];
+	int count = 10000;
+
+	if (argc > 1)
+		count = atoi (argv[1]);
+
+	/* set TMPDIR to measure on a real disk rather than tmpfs */
+	tmpdir = getenv ("TMPDIR");
+
+	snprintf (dir, sizeof (dir), "%s/xmms2-scrobbler-bench.XXXXXX",
+	          tmpdir ? tmpdir : "/tmp");
+
+	if (!mkdtemp (dir)) {
+		perror ("mkdtemp");
+		return EXIT_FAILURE;
+	}
+
+	snprintf (filename, sizeof (filename), "%s/journal", dir);
+
+	for (int i = 0; i < sizeof (intervals) / sizeof (intervals[0]); i++)
+		run (filename, intervals[i], count);
+
+	unlink (filename);
+	rmdir (dir);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,141 @@
+/*
+ * Copyright (c) 2009 Tilman Sauerbeck (tilman at xmms org)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* measures how long a thread is held up by logging a line like the
+ * ones on the submission path, with fprintf() to stderr as it used to
+ * be done and with the buffered logger.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+
+#define BURST 64
+
+static uint64_t
+now_ns ()
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+log_fprintf (int i)
+{
+	fprintf (stderr, "[%s] submitting %i item(s)\n", "lastfm", i);
+}
+
+static void
+log_buffered (int i)
+{
+	log_info ("[%s] submitting %i item(s)\n", "lastfm", i);
+}
+
+static int
+compare (const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+/* logs 'count' lines in bursts, pausing for 'pause' microseconds
+ * between bursts like a busy daemon would.
+ */
+static void
+run (const char *name, void (*log) (int), int count, int pause)
+{
+	uint32_t *latencies = malloc (count * sizeof (uint32_t));
+
+	for (int i = 0; i < count; i++) {
+		uint64_t t = now_ns ();
+
+		log (i);
+		latencies[i] = now_ns () - t;
+
+		if (i % BURST == BURST - 1) {
+			struct timespec ts = { 0, pause * 1000 };
+
+			nanosleep (&ts, NULL);
+		}
+	}
+
+	qsort (latencies, count, sizeof (uint32_t), compare);
+
+	printf ("%-8s: p50 %6u ns, p99 %6u ns, p99.9 %7u ns, max %8u ns\n",
+	        name, latencies[count / 2], latencies[count / 100 * 99],
+	        latencies[count / 1000 * 999], latencies[count - 1]);
+
+	free (latencies);
+}
+
+int
+main (int argc, char **argv)
+{
+	const char *tmpdir;
+	char filename[PATH_MAX];
+	int count = 100000, fd, saved_stderr;
+
+	if (argc > 1)
+		count = atoi (argv[1]);
+
+	/* set TMPDIR to measure on a real disk rather than tmpfs */
+	tmpdir = getenv ("TMPDIR");
+
+	snprintf (filename, sizeof (filename),
+	          "%s/xmms2-scrobbler-bench.XXXXXX", tmpdir ? tmpdir : "/tmp");
+
+	fd = mkstemp (filename);
+
+	if (fd == -1) {
+		perror ("mkstemp");
+		return EXIT_FAILURE;
+	}
+
+	saved_stderr = dup (STDERR_FILENO);
+
+	dup2 (fd, STDERR_FILENO);
+	close (fd);
+
+	run ("fprintf", log_fprintf, count, 100);
+
+	log_start (filename);
+	run ("buffered", log_buffered, count, 100);
+	log_stop ();
+
+	dup2 (saved_stderr, STDERR_FILENO);
+	close (saved_stderr);
+
+	unlink (filename);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,280 @@
+/*
+ * Copyright (c) 2009 Tilman Sauerbeck (tilman at xmms org)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* times the building blocks of xmms2-scrobbler on synthetic data and
+ * prints the results as JSON. allocations are counted by wrapping
+ * malloc, calloc and realloc at link time, so only the ones made by
+ * our own code show up.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <xmmsclient/xmmsclient.h>
+
+#include "md5.h"
+#include "queue.h"
+#include "ring.h"
+#include "strbuf.h"
+#include "submission.h"
+
+static unsigned long allocations;
+
+void *__real_malloc (size_t size);
+void *__real_calloc (size_t n, size_t size);
+void *__real_realloc (void *p, size_t size);
+
+void *
+__wrap_malloc (size_t size)
+{
+	allocations++;
+
+	return __real_malloc (size);
+}
+
+void *
+__wrap_calloc (size_t n, size_t size)
+{
+	allocations++;
+
+	return __real_calloc (n, size);
+}
+
+void *
+__wrap_realloc (void *p, size_t size)
+{
+	allocations++;
+
+	return __real_realloc (p, size);
+}
+
+static const char *artist = "Sigur R\xc3\xb3s";
+static const char *title = "Hopp\xc3\xadpolla (Live at the Royal Albert Hall)";
+static const char *album = "Takk...";
+static const char *line =
+	"a[0]=Sigur+R%c3%b3s&t[0]=Hopp%c3%adpolla+%28Live+at+the+Royal+"
+	"Albert+Hall%29&i[0]=1234567890&o[0]=P&r[0]=&l[0]=600&b[0]=Takk..."
+	"&n[0]=&m[0]=";
+
+static xmmsv_t *dict;
+static StrBuf *sb;
+static Submission *submission;
+static Queue queue;
+static Ring *ring;
+
+static void
+set_string (xmmsv_t *d, const char *key, const char *value)
+{
+	xmmsv_t *v = xmmsv_new_string (value);
+
+	xmmsv_dict_set (d, key, v);
+	xmmsv_unref (v);
+}
+
+static void
+set_int (xmmsv_t *d, const char *key, int value)
+{
+	xmmsv_t *v = xmmsv_new_int (value);
+
+	xmmsv_dict_set (d, key, v);
+	xmmsv_unref (v);
+}
+
+static void
+bench_strbuf_append (int n)
+{
+	while (n--) {
+		strbuf_truncate (sb, 0);
+		strbuf_append (sb, title);
+	}
+}
+
+static void
+bench_strbuf_append_encoded (int n)
+{
+	while (n--) {
+		strbuf_truncate (sb, 0);
+		strbuf_append_encoded (sb, (const uint8_t *) title);
+	}
+}
+
+static void
+bench_now_playing_submission_new (int n)
+{
+	while (n--)
+		submission_unref (now_playing_submission_new (dict));
+}
+
+static void
+bench_profile_submission_new (int n)
+{
+	while (n--)
+		submission_unref (profile_submission_new (dict, 1234567890));
+}
+
+static void
+bench_submission_encode (int n)
+{
+	while (n--) {
+		strbuf_truncate (sb, 0);
+		submission_encode (sb, submission, 0);
+	}
+}
+
+static void
+bench_submission_parse (int n)
+{
+	int length = strlen (line);
+
+	while (n--)
+		submission_unref (submission_parse (NULL, line, length));
+}
+
+/* what submission_clone() used to be for */
+static void
+bench_submission_ref (int n)
+{
+	while (n--)
+		submission_unref (submission_ref (submission));
+}
+
+static void
+bench_queue_push_pop (int n)
+{
+	while (n--) {
+		queue_push (&queue, submission);
+		queue_pop (&queue);
+	}
+}
+
+static void
+bench_ring_push_pop (int n)
+{
+	while (n--) {
+		ring_push (ring, submission);
+		ring_pop (ring);
+	}
+}
+
+static void
+bench_md5 (int n)
+{
+	char out[33];
+
+	while (n--)
+		md5 (title, out);
+}
+
+static const struct {
+	const char *name;
+	void (*func) (int n);
+	int iterations;
+} benchmarks[] = {
+	{ "strbuf_append", bench_strbuf_append, 10000000 },
+	{ "strbuf_append_encoded", bench_strbuf_append_encoded, 2000000 },
+	{ "now_playing_submission_new", bench_now_playing_submission_new,
+	  1000000 },
+	{ "profile_submission_new", bench_profile_submission_new, 1000000 },
+	{ "submission_encode", bench_submission_encode, 1000000 },
+	{ "submission_parse", bench_submission_parse, 1000000 },
+	{ "submission_ref", bench_submission_ref, 10000000 },
+	{ "queue_push_pop", bench_queue_push_pop, 10000000 },
+	{ "ring_push_pop", bench_ring_push_pop, 10000000 },
+	{ "md5", bench_md5, 1000000 }
+};
+
+static double
+now ()
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* the iteration counts are divided by 'argv[1]', if given */
+int
+main (int argc, char **argv)
+{
+	int scale = 1;
+	int count = sizeof (benchmarks) / sizeof (benchmarks[0]);
+
+	if (argc > 1)
+		scale = atoi (argv[1]);
+
+	if (scale < 1)
+		scale = 1;
+
+	dict = xmmsv_new_dict ();
+	set_string (dict, "artist", artist);
+	set_string (dict, "title", title);
+	set_string (dict, "album", album);
+	set_string (dict, "track_id", "c4b1a1c2-9a8e-4f1a-b2d5-1ab0e5d1c8f0");
+	set_int (dict, "duration", 600000);
+
+	sb = strbuf_new ();
+	submission = profile_submission_new (dict, 1234567890);
+	queue_init (&queue);
+	ring = ring_new (256);
+
+	/* keep a backlog, so the queue doesn't hit its empty case */
+	for (int i = 0; i < 100; i++)
+		queue_push (&queue, submission);
+
+	printf ("{\n  \"benchmarks\": [\n");
+
+	for (int i = 0; i < count; i++) {
+		int n = benchmarks[i].iterations / scale;
+		unsigned long allocs;
+		double start, elapsed;
+
+		/* warm up */
+		benchmarks[i].func (n / 10 + 1);
+
+		allocs = allocations;
+		start = now ();
+
+		benchmarks[i].func (n);
+
+		elapsed = now () - start;
+		allocs = allocations - allocs;
+
+		printf ("    { \"name\": \"%s\", \"iterations\": %i, "
+		        "\"ns_per_op\": %.2f, \"allocs_per_op\": %.2f }%s\n",
+		        benchmarks[i].name, n, elapsed * 1e9 / n,
+		        (double) allocs / n, i < count - 1 ? "," : "");
+	}
+
+	printf ("  ]\n}\n");
+
+	queue_clear (&queue);
+	ring_free (ring);
+	submission_unref (submission);
+	strbuf_free (sb);
+	xmmsv_unref (dict);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,167 @@
+/*
+ * Copyright (c) 2009 Tilman Sauerbeck (tilman at xmms org)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* measures how long it takes to load a queue of 10k, 100k and 1M
+ * entries at startup, comparing the journal loader (which maps the
+ * file and doesn't copy the entries) to reading the file line by line
+ * like the plain queue file used to be read.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "journal.h"
+#include "queue.h"
+#include "submission.h"
+
+static double
+now ()
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+write_queue (const char *filename, const char *prefix, int count)
+{
+	FILE *fp;
+
+	fp = fopen (filename, "w");
+
+	for (int i = 0; i < count; i++)
+		fprintf (fp, "%sa[0]=Some+Artist+%i&t[0]=Some+Title&i[0]=%i"
+		         "&o[0]=P&r[0]=&l[0]=240&b[0]=Some+Album&n[0]=&m[0]=\n",
+		         prefix, i, 1234567890 + i);
+
+	fclose (fp);
+}
+
+static void
+free_queue (Queue *q)
+{
+	Submission *s;
+
+	while ((s = queue_pop (q)))
+		submission_unref (s);
+}
+
+static void
+on_line (const char *line, Queue *q)
+{
+	queue_push (q, submission_parse (NULL, line, strlen (line)));
+}
+
+static double
+load_lines (const char *filename, Queue *q)
+{
+	FILE *fp;
+	char buf[4096];
+	double start = now ();
+
+	fp = fopen (filename, "r");
+
+	while (fgets (buf, sizeof (buf), fp)) {
+		buf[strcspn (buf, "\n")] = 0;
+		on_line (buf, q);
+	}
+
+	fclose (fp);
+
+	return now () - start;
+}
+
+static bool
+on_entry (Mapping *mapping, const char *line, int length, void *user_data)
+{
+	queue_push (user_data, submission_parse (mapping, line, length));
+
+	return true;
+}
+
+static double
+load_journal (const char *filename, Queue *q)
+{
+	Journal *j;
+	double start = now (), elapsed;
+
+	j = journal_open (filename, on_entry, q);
+
+	elapsed = now () - start;
+
+	journal_close (j);
+
+	return elapsed;
+}
+
+int
+main (int argc, char **argv)
+{
+	static const int counts[] = { 10000, 100000, 1000000 };
+	const char *tmpdir;
+	char dir[PATH_MAX], filename[PATH_MAX + 16];
+	Queue q;
+
+	tmpdir = getenv ("TMPDIR");
+
+	snprintf (dir, sizeof (dir), "%s/xmms2-scrobbler-bench.XXXXXX",
+	          tmpdir ? tmpdir : "/tmp");
+
+	if (!mkdtemp (dir)) {
+		perror ("mkdtemp");
+		return EXIT_FAILURE;
+	}
+
+	snprintf (filename, sizeof (filename), "%s/queue", dir);
+
+	journal_init (1000);
+	queue_init (&q);
+
+	for (int i = 0; i < sizeof (counts) / sizeof (counts[0]); i++) {
+		double lines, journal;
+
+		write_queue (filename, "", counts[i]);
+		lines = load_lines (filename, &q);
+		free_queue (&q);
+
+		write_queue (filename, "+", counts[i]);
+		journal = load_journal (filename, &q);
+		free_queue (&q);
+
+		printf ("%8i entries: %8.1f ms line by line, "
+		        "%8.1f ms mapped journal\n",
+		        counts[i], lines * 1000, journal * 1000);
+	}
+
+	journal_shutdown ();
+
+	unlink (filename);
+	rmdir (dir);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,213 @@
+/*
+ * Copyright (c) 2009 Tilman Sauerbeck (tilman at xmms org)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* compares the chunked queue against the linked list it replaced. */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "queue.h"
+
+/* the old implementation, one malloc'ed node per item */
+typedef struct __ListItem {
+	struct __ListItem *next;
+
+	void *data;
+} ListItem;
+
+typedef struct {
+	ListItem *head;
+	ListItem *tail;
+} ListQueue;
+
+static void
+list_queue_push (ListQueue *q, void *data)
+{
+	ListItem *item;
+
+	item = malloc (sizeof (ListItem));
+
+	item->next = NULL;
+	item->data = data;
+
+	if (q->tail)
+		q->tail->next = item;
+
+	q->tail = item;
+
+	if (!q->head)
+		q->head = item;
+}
+
+static void *
+list_queue_pop (ListQueue *q)
+{
+	ListItem *item;
+	void *data;
+
+	if (!q->head)
+		return NULL;
+
+	item = q->head;
+	data = item->data;
+
+	q->head = q->head->next;
+
+	if (!q->head)
+		q->tail = NULL;
+
+	free (item);
+
+	return data;
+}
+
+static void *
+list_queue_peek_nth (ListQueue *q, int n)
+{
+	ListItem *item;
+
+	for (item = q->head; item && n > 0; item = item->next)
+		n--;
+
+	return item ? item->data : NULL;
+}
+
+static double
+now ()
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#define DATA(i) ((void *) (intptr_t) ((i) + 1))
+
+/* push 'count' items, then pop them all */
+static void
+fill_drain (int count)
+{
+	ListQueue lq = { NULL, NULL };
+	Queue q;
+	double start, list, chunked;
+
+	start = now ();
+
+	for (int i = 0; i < count; i++)
+		list_queue_push (&lq, DATA (i));
+
+	while (list_queue_pop (&lq))
+		;
+
+	list = now () - start;
+
+	queue_init (&q);
+
+	start = now ();
+
+	for (int i = 0; i < count; i++)
+		queue_push (&q, DATA (i));
+
+	while (queue_pop (&q))
+		;
+
+	chunked = now () - start;
+
+	queue_clear (&q);
+
+	printf ("fill/drain %8i: %6.1f ns/op list, %6.1f ns/op chunked\n",
+	        count, list * 1e9 / (2 * count), chunked * 1e9 / (2 * count));
+}
+
+/* keep 'backlog' items queued while pushing and popping 'count' items,
+ * looking at the first batch of 50 each time like the curl thread does.
+ */
+static void
+steady (int backlog, int count)
+{
+	ListQueue lq = { NULL, NULL };
+	Queue q;
+	double start, list, chunked;
+	intptr_t sum = 0;
+
+	for (int i = 0; i < backlog; i++)
+		list_queue_push (&lq, DATA (i));
+
+	start = now ();
+
+	for (int i = 0; i < count; i++) {
+		for (int n = 0; n < 50; n++)
+			sum += (intptr_t) list_queue_peek_nth (&lq, n);
+
+		list_queue_push (&lq, DATA (i));
+		list_queue_pop (&lq);
+	}
+
+	list = now () - start;
+
+	while (list_queue_pop (&lq))
+		;
+
+	queue_init (&q);
+
+	for (int i = 0; i < backlog; i++)
+		queue_push (&q, DATA (i));
+
+	start = now ();
+
+	for (int i = 0; i < count; i++) {
+		for (int n = 0; n < 50; n++)
+			sum -= (intptr_t) queue_peek_nth (&q, n);
+
+		queue_push (&q, DATA (i));
+		queue_pop (&q);
+	}
+
+	chunked = now () - start;
+
+	queue_clear (&q);
+
+	if (sum)
+		fprintf (stderr, "queues disagree\n");
+
+	printf ("steady     %8i: %6.1f ns/op list, %6.1f ns/op chunked\n",
+	        backlog, list * 1e9 / count, chunked * 1e9 / count);
+}
+
+int
+main (int argc, char **argv)
+{
+	int count = 1000000;
+
+	if (argc > 1)
+		count = atoi (argv[1]);
+
+	fill_drain (count);
+	steady (1000, count);
+	steady (100000, count);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,49 @@
+#!/bin/sh
+#
+# replay load test: writes a synthetic trace of N tracks, feeds it to
+# "xmms2-scrobbler --replay --fast" and lets it send the scrobbles to
+# the stand-in server in bin/as-server. prints how fast the events were
+# handled and the server's accounting.
+#
+# usage: replay.sh [N [ENGINE [AS-SERVER OPTIONS...]]]
+#
+# ENGINE is "threads", "multi" or "pool". PORT sets the port to use. TRACE
+# replays the given trace instead of a synthetic one, eg one that was
+# written by "xmms2-scrobbler --record FILE".
+
+set -e
+
+count=${1:-10000}
+engine=${2:-threads}
+[ $# -gt 0 ] && shift
+[ $# -gt 0 ] && shift
+
+port=${PORT:-18190}
+dir=$(mktemp -d "${TMPDIR:-/tmp}/xmms2-scrobbler-replay.XXXXXX")
+conf=$dir/xmms2/clients/xmms2-scrobbler
+trace=${TRACE:-$dir/trace}
+
+trap 'rm -rf "$dir"' EXIT
+
+mkdir -p "$conf/standin"
+
+printf 'engine: %s\nrequest_timeout: 2\n' "$engine" > "$conf/config"
+printf 'user: bench\npassword: bench\nhandshake_url: http://127.0.0.1:%s/\n' \
+       "$port" > "$conf/standin/config"
+
+[ -n "$TRACE" ] || bin/trace-gen "$trace" "$count"
+
+bin/as-server -p "$port" -P "$dir/pid" "$@" > "$dir/stats" &
+server=$!
+
+while [ ! -s "$dir/pid" ]; do
+	kill -0 $server
+	sleep 0.05
+done
+
+XDG_CONFIG_HOME=$dir bin/xmms2-scrobbler --replay "$trace" --fast
+
+kill -INT $server
+wait $server
+
+cat "$dir/stats"
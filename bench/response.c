@@ -0,0 +1,336 @@
+/*
+ * Copyright (c) 2009 Tilman Sauerbeck (tilman at xmms org)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* checks that the response parser gives the same result no matter how
+ * a response is split into pieces, then measures its throughput.
+ *
+ * the inputs are the files in bench/corpus/response (or the ones given
+ * on the command line) and random mutations of them. the first byte of
+ * each file selects the response type ('h' for a handshake, anything
+ * else for a submission), the rest is the body.
+ *
+ * built with -DFUZZING, this is a libFuzzer target instead, see
+ * "make fuzz-response".
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+
+#include "response.h"
+
+#define MAX_INPUT_SIZE 4096
+#define MAX_INPUTS 256
+#define MUTATIONS 20000
+
+typedef struct {
+	ResponseStatus status;
+	char lines[RESPONSE_LINES][RESPONSE_MAX_LINE];
+} Result;
+
+static void
+parse (const uint8_t *data, size_t size, const size_t *splits,
+       int n_splits, Result *result)
+{
+	ResponseParser p;
+	size_t pos = 0;
+
+	response_parser_init (&p, (size && data[0] == 'h')
+	                          ? RESPONSE_HANDSHAKE : RESPONSE_SUBMISSION);
+
+	if (size) {
+		data++;
+		size--;
+	}
+
+	for (int i = 0; i < n_splits; i++) {
+		size_t split = splits[i] > size ? size : splits[i];
+
+		if (split < pos)
+			continue;
+
+		response_parser_feed (&p, (const char *) data + pos,
+		                      split - pos);
+		pos = split;
+	}
+
+	response_parser_feed (&p, (const char *) data + pos, size - pos);
+
+	result->status = response_parser_finish (&p, true);
+	memcpy (result->lines, p.lines, sizeof (p.lines));
+
+	for (int i = 0; i < RESPONSE_LINES; i++)
+		if (!memchr (p.lines[i], 0, RESPONSE_MAX_LINE))
+			abort ();
+}
+
+static int
+compare (const Result *a, const Result *b)
+{
+	if (a->status != b->status)
+		return 1;
+
+	for (int i = 0; i < RESPONSE_LINES; i++)
+		if (strcmp (a->lines[i], b->lines[i]))
+			return 1;
+
+	return 0;
+}
+
+/* parses 'data' whole, byte by byte and split in two at every
+ * position. returns the number of mismatches.
+ */
+static int
+check (const uint8_t *data, size_t size)
+{
+	Result whole, other;
+	static size_t splits[MAX_INPUT_SIZE];
+	int errors = 0;
+
+	parse (data, size, NULL, 0, &whole);
+
+	/* after the type byte, every piece is a single byte */
+	for (size_t i = 0; i < size; i++)
+		splits[i] = i + 1;
+
+	parse (data, size, splits, size, &other);
+	errors += compare (&whole, &other);
+
+	for (size_t i = 0; i < size; i++) {
+		parse (data, size, &i, 1, &other);
+		errors += compare (&whole, &other);
+	}
+
+	return errors;
+}
+
+#ifdef FUZZING
+
+int
+LLVMFuzzerTestOneInput (const uint8_t *data, size_t size)
+{
+	if (size > MAX_INPUT_SIZE)
+		return 0;
+
+	if (check (data, size))
+		abort ();
+
+	return 0;
+}
+
+#else
+
+static uint8_t *inputs[MAX_INPUTS];
+static size_t sizes[MAX_INPUTS];
+static int n_inputs;
+
+static void
+load (const char *filename)
+{
+	FILE *fp;
+	uint8_t buf[MAX_INPUT_SIZE];
+	size_t size;
+
+	if (n_inputs == MAX_INPUTS)
+		return;
+
+	fp = fopen (filename, "rb");
+
+	if (!fp) {
+		fprintf (stderr, "cannot open %s\n", filename);
+		return;
+	}
+
+	size = fread (buf, 1, sizeof (buf), fp);
+	fclose (fp);
+
+	inputs[n_inputs] = malloc (size ? size : 1);
+	memcpy (inputs[n_inputs], buf, size);
+	sizes[n_inputs++] = size;
+}
+
+static void
+load_dir (const char *dir)
+{
+	struct dirent *dirent;
+	char filename[1024];
+	DIR *dp;
+
+	dp = opendir (dir);
+
+	if (!dp) {
+		fprintf (stderr, "cannot open %s\n", dir);
+		return;
+	}
+
+	while ((dirent = readdir (dp))) {
+		if (dirent->d_name[0] == '.')
+			continue;
+
+		snprintf (filename, sizeof (filename), "%s/%s",
+		          dir, dirent->d_name);
+		load (filename);
+	}
+
+	closedir (dp);
+}
+
+/* replaces, inserts or removes a few bytes. newlines, '\r' and the
+ * status words are likely, so that the mutations are interesting.
+ */
+static size_t
+mutate (uint8_t *buf, size_t size)
+{
+	static const char bytes[] = "\n\r\n OKFAILEDBADSESSION\0x";
+	int n = 1 + rand () % 4;
+
+	for (int i = 0; i < n; i++) {
+		size_t pos = size ? rand () % size : 0;
+		uint8_t c = bytes[rand () % (sizeof (bytes) - 1)];
+
+		switch (rand () % 4) {
+			case 0:
+				if (size)
+					buf[pos] = c;
+				break;
+			case 1:
+				if (size < MAX_INPUT_SIZE) {
+					memmove (buf + pos + 1, buf + pos,
+					         size - pos);
+					buf[pos] = c;
+					size++;
+				}
+				break;
+			case 2:
+				if (size > 1) {
+					memmove (buf + pos, buf + pos + 1,
+					         size - pos - 1);
+					size--;
+				}
+				break;
+			default:
+				/* a long line */
+				while (size < MAX_INPUT_SIZE && rand () % 64)
+					buf[size++] = 'a' + rand () % 26;
+				break;
+		}
+	}
+
+	return size;
+}
+
+static double
+now ()
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+measure (const char *name, const char *body, size_t piece, int iterations)
+{
+	size_t length = strlen (body);
+	double start, elapsed;
+	ResponseParser p;
+	int ok = 0;
+
+	start = now ();
+
+	for (int i = 0; i < iterations; i++) {
+		response_parser_init (&p, name[0] == 'h' ? RESPONSE_HANDSHAKE
+		                                         : RESPONSE_SUBMISSION);
+
+		for (size_t pos = 0; pos < length; pos += piece)
+			response_parser_feed (&p, body + pos,
+			                      length - pos < piece
+			                      ? length - pos : piece);
+
+		ok += response_parser_finish (&p, true) == RESPONSE_OK;
+	}
+
+	elapsed = now () - start;
+
+	if (ok != iterations)
+		printf ("%-20s unexpected result\n", name);
+	else
+		printf ("%-20s pieces of %4zu bytes: %7.1f ns per response\n",
+		        name, piece, elapsed * 1e9 / iterations);
+}
+
+int
+main (int argc, char **argv)
+{
+	static const char handshake[] =
+		"OK\n"
+		"17E61E13454CDD8B68E8D7DEEEDF6170\n"
+		"http://post.audioscrobbler.com:80/np_1.2\n"
+		"http://post2.audioscrobbler.com:80/protocol_1.2\n";
+	uint8_t buf[MAX_INPUT_SIZE];
+	int errors = 0, iterations = 2000000;
+
+	if (argc > 1)
+		for (int i = 1; i < argc; i++)
+			load (argv[i]);
+	else
+		load_dir ("bench/corpus/response");
+
+	for (int i = 0; i < n_inputs; i++)
+		errors += check (inputs[i], sizes[i]);
+
+	srand (1);
+
+	for (int i = 0; n_inputs && i < MUTATIONS && errors < 10; i++) {
+		int j = rand () % n_inputs;
+		size_t size;
+
+		memcpy (buf, inputs[j], sizes[j]);
+		size = mutate (buf, sizes[j]);
+
+		errors += check (buf, size);
+	}
+
+	printf ("%i inputs, %i mutations: %s\n", n_inputs, MUTATIONS,
+	        errors ? "MISMATCH" : "ok");
+
+	if (errors)
+		return EXIT_FAILURE;
+
+	measure ("handshake", handshake, 4096, iterations);
+	measure ("handshake", handshake, 16, iterations);
+	measure ("handshake", handshake, 1, iterations / 10);
+	measure ("submission", "OK\n", 4096, iterations);
+	measure ("submission", "OK\n", 1, iterations);
+
+	for (int i = 0; i < n_inputs; i++)
+		free (inputs[i]);
+
+	return EXIT_SUCCESS;
+}
+
+#endif
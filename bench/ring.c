@@ -0,0 +1,226 @@
+/*
+ * Copyright (c) 2009 Tilman Sauerbeck (tilman at xmms org)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* measures how long it takes the xmms2 thread to hand a submission to
+ * a server's thread, with the ring and with the mutex/condvar protected
+ * queue it replaced. the consumer behaves like curl_thread() did.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "queue.h"
+#include "ring.h"
+
+#define BURST 64
+
+typedef struct {
+	Queue queue;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	bool shutdown;
+} Locked;
+
+static uint64_t
+now_ns ()
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void *
+locked_consumer (void *arg)
+{
+	Locked *l = arg;
+
+	pthread_mutex_lock (&l->mutex);
+
+	while (!l->shutdown) {
+		if (!queue_peek (&l->queue)) {
+			pthread_cond_wait (&l->cond, &l->mutex);
+			continue;
+		}
+
+		pthread_mutex_unlock (&l->mutex);
+
+		while (true) {
+			void *data;
+			bool shutdown;
+
+			pthread_mutex_lock (&l->mutex);
+			data = queue_peek (&l->queue);
+			shutdown = l->shutdown;
+			pthread_mutex_unlock (&l->mutex);
+
+			if (!data || shutdown)
+				break;
+
+			pthread_mutex_lock (&l->mutex);
+			queue_pop (&l->queue);
+			pthread_mutex_unlock (&l->mutex);
+		}
+
+		pthread_mutex_lock (&l->mutex);
+	}
+
+	pthread_mutex_unlock (&l->mutex);
+
+	return NULL;
+}
+
+static void
+locked_push (void *arg, void *data)
+{
+	Locked *l = arg;
+
+	pthread_mutex_lock (&l->mutex);
+	queue_push (&l->queue, data);
+	pthread_cond_signal (&l->cond);
+	pthread_mutex_unlock (&l->mutex);
+}
+
+static bool ring_shutdown;
+
+static void *
+ring_consumer (void *arg)
+{
+	Ring *r = arg;
+
+	while (!__atomic_load_n (&ring_shutdown, __ATOMIC_ACQUIRE)) {
+		if (!ring_pop (r))
+			ring_wait (r, -1);
+	}
+
+	return NULL;
+}
+
+static void
+ring_push_cb (void *arg, void *data)
+{
+	ring_push (arg, data);
+}
+
+static int
+compare (const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+/* pushes 'count' items in bursts, pausing for 'pause' microseconds
+ * between bursts so that the consumer gets to sleep.
+ */
+static void
+run (const char *name, void (*push) (void *, void *), void *arg,
+     int count, int pause)
+{
+	uint32_t *latencies = malloc (count * sizeof (uint32_t));
+	uint64_t start = now_ns (), elapsed;
+
+	for (int i = 0; i < count; i++) {
+		uint64_t t = now_ns ();
+
+		push (arg, (void *) (intptr_t) (i + 1));
+		latencies[i] = now_ns () - t;
+
+		if (pause && i % BURST == BURST - 1) {
+			struct timespec ts = { 0, pause * 1000 };
+
+			nanosleep (&ts, NULL);
+		}
+	}
+
+	elapsed = now_ns () - start;
+
+	qsort (latencies, count, sizeof (uint32_t), compare);
+
+	printf ("%-6s pause %3ius: p50 %6u ns, p99 %6u ns, p99.9 %7u ns, "
+	        "max %8u ns, %6.2f Mops/s\n", name, pause,
+	        latencies[count / 2], latencies[count / 100 * 99],
+	        latencies[count / 1000 * 999], latencies[count - 1],
+	        count * 1e3 / elapsed);
+
+	free (latencies);
+}
+
+static void
+bench (int count, int pause)
+{
+	pthread_t thread;
+	Locked l;
+	Ring *r;
+
+	queue_init (&l.queue);
+	pthread_mutex_init (&l.mutex, NULL);
+	pthread_cond_init (&l.cond, NULL);
+	l.shutdown = false;
+
+	pthread_create (&thread, NULL, locked_consumer, &l);
+	run ("mutex", locked_push, &l, count, pause);
+
+	pthread_mutex_lock (&l.mutex);
+	l.shutdown = true;
+	pthread_cond_signal (&l.cond);
+	pthread_mutex_unlock (&l.mutex);
+	pthread_join (thread, NULL);
+
+	queue_clear (&l.queue);
+	pthread_mutex_destroy (&l.mutex);
+	pthread_cond_destroy (&l.cond);
+
+	r = ring_new (256);
+	ring_shutdown = false;
+
+	pthread_create (&thread, NULL, ring_consumer, r);
+	run ("ring", ring_push_cb, r, count, pause);
+
+	__atomic_store_n (&ring_shutdown, true, __ATOMIC_RELEASE);
+	ring_wake (r);
+	pthread_join (thread, NULL);
+
+	printf ("%-6s %lu overflowed\n", "", r->overflowed);
+
+	ring_free (r);
+}
+
+int
+main (int argc, char **argv)
+{
+	int count = 1000000;
+
+	if (argc > 1)
+		count = atoi (argv[1]);
+
+	bench (count, 0);
+	bench (count / 10, 50);
+
+	return EXIT_SUCCESS;
+}
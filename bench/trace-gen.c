@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2009 Tilman Sauerbeck (tilman at xmms org)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* writes a synthetic trace for "xmms2-scrobbler --replay": 'count'
+ * tracks, most of which are played long enough to be scrobbled, some
+ * paused in between and some skipped right away.
+ *
+ * usage: trace-gen FILE [COUNT [SEED]]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <xmmsclient/xmmsclient.h>
+
+#include "trace.h"
+
+/* 2009-02-13, so that the timestamps are the same on every run */
+#define STARTED 1234567890000LL
+
+static void
+set_property (xmmsv_t *propdict, const char *key, xmmsv_t *value)
+{
+	xmmsv_t *sources = xmmsv_new_dict ();
+
+	xmmsv_dict_set (sources, "plugin/id3v2", value);
+	xmmsv_dict_set (propdict, key, sources);
+
+	xmmsv_unref (value);
+	xmmsv_unref (sources);
+}
+
+static xmmsv_t *
+make_info (int id, int duration)
+{
+	xmmsv_t *info = xmmsv_new_dict ();
+	char buf[64];
+
+	snprintf (buf, sizeof (buf), "Artist %i", id % 500);
+	set_property (info, "artist", xmmsv_new_string (buf));
+
+	snprintf (buf, sizeof (buf), "Title %i", id);
+	set_property (info, "title", xmmsv_new_string (buf));
+
+	snprintf (buf, sizeof (buf), "Album %i", id % 2000);
+	set_property (info, "album", xmmsv_new_string (buf));
+
+	set_property (info, "duration", xmmsv_new_int (duration));
+
+	return info;
+}
+
+static void
+write_event (TraceWriter *w, TraceEventType type, int64_t time,
+             int32_t value, xmmsv_t *info)
+{
+	TraceEvent event = { type, time, value, info };
+
+	if (!trace_write (w, &event)) {
+		perror ("write");
+		exit (EXIT_FAILURE);
+	}
+}
+
+int
+main (int argc, char **argv)
+{
+	TraceWriter *w;
+	int64_t time = 0;
+	int count = 10000;
+
+	if (argc < 2) {
+		fprintf (stderr, "usage: %s FILE [COUNT [SEED]]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (argc > 2)
+		count = atoi (argv[2]);
+
+	srand (argc > 3 ? atoi (argv[3]) : 1);
+
+	w = trace_writer_new (argv[1], STARTED);
+
+	if (!w) {
+		perror (argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	write_event (w, TRACE_PLAYBACK_STATUS, time,
+	             XMMS_PLAYBACK_STATUS_PLAY, NULL);
+
+	for (int id = 1; id <= count; id++) {
+		int duration = (120 + rand () % 240) * 1000;
+		int played = duration;
+		xmmsv_t *info;
+
+		write_event (w, TRACE_CURRENT_ID, time, id, NULL);
+
+		info = make_info (id, duration);
+		write_event (w, TRACE_MEDIALIB_INFO, time + 5, id, info);
+		xmmsv_unref (info);
+
+		switch (rand () % 10) {
+			case 0:
+				/* skipped */
+				played = 2000;
+				break;
+			case 1:
+				/* paused for a minute halfway through */
+				write_event (w, TRACE_PLAYBACK_STATUS,
+				             time + duration / 2,
+				             XMMS_PLAYBACK_STATUS_PAUSE, NULL);
+				write_event (w, TRACE_PLAYBACK_STATUS,
+				             time + duration / 2 + 60000,
+				             XMMS_PLAYBACK_STATUS_PLAY, NULL);
+				played += 60000;
+				break;
+		}
+
+		time += played;
+	}
+
+	write_event (w, TRACE_PLAYBACK_STATUS, time,
+	             XMMS_PLAYBACK_STATUS_STOP, NULL);
+
+	trace_writer_free (w);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,145 @@
+/*
+ * Copyright (c) 2009 Tilman Sauerbeck (tilman at xmms org)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+
+#include "dedup.h"
+
+#define INITIAL_SIZE 1024
+
+DedupSet *
+dedup_set_new (void)
+{
+	DedupSet *set;
+
+	set = malloc (sizeof (DedupSet));
+	set->slots = calloc (INITIAL_SIZE, sizeof (uint64_t));
+	set->mask = INITIAL_SIZE - 1;
+	set->count = 0;
+
+	return set;
+}
+
+void
+dedup_set_free (DedupSet *set)
+{
+	free (set->slots);
+	free (set);
+}
+
+static uint64_t *
+find_slot (uint64_t *slots, unsigned int mask, uint64_t hash)
+{
+	unsigned int i = hash & mask;
+
+	/* linear probing, there's always a free slot */
+	while (slots[i] && slots[i] != hash)
+		i = (i + 1) & mask;
+
+	return &slots[i];
+}
+
+static void
+grow (DedupSet *set)
+{
+	unsigned int mask = set->mask * 2 + 1;
+	uint64_t *slots = calloc (mask + 1, sizeof (uint64_t));
+
+	for (unsigned int i = 0; i <= set->mask; i++)
+		if (set->slots[i])
+			*find_slot (slots, mask, set->slots[i]) = set->slots[i];
+
+	free (set->slots);
+	set->slots = slots;
+	set->mask = mask;
+}
+
+/* 0 marks empty slots, so it's mapped to another value */
+static uint64_t
+fix_hash (uint64_t hash)
+{
+	return hash ? hash : 1;
+}
+
+/* returns false if 'hash' is in the set already */
+bool
+dedup_set_add (DedupSet *set, uint64_t hash)
+{
+	uint64_t *slot;
+
+	hash = fix_hash (hash);
+	slot = find_slot (set->slots, set->mask, hash);
+
+	if (*slot)
+		return false;
+
+	*slot = hash;
+
+	/* keep the load factor below 3/4 */
+	if (++set->count * 4 > (set->mask + 1) * 3)
+		grow (set);
+
+	return true;
+}
+
+bool
+dedup_set_contains (DedupSet *set, uint64_t hash)
+{
+	return !!*find_slot (set->slots, set->mask, fix_hash (hash));
+}
+
+void
+dedup_set_remove (DedupSet *set, uint64_t hash)
+{
+	uint64_t *slot = find_slot (set->slots, set->mask, fix_hash (hash));
+	unsigned int hole, i;
+
+	if (!*slot)
+		return;
+
+	/* move the following entries of the cluster back if the hole
+	 * is on their probe path, so that no tombstones are needed.
+	 */
+	hole = i = slot - set->slots;
+
+	for (;;) {
+		unsigned int home;
+
+		i = (i + 1) & set->mask;
+
+		if (!set->slots[i])
+			break;
+
+		home = set->slots[i] & set->mask;
+
+		/* is 'home' cyclically outside of (hole, i]? */
+		if ((i > hole && (home <= hole || home > i)) ||
+		    (i < hole && home <= hole && home > i)) {
+			set->slots[hole] = set->slots[i];
+			hole = i;
+		}
+	}
+
+	set->slots[hole] = 0;
+	set->count--;
+}
@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2009 Tilman Sauerbeck (tilman at xmms org)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _DEDUP_H
+#define _DEDUP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* a set of submission hashes (see submission_hash()), used to spot
+ * submissions that are queued already.
+ * it's an open addressing hash table; 0 marks an empty slot.
+ */
+typedef struct {
+	uint64_t *slots;
+	unsigned int mask;
+	unsigned int count;
+} DedupSet;
+
+DedupSet *dedup_set_new (void);
+void dedup_set_free (DedupSet *set);
+bool dedup_set_add (DedupSet *set, uint64_t hash);
+bool dedup_set_contains (DedupSet *set, uint64_t hash);
+void dedup_set_remove (DedupSet *set, uint64_t hash);
+
+#endif
@@ -0,0 +1,644 @@
+/*
+ * Copyright (c) 2009 Tilman Sauerbeck (tilman at xmms org)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* parses listening history for "xmms2-scrobbler --import".
+ *
+ * every line is either tab separated:
+ *   artist, title, album, duration, timestamp[, musicbrainz id]
+ * or a JSON object with the keys artist, title, album, duration,
+ * timestamp and optionally mbid. durations are in seconds, timestamps
+ * are unix time. empty lines and lines starting with '#' are skipped.
+ *
+ * the file is split into chunks which are parsed, encoded and hashed
+ * by a number of worker threads, while the calling thread hands the
+ * results to the caller in file order.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "import.h"
+#include "submission.h"
+
+#define CHUNK_SIZE (256 * 1024)
+
+/* number of chunks per worker that may be parsed ahead of the caller */
+#define CHUNKS_AHEAD 4
+
+typedef enum {
+	FIELD_ARTIST,
+	FIELD_TITLE,
+	FIELD_ALBUM,
+	FIELD_MBID,
+	FIELD_COUNT
+} Field;
+
+typedef struct {
+	/* offsets into the scratch buffer, -1 if the field is missing */
+	int fields[FIELD_COUNT];
+	long long duration;
+	long long timestamp;
+} Entry;
+
+typedef struct {
+	Submission *submission;
+	uint64_t hash;
+	int offset, length; /* of the encoded entry in the chunk's 'out' */
+} ParsedEntry;
+
+typedef struct {
+	const char *start, *end;
+
+	StrBuf *out; /* the encoded entries, back to back */
+	ParsedEntry *entries;
+	int count, allocated;
+	ImportStats stats;
+	bool done;
+} Chunk;
+
+typedef struct {
+	Chunk *chunks;
+	int count;
+	int next; /* the next chunk to parse */
+	int consumed; /* chunks that have been passed to the caller */
+	int window;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+} Import;
+
+static void
+entry_init (Entry *e)
+{
+	for (int i = 0; i < FIELD_COUNT; i++)
+		e->fields[i] = -1;
+
+	e->duration = e->timestamp = -1;
+}
+
+/* copies 'length' bytes of 'data' to 'scratch' and returns the offset */
+static int
+store (StrBuf *scratch, const char *data, int length)
+{
+	int offset = scratch->length;
+
+	strbuf_append_len (scratch, data, length);
+	strbuf_append_len (scratch, "", 1);
+
+	return offset;
+}
+
+static bool
+parse_integer (const char *p, int length, long long *value)
+{
+	long long v = 0;
+
+	if (!length || length > 18)
+		return false;
+
+	for (int i = 0; i < length; i++) {
+		if (p[i] < '0' || p[i] > '9')
+			return false;
+
+		v = v * 10 + p[i] - '0';
+	}
+
+	*value = v;
+
+	return true;
+}
+
+static bool
+parse_tsv (const char *line, int length, StrBuf *scratch, Entry *e)
+{
+	static const Field string_columns[] = {
+		FIELD_ARTIST, FIELD_TITLE, FIELD_ALBUM
+	};
+	const char *p = line, *end = line + length;
+	int column;
+
+	for (column = 0; column < 6; column++) {
+		const char *tab = memchr (p, '\t', end - p);
+		int len;
+
+		if (!tab)
+			tab = end;
+
+		len = tab - p;
+
+		if (column < 3)
+			e->fields[string_columns[column]] = store (scratch, p, len);
+		else if (column == 3 && !parse_integer (p, len, &e->duration))
+			return false;
+		else if (column == 4 && !parse_integer (p, len, &e->timestamp))
+			return false;
+		else if (column == 5)
+			e->fields[FIELD_MBID] = store (scratch, p, len);
+
+		if (tab == end)
+			break;
+
+		p = tab + 1;
+	}
+
+	return column >= 4;
+}
+
+static const char *
+skip_space (const char *p, const char *end)
+{
+	while (p < end && (*p == ' ' || *p == '\t'))
+		p++;
+
+	return p;
+}
+
+static int
+hex_value (char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+
+	return -1;
+}
+
+static bool
+parse_hex4 (const char *p, const char *end, unsigned int *value)
+{
+	*value = 0;
+
+	if (end - p < 4)
+		return false;
+
+	for (int i = 0; i < 4; i++) {
+		int v = hex_value (p[i]);
+
+		if (v < 0)
+			return false;
+
+		*value = *value * 16 + v;
+	}
+
+	return true;
+}
+
+static void
+append_utf8 (StrBuf *sb, unsigned int c)
+{
+	char buf[4];
+	int n;
+
+	if (c < 0x80) {
+		buf[0] = c;
+		n = 1;
+	} else if (c < 0x800) {
+		buf[0] = 0xc0 | (c >> 6);
+		buf[1] = 0x80 | (c & 0x3f);
+		n = 2;
+	} else if (c < 0x10000) {
+		buf[0] = 0xe0 | (c >> 12);
+		buf[1] = 0x80 | ((c >> 6) & 0x3f);
+		buf[2] = 0x80 | (c & 0x3f);
+		n = 3;
+	} else {
+		buf[0] = 0xf0 | (c >> 18);
+		buf[1] = 0x80 | ((c >> 12) & 0x3f);
+		buf[2] = 0x80 | ((c >> 6) & 0x3f);
+		buf[3] = 0x80 | (c & 0x3f);
+		n = 4;
+	}
+
+	strbuf_append_len (sb, buf, n);
+}
+
+/* parses the JSON string at 'p', which points at the opening quote,
+ * and stores it unescaped in 'scratch'.
+ * returns a pointer to the first character after the string, or NULL
+ * if it's invalid.
+ */
+static const char *
+parse_string (const char *p, const char *end, StrBuf *scratch, int *offset)
+{
+	*offset = scratch->length;
+
+	for (p++; p < end; ) {
+		const char *special = p;
+		unsigned int c, low;
+
+		while (special < end && *special != '"' && *special != '\\')
+			special++;
+
+		strbuf_append_len (scratch, p, special - p);
+		p = special;
+
+		if (p == end)
+			return NULL;
+
+		if (*p == '"') {
+			/* the strings are used as C strings */
+			if (memchr (scratch->buf + *offset, 0,
+			            scratch->length - *offset))
+				return NULL;
+
+			strbuf_append_len (scratch, "", 1);
+
+			return p + 1;
+		}
+
+		if (++p == end)
+			return NULL;
+
+		switch (*p++) {
+			case '"': strbuf_append_len (scratch, "\"", 1); break;
+			case '\\': strbuf_append_len (scratch, "\\", 1); break;
+			case '/': strbuf_append_len (scratch, "/", 1); break;
+			case 'b': strbuf_append_len (scratch, "\b", 1); break;
+			case 'f': strbuf_append_len (scratch, "\f", 1); break;
+			case 'n': strbuf_append_len (scratch, "\n", 1); break;
+			case 'r': strbuf_append_len (scratch, "\r", 1); break;
+			case 't': strbuf_append_len (scratch, "\t", 1); break;
+			case 'u':
+				if (!parse_hex4 (p, end, &c))
+					return NULL;
+
+				p += 4;
+
+				/* surrogate pairs */
+				if (c >= 0xdc00 && c <= 0xdfff)
+					return NULL;
+
+				if (c >= 0xd800 && c <= 0xdbff) {
+					if (end - p < 6 || p[0] != '\\' || p[1] != 'u' ||
+					    !parse_hex4 (p + 2, end, &low) ||
+					    low < 0xdc00 || low > 0xdfff)
+						return NULL;
+
+					c = 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00);
+					p += 6;
+				}
+
+				append_utf8 (scratch, c);
+				break;
+			default:
+				return NULL;
+		}
+	}
+
+	return NULL;
+}
+
+/* parses the number at 'p'. only the integer part is kept. */
+static const char *
+parse_number (const char *p, const char *end, long long *value)
+{
+	const char *start = p;
+	char buf[32];
+
+	double d;
+
+	while (p < end && *p && strchr ("0123456789+-.eE", *p))
+		p++;
+
+	if (p == start || p - start >= sizeof (buf))
+		return NULL;
+
+	memcpy (buf, start, p - start);
+	buf[p - start] = 0;
+
+	d = strtod (buf, NULL);
+
+	if (!(d > -1e18 && d < 1e18))
+		return NULL;
+
+	*value = d;
+
+	return p;
+}
+
+static const char *
+skip_literal (const char *p, const char *end)
+{
+	static const char *literals[] = { "true", "false", "null" };
+
+	for (int i = 0; i < 3; i++) {
+		int len = strlen (literals[i]);
+
+		if (end - p >= len && !memcmp (p, literals[i], len))
+			return p + len;
+	}
+
+	return NULL;
+}
+
+static bool
+parse_json (const char *line, int length, StrBuf *scratch, Entry *e)
+{
+	const char *p = line + 1, *end = line + length;
+
+	for (;;) {
+		int key, value;
+		long long *number = NULL;
+		int *string = NULL;
+
+		p = skip_space (p, end);
+
+		if (p == end || *p != '"')
+			return false;
+
+		p = parse_string (p, end, scratch, &key);
+
+		if (!p)
+			return false;
+
+		if (!strcmp (scratch->buf + key, "artist"))
+			string = &e->fields[FIELD_ARTIST];
+		else if (!strcmp (scratch->buf + key, "title"))
+			string = &e->fields[FIELD_TITLE];
+		else if (!strcmp (scratch->buf + key, "album"))
+			string = &e->fields[FIELD_ALBUM];
+		else if (!strcmp (scratch->buf + key, "mbid"))
+			string = &e->fields[FIELD_MBID];
+		else if (!strcmp (scratch->buf + key, "duration"))
+			number = &e->duration;
+		else if (!strcmp (scratch->buf + key, "timestamp"))
+			number = &e->timestamp;
+
+		/* the key isn't needed anymore */
+		strbuf_truncate (scratch, key);
+
+		p = skip_space (p, end);
+
+		if (p == end || *p++ != ':')
+			return false;
+
+		p = skip_space (p, end);
+
+		if (p == end)
+			return false;
+
+		if (*p == '"') {
+			p = parse_string (p, end, scratch, &value);
+
+			if (p && string)
+				*string = value;
+			else if (p)
+				strbuf_truncate (scratch, value);
+		} else if (*p == '-' || (*p >= '0' && *p <= '9')) {
+			long long v;
+
+			p = parse_number (p, end, &v);
+
+			if (p && number)
+				*number = v;
+		} else {
+			/* nested objects and arrays aren't supported */
+			p = skip_literal (p, end);
+		}
+
+		if (!p)
+			return false;
+
+		p = skip_space (p, end);
+
+		if (p == end)
+			return false;
+
+		if (*p == '}')
+			return skip_space (p + 1, end) == end;
+
+		if (*p++ != ',')
+			return false;
+	}
+}
+
+/* parses a single line and adds the submission to 'chunk'. */
+static bool
+import_line (const char *line, int length, StrBuf *scratch, Chunk *chunk)
+{
+	ParsedEntry *entry;
+	Submission *submission;
+	const char *fields[FIELD_COUNT];
+	Entry e;
+	bool ok;
+
+	entry_init (&e);
+	strbuf_truncate (scratch, 0);
+
+	if (*line == '{')
+		ok = parse_json (line, length, scratch, &e);
+	else
+		ok = parse_tsv (line, length, scratch, &e);
+
+	if (!ok || e.fields[FIELD_ARTIST] == -1 || e.fields[FIELD_TITLE] == -1 ||
+	    e.duration <= 0 || e.duration > 0x7fffffff || e.timestamp <= 0)
+		return false;
+
+	for (int i = 0; i < FIELD_COUNT; i++)
+		fields[i] = (e.fields[i] == -1) ? NULL : scratch->buf + e.fields[i];
+
+	submission = profile_submission_from_fields (fields, e.duration,
+	                                             e.timestamp);
+
+	if (!submission)
+		return false;
+
+	if (chunk->count == chunk->allocated) {
+		chunk->allocated = chunk->allocated ? chunk->allocated * 2 : 1024;
+		chunk->entries = realloc (chunk->entries,
+		                          chunk->allocated * sizeof (ParsedEntry));
+	}
+
+	entry = &chunk->entries[chunk->count++];
+	entry->submission = submission;
+	entry->hash = submission_hash (submission);
+	entry->offset = chunk->out->length;
+
+	submission_encode (chunk->out, submission, 0);
+	entry->length = chunk->out->length - entry->offset;
+
+	return true;
+}
+
+static void
+parse_chunk (Chunk *chunk, StrBuf *scratch)
+{
+	const char *p = chunk->start;
+
+	chunk->out = strbuf_new ();
+
+	while (p < chunk->end) {
+		const char *newline = memchr (p, '\n', chunk->end - p);
+		const char *eol = newline ? newline : chunk->end;
+		int length = eol - p;
+
+		if (length && p[length - 1] == '\r')
+			length--;
+
+		if (length && *p != '#') {
+			chunk->stats.lines++;
+
+			if (import_line (p, length, scratch, chunk))
+				chunk->stats.entries++;
+			else
+				chunk->stats.invalid++;
+		}
+
+		p = eol + 1;
+	}
+}
+
+static void *
+worker (void *arg)
+{
+	Import *import = arg;
+	StrBuf *scratch = strbuf_new ();
+
+	pthread_mutex_lock (&import->mutex);
+
+	for (;;) {
+		Chunk *chunk;
+
+		/* don't get too far ahead of the caller */
+		while (import->next < import->count &&
+		       import->next >= import->consumed + import->window)
+			pthread_cond_wait (&import->cond, &import->mutex);
+
+		if (import->next == import->count)
+			break;
+
+		chunk = &import->chunks[import->next++];
+
+		pthread_mutex_unlock (&import->mutex);
+		parse_chunk (chunk, scratch);
+		pthread_mutex_lock (&import->mutex);
+
+		chunk->done = true;
+		pthread_cond_broadcast (&import->cond);
+	}
+
+	pthread_mutex_unlock (&import->mutex);
+
+	strbuf_free (scratch);
+
+	return NULL;
+}
+
+static void
+split_chunks (Import *import, const char *data, size_t length)
+{
+	size_t pos = 0;
+	int allocated = length / CHUNK_SIZE + 1;
+
+	import->chunks = calloc (allocated, sizeof (Chunk));
+	import->count = 0;
+
+	while (pos < length) {
+		Chunk *chunk = &import->chunks[import->count++];
+		size_t end = pos + CHUNK_SIZE;
+		const char *newline;
+
+		if (end >= length) {
+			end = length;
+		} else {
+			newline = memchr (data + end, '\n', length - end);
+			end = newline ? newline - data + 1 : length;
+		}
+
+		chunk->start = data + pos;
+		chunk->end = data + end;
+
+		pos = end;
+	}
+}
+
+void
+import_run (const char *data, size_t length, int workers,
+            ImportEntryFunc entry_func, ImportChunkFunc chunk_func,
+            void *user_data, ImportStats *stats)
+{
+	Import import;
+	pthread_t *threads;
+
+	memset (stats, 0, sizeof (ImportStats));
+
+	split_chunks (&import, data, length);
+
+	import.next = import.consumed = 0;
+	import.window = workers * CHUNKS_AHEAD;
+	pthread_mutex_init (&import.mutex, NULL);
+	pthread_cond_init (&import.cond, NULL);
+
+	threads = malloc (workers * sizeof (pthread_t));
+
+	for (int i = 0; i < workers; i++)
+		pthread_create (&threads[i], NULL, worker, &import);
+
+	for (int i = 0; i < import.count; i++) {
+		Chunk *chunk = &import.chunks[i];
+
+		pthread_mutex_lock (&import.mutex);
+
+		while (!chunk->done)
+			pthread_cond_wait (&import.cond, &import.mutex);
+
+		pthread_mutex_unlock (&import.mutex);
+
+		for (int j = 0; j < chunk->count; j++) {
+			ParsedEntry *entry = &chunk->entries[j];
+
+			entry_func (entry->submission, entry->hash,
+			            chunk->out->buf + entry->offset,
+			            entry->length, user_data);
+			submission_unref (entry->submission);
+		}
+
+		strbuf_free (chunk->out);
+		free (chunk->entries);
+
+		stats->lines += chunk->stats.lines;
+		stats->entries += chunk->stats.entries;
+		stats->invalid += chunk->stats.invalid;
+
+		pthread_mutex_lock (&import.mutex);
+		import.consumed++;
+		pthread_cond_broadcast (&import.cond);
+		pthread_mutex_unlock (&import.mutex);
+
+		chunk_func (stats, user_data);
+	}
+
+	for (int i = 0; i < workers; i++)
+		pthread_join (threads[i], NULL);
+
+	free (threads);
+	free (import.chunks);
+
+	pthread_mutex_destroy (&import.mutex);
+	pthread_cond_destroy (&import.cond);
+}
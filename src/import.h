@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2009 Tilman Sauerbeck (tilman at xmms org)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _IMPORT_H
+#define _IMPORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "submission.h"
+
+/* the accumulated numbers of an import */
+typedef struct {
+	unsigned long lines;
+	unsigned long entries; /* valid entries */
+	unsigned long invalid;
+} ImportStats;
+
+/* called in file order for every valid entry. 'line' is the encoded
+ * profile submission, as it's stored in the journal, and 'hash' is
+ * submission_hash() of 'submission'. the function takes its own
+ * reference if it keeps the submission.
+ */
+typedef void (*ImportEntryFunc) (Submission *submission, uint64_t hash,
+                                 const char *line, int length,
+                                 void *user_data);
+
+/* called whenever a chunk of the file has been passed to the entry
+ * function.
+ */
+typedef void (*ImportChunkFunc) (ImportStats *stats, void *user_data);
+
+void import_run (const char *data, size_t length, int workers,
+                 ImportEntryFunc entry_func, ImportChunkFunc chunk_func,
+                 void *user_data, ImportStats *stats);
+
+#endif
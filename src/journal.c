@@ -0,0 +1,652 @@
+/*
+ * Copyright (c) 2009 Tilman Sauerbeck (tilman at xmms org)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "journal.h"
+#include "log.h"
+#include "list.h"
+
+/* compact journals that contain more acknowledged than live entries
+ * once they're bigger than this.
+ */
+#define COMPACT_MIN_SIZE (64 * 1024)
+
+/* how often the background thread checks for journals to compact if
+ * it isn't woken up more often for group commits anyway.
+ */
+#define COMPACT_INTERVAL 1000
+
+/* seconds to wait before writing again after a write failed */
+#define RETRY_DELAY 5
+
+/* milliseconds between group commits.
+ * 0 means that every commit is written and synced right away,
+ * a negative value means that records are written right away,
+ * but never synced.
+ */
+static int sync_interval;
+
+typedef struct {
+	const char *data;
+	int length;
+} Slice;
+
+static List *journals;
+static pthread_mutex_t journals_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t journals_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t thread;
+static bool thread_running, shutdown_thread;
+
+static bool
+write_all (int fd, const char *buf, size_t len)
+{
+	while (len) {
+		ssize_t w = write (fd, buf, len);
+
+		if (w == -1 && errno == EINTR)
+			continue;
+
+		if (w == -1)
+			return false;
+
+		buf += w;
+		len -= w;
+	}
+
+	return true;
+}
+
+/* (re)opens the journal for appending, eg after it was replaced */
+static bool
+reopen (Journal *j)
+{
+	j->fd = open (j->filename, O_WRONLY | O_APPEND | O_CREAT, 0600);
+
+	if (j->fd == -1)
+		return false;
+
+	j->size = lseek (j->fd, 0, SEEK_END);
+
+	return true;
+}
+
+/* puts the records that were being written back in front of the ones
+ * that were added in the meantime.
+ */
+static void
+requeue (Journal *j)
+{
+	StrBuf *tmp;
+
+	pthread_mutex_lock (&j->mutex);
+
+	strbuf_append_len (j->writing, j->pending->buf, j->pending->length);
+	strbuf_truncate (j->pending, 0);
+
+	tmp = j->writing;
+	j->writing = j->pending;
+	j->pending = tmp;
+
+	pthread_mutex_unlock (&j->mutex);
+}
+
+/* write out the pending records.
+ * if they cannot be written, they are kept for the next flush, which
+ * won't try again for RETRY_DELAY seconds.
+ * must be called with the io mutex held.
+ */
+static bool
+flush_locked (Journal *j, bool sync, int *entries, int *acked)
+{
+	StrBuf *tmp;
+
+	pthread_mutex_lock (&j->mutex);
+
+	tmp = j->writing;
+	j->writing = j->pending;
+	j->pending = tmp;
+
+	if (entries)
+		*entries = j->entries;
+
+	if (acked)
+		*acked = j->acked;
+
+	pthread_mutex_unlock (&j->mutex);
+
+	if (!j->writing->length)
+		return true;
+
+	if (time (NULL) < j->retry_at) {
+		requeue (j);
+		return false;
+	}
+
+	if (j->fd == -1 && !reopen (j)) {
+		log_error ("journal: cannot open '%s': %s\n",
+		           j->filename, strerror (errno));
+
+		j->retry_at = time (NULL) + RETRY_DELAY;
+		requeue (j);
+
+		return false;
+	}
+
+	if (!write_all (j->fd, j->writing->buf, j->writing->length)) {
+		log_error ("journal: cannot write to '%s': %s\n",
+		           j->filename, strerror (errno));
+
+		/* drop the part that was written, it's written again */
+		if (ftruncate (j->fd, j->size))
+			log_error ("journal: cannot truncate '%s': %s\n",
+			           j->filename, strerror (errno));
+
+		j->retry_at = time (NULL) + RETRY_DELAY;
+		requeue (j);
+
+		return false;
+	}
+
+	j->retry_at = 0;
+
+	j->size += j->writing->length;
+
+	if (sync)
+		fdatasync (j->fd);
+
+	strbuf_truncate (j->writing, 0);
+
+	return true;
+}
+
+/* collect the entries in 'm' that haven't been acknowledged yet.
+ * returns false if the journal contains acknowledgements or records
+ * that weren't written completely, ie if it should be rewritten.
+ */
+static bool
+read_live_entries (Mapping *m, Slice **live, int *count)
+{
+	const char *p = m->data, *end = m->data + m->length;
+	int head = 0, allocated = 0;
+	bool clean = true;
+
+	*live = NULL;
+	*count = 0;
+
+	while (p < end) {
+		const char *newline;
+
+		newline = memchr (p, '\n', end - p);
+
+		/* a record without a newline wasn't written completely */
+		if (!newline) {
+			clean = false;
+			break;
+		}
+
+		if (*p == '+') {
+			if (*count == allocated) {
+				allocated = allocated ? allocated * 2 : 1024;
+				*live = realloc (*live, allocated * sizeof (Slice));
+			}
+
+			(*live)[*count].data = p + 1;
+			(*live)[*count].length = newline - p - 1;
+			(*count)++;
+		} else {
+			if (*p == '-')
+				head += atoi (p + 1);
+
+			clean = false;
+		}
+
+		p = newline + 1;
+	}
+
+	if (head > *count)
+		head = *count;
+
+	/* drop the acknowledged entries */
+	*count -= head;
+	memmove (*live, *live + head, *count * sizeof (Slice));
+
+	return clean;
+}
+
+static void
+sync_parent_directory (const char *filename)
+{
+	char dir[PATH_MAX], *slash;
+	int fd;
+
+	strcpy (dir, filename);
+
+	slash = strrchr (dir, '/');
+
+	if (!slash)
+		strcpy (dir, ".");
+	else
+		*slash = 0;
+
+	fd = open (dir, O_RDONLY);
+
+	if (fd > -1) {
+		fsync (fd);
+		close (fd);
+	}
+}
+
+/* replace the journal by one that only contains the 'count' entries
+ * in 'live'.
+ * the new journal is written to a temporary file first, which is then
+ * renamed, so there's always a complete journal on disk.
+ * must be called with the io mutex held and all records flushed.
+ */
+static void
+rewrite (Journal *j, Slice *live, int count)
+{
+	FILE *fp;
+	char tmp_filename[PATH_MAX + 4];
+	off_t size;
+	bool ok;
+
+	snprintf (tmp_filename, sizeof (tmp_filename), "%s.tmp", j->filename);
+
+	fp = fopen (tmp_filename, "w");
+
+	if (!fp) {
+		log_error ("journal: cannot open '%s' for writing\n",
+		           tmp_filename);
+		return;
+	}
+
+	for (int i = 0; i < count; i++) {
+		fputc ('+', fp);
+		fwrite (live[i].data, 1, live[i].length, fp);
+		fputc ('\n', fp);
+	}
+
+	ok = !fflush (fp) && !fdatasync (fileno (fp));
+	size = ftello (fp);
+	ok = !fclose (fp) && ok;
+
+	if (!ok || rename (tmp_filename, j->filename)) {
+		log_error ("journal: cannot replace '%s': %s\n",
+		           j->filename, strerror (errno));
+		unlink (tmp_filename);
+
+		return;
+	}
+
+	sync_parent_directory (j->filename);
+
+	if (j->fd > -1)
+		close (j->fd);
+
+	/* the old file is gone, so there's no going back to it. if the
+	 * new one cannot be opened, the next flush tries again.
+	 */
+	j->size = size;
+
+	if (!reopen (j))
+		log_error ("journal: cannot open '%s': %s\n",
+		           j->filename, strerror (errno));
+}
+
+static bool
+needs_compaction (Journal *j)
+{
+	bool ret;
+
+	pthread_mutex_lock (&j->mutex);
+	ret = j->size > COMPACT_MIN_SIZE && j->acked > j->entries - j->acked;
+	pthread_mutex_unlock (&j->mutex);
+
+	return ret;
+}
+
+static void *
+journal_thread (void *arg)
+{
+	int interval = sync_interval > 0 ? sync_interval : COMPACT_INTERVAL;
+
+	pthread_mutex_lock (&journals_mutex);
+
+	while (!shutdown_thread) {
+		struct timespec ts;
+
+		clock_gettime (CLOCK_REALTIME, &ts);
+
+		ts.tv_sec += interval / 1000;
+		ts.tv_nsec += (interval % 1000) * 1000000;
+
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+
+		pthread_cond_timedwait (&journals_cond, &journals_mutex, &ts);
+
+		for (List *l = journals; l; l = l->next) {
+			Journal *j = l->data;
+
+			if (sync_interval > 0)
+				journal_flush (j, true);
+
+			if (needs_compaction (j))
+				journal_compact (j);
+		}
+	}
+
+	pthread_mutex_unlock (&journals_mutex);
+
+	return NULL;
+}
+
+void
+journal_init (int interval)
+{
+	sync_interval = interval;
+	shutdown_thread = false;
+
+	thread_running = !pthread_create (&thread, NULL, journal_thread, NULL);
+}
+
+void
+journal_shutdown (void)
+{
+	if (!thread_running)
+		return;
+
+	pthread_mutex_lock (&journals_mutex);
+	shutdown_thread = true;
+	pthread_cond_signal (&journals_cond);
+	pthread_mutex_unlock (&journals_mutex);
+
+	pthread_join (thread, NULL);
+	thread_running = false;
+}
+
+/* open the journal in 'filename', which is created if it doesn't
+ * exist yet. 'callback' is called for every entry that hasn't been
+ * acknowledged yet. the entry isn't NUL-terminated; it points into
+ * 'mapping', which the callback can keep a reference to.
+ * if the callback returns false, the entry is removed from the journal.
+ */
+Journal *
+journal_open (const char *filename,
+              bool (*callback) (Mapping *mapping, const char *line,
+                                int length, void *user_data),
+              void *user_data)
+{
+	Journal *j;
+	Mapping *m;
+	Slice *live = NULL;
+	int count = 0, kept = 0;
+	bool clean = false;
+
+	j = malloc (sizeof (Journal));
+
+	strncpy (j->filename, filename, sizeof (j->filename));
+	j->filename[sizeof (j->filename) - 1] = 0;
+
+	pthread_mutex_init (&j->mutex, NULL);
+	pthread_mutex_init (&j->io_mutex, NULL);
+
+	j->pending = strbuf_new ();
+	j->writing = strbuf_new ();
+	j->fd = -1;
+	j->size = 0;
+	j->retry_at = 0;
+
+	m = mapping_open (filename);
+
+	if (m)
+		clean = read_live_entries (m, &live, &count);
+
+	for (int i = 0; i < count; i++)
+		if (!callback || callback (m, live[i].data, live[i].length,
+		                           user_data))
+			live[kept++] = live[i];
+
+	clean = clean && kept == count;
+	count = kept;
+
+	/* unless the journal only contains complete records of the live
+	 * entries, start with a compacted one.
+	 */
+	if (!clean)
+		rewrite (j, live, count);
+
+	if (j->fd == -1 && !reopen (j))
+		log_error ("journal: cannot open '%s': %s\n",
+		           j->filename, strerror (errno));
+
+	j->entries = count;
+	j->acked = 0;
+
+	free (live);
+
+	if (m)
+		mapping_unref (m);
+
+	pthread_mutex_lock (&journals_mutex);
+	journals = list_prepend (journals, j);
+	pthread_mutex_unlock (&journals_mutex);
+
+	return j;
+}
+
+void
+journal_close (Journal *j)
+{
+	List **link;
+
+	pthread_mutex_lock (&journals_mutex);
+
+	for (link = &journals; *link; link = &(*link)->next)
+		if ((*link)->data == j) {
+			*link = list_remove_head (*link);
+			break;
+		}
+
+	pthread_mutex_unlock (&journals_mutex);
+
+	/* last chance for the records that couldn't be written */
+	j->retry_at = 0;
+
+	journal_compact (j);
+
+	if (j->fd > -1)
+		close (j->fd);
+
+	pthread_mutex_destroy (&j->mutex);
+	pthread_mutex_destroy (&j->io_mutex);
+
+	strbuf_free (j->pending);
+	strbuf_free (j->writing);
+	free (j);
+}
+
+/* add a record for a submission that was pushed to the queue.
+ * the record isn't guaranteed to be on disk before journal_commit()
+ * is called.
+ */
+void
+journal_append (Journal *j, const char *line, int length)
+{
+	pthread_mutex_lock (&j->mutex);
+
+	strbuf_append (j->pending, "+");
+	strbuf_append_len (j->pending, line, length);
+	strbuf_append (j->pending, "\n");
+
+	j->entries++;
+
+	pthread_mutex_unlock (&j->mutex);
+}
+
+/* add a record for 'count' submissions that were removed from the
+ * head of the queue.
+ */
+void
+journal_ack (Journal *j, int count)
+{
+	char buf32[32];
+
+	sprintf (buf32, "-%i\n", count);
+
+	pthread_mutex_lock (&j->mutex);
+
+	strbuf_append (j->pending, buf32);
+	j->acked += count;
+
+	pthread_mutex_unlock (&j->mutex);
+}
+
+/* make sure the records that were added so far end up on disk,
+ * according to the sync interval.
+ */
+void
+journal_commit (Journal *j)
+{
+	if (!sync_interval)
+		journal_flush (j, true);
+	else if (sync_interval < 0)
+		journal_flush (j, false);
+}
+
+/* returns false if the records couldn't be written. they are kept
+ * and written by the next flush.
+ */
+bool
+journal_flush (Journal *j, bool sync)
+{
+	bool ret;
+
+	pthread_mutex_lock (&j->io_mutex);
+	ret = flush_locked (j, sync, NULL, NULL);
+	pthread_mutex_unlock (&j->io_mutex);
+
+	return ret;
+}
+
+void
+journal_compact (Journal *j)
+{
+	Mapping *m;
+	Slice *live = NULL;
+	int entries, acked, count = 0;
+
+	pthread_mutex_lock (&j->io_mutex);
+
+	/* the records that are still pending would be lost by the
+	 * rewrite, so leave it for later.
+	 */
+	if (!flush_locked (j, true, &entries, &acked)) {
+		pthread_mutex_unlock (&j->io_mutex);
+		return;
+	}
+
+	/* without the old journal, the rewrite would drop all entries */
+	m = mapping_open (j->filename);
+
+	if (!m) {
+		log_error ("journal: cannot read '%s'\n", j->filename);
+		pthread_mutex_unlock (&j->io_mutex);
+		return;
+	}
+
+	read_live_entries (m, &live, &count);
+	rewrite (j, live, count);
+
+	free (live);
+	mapping_unref (m);
+
+	/* records that were added while we were busy aren't in the
+	 * journal yet.
+	 */
+	pthread_mutex_lock (&j->mutex);
+	j->entries = count + (j->entries - entries);
+	j->acked -= acked;
+	pthread_mutex_unlock (&j->mutex);
+
+	pthread_mutex_unlock (&j->io_mutex);
+}
+
+/* replace all entries in the journal by the newline-terminated lines
+ * in 'entries', eg after the queue has been reordered.
+ * the journal must not be in use by other threads.
+ */
+void
+journal_replace (Journal *j, const char *entries, int length)
+{
+	const char *p = entries, *end = entries + length;
+	Slice *live = NULL;
+	int count = 0, allocated = 0;
+
+	while (p < end) {
+		const char *newline = memchr (p, '\n', end - p);
+
+		if (!newline)
+			newline = end;
+
+		if (count == allocated) {
+			allocated = allocated ? allocated * 2 : 1024;
+			live = realloc (live, allocated * sizeof (Slice));
+		}
+
+		live[count].data = p;
+		live[count].length = newline - p;
+		count++;
+
+		p = newline + 1;
+	}
+
+	pthread_mutex_lock (&j->io_mutex);
+
+	/* the records that couldn't be written are replaced, too */
+	if (!flush_locked (j, true, NULL, NULL)) {
+		pthread_mutex_lock (&j->mutex);
+		strbuf_truncate (j->pending, 0);
+		pthread_mutex_unlock (&j->mutex);
+	}
+
+	rewrite (j, live, count);
+
+	pthread_mutex_lock (&j->mutex);
+	j->entries = count;
+	j->acked = 0;
+	pthread_mutex_unlock (&j->mutex);
+
+	pthread_mutex_unlock (&j->io_mutex);
+
+	free (live);
+}
@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2009 Tilman Sauerbeck (tilman at xmms org)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _JOURNAL_H
+#define _JOURNAL_H
+
+#include <limits.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <time.h>
+#include "strbuf.h"
+#include "mapping.h"
+
+/* a journal is an append-only log of the profile submissions in a
+ * server's queue. each record is a single line:
+ *
+ *   +<submission>   a submission was added to the tail of the queue
+ *   -<count>        <count> submissions were removed from the head
+ *
+ * records are collected in memory and written (and synced) according
+ * to the sync interval that was passed to journal_init().
+ */
+typedef struct {
+	char filename[PATH_MAX];
+	int fd;
+
+	/* protects 'pending' and the counters */
+	pthread_mutex_t mutex;
+
+	/* serializes writes to and rewrites of the file */
+	pthread_mutex_t io_mutex;
+
+	/* records that haven't been written yet, and the ones
+	 * that are being written at the moment.
+	 */
+	StrBuf *pending, *writing;
+
+	/* number of records in the journal */
+	int entries, acked;
+	off_t size;
+
+	/* after a failed write, the next one isn't tried before this */
+	time_t retry_at;
+} Journal;
+
+void journal_init (int sync_interval);
+void journal_shutdown (void);
+
+Journal *journal_open (const char *filename,
+                       bool (*callback) (Mapping *mapping, const char *line,
+                                         int length, void *user_data),
+                       void *user_data);
+void journal_close (Journal *j);
+
+void journal_append (Journal *j, const char *line, int length);
+void journal_ack (Journal *j, int count);
+void journal_commit (Journal *j);
+bool journal_flush (Journal *j, bool sync);
+void journal_compact (Journal *j);
+void journal_replace (Journal *j, const char *entries, int length);
+
+#endif
@@ -0,0 +1,528 @@
+/*
+ * Copyright (c) 2009 Tilman Sauerbeck (tilman at xmms org)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "log.h"
+#include "list.h"
+
+/* per thread, must be a power of two */
+#define BUFFER_SIZE (64 * 1024)
+
+/* longer messages are cut off */
+#define MAX_MESSAGE 2048
+
+/* milliseconds between flushes, unless a buffer fills up */
+#define FLUSH_INTERVAL 100
+
+/* iovecs per writev() call */
+#define MAX_IOVECS 64
+
+/* new buffers are prepended to 'buffers' and only the writer removes
+ * them, so it can walk the list without holding 'buffers_mutex'.
+ * the mutex also protects the rotation settings.
+ * the writer sleeps on 'wake_cond'. neither mutex is held while it
+ * writes, so threads that log never wait for the disk.
+ */
+static List *buffers;
+static pthread_mutex_t buffers_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t wake_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake_cond = PTHREAD_COND_INITIALIZER;
+static pthread_key_t buffer_key;
+static __thread LogBuffer *local;
+
+static pthread_t thread;
+static bool thread_running, shutdown_thread, wake_requested;
+
+/* orders the messages of all threads */
+static uint64_t sequence;
+
+/* the log goes to stderr, which is pointed at 'filename' */
+static char *filename;
+static long max_size;
+static int keep;
+static off_t written; /* only used by the writer */
+
+static void
+write_all (int fd, const char *buf, size_t len)
+{
+	while (len) {
+		ssize_t w = write (fd, buf, len);
+
+		if (w == -1 && errno == EINTR)
+			continue;
+
+		if (w == -1)
+			return;
+
+		buf += w;
+		len -= w;
+	}
+}
+
+static void
+on_thread_exit (void *data)
+{
+	LogBuffer *b = data;
+
+	__atomic_store_n (&b->orphaned, true, __ATOMIC_RELEASE);
+}
+
+static LogBuffer *
+buffer_new (void)
+{
+	LogBuffer *b;
+
+	if (posix_memalign ((void **) &b, CACHELINE, sizeof (LogBuffer)))
+		return NULL;
+
+	b->data = malloc (BUFFER_SIZE);
+	b->head = b->tail = 0;
+	b->dropped = 0;
+	b->orphaned = false;
+
+	pthread_mutex_lock (&buffers_mutex);
+	buffers = list_prepend (buffers, b);
+	pthread_mutex_unlock (&buffers_mutex);
+
+	pthread_setspecific (buffer_key, b);
+
+	return b;
+}
+
+static void
+buffer_free (LogBuffer *b)
+{
+	free (b->data);
+	free (b);
+}
+
+/* copies to and from the ring, which the data might wrap around */
+static void
+copy_in (LogBuffer *b, unsigned int at, const void *data,
+         unsigned int length)
+{
+	unsigned int offset = at & (BUFFER_SIZE - 1);
+	unsigned int first = BUFFER_SIZE - offset;
+
+	if (first > length)
+		first = length;
+
+	memcpy (&b->data[offset], data, first);
+	memcpy (b->data, (const char *) data + first, length - first);
+}
+
+static void
+copy_out (LogBuffer *b, unsigned int at, void *data, unsigned int length)
+{
+	unsigned int offset = at & (BUFFER_SIZE - 1);
+	unsigned int first = BUFFER_SIZE - offset;
+
+	if (first > length)
+		first = length;
+
+	memcpy (data, &b->data[offset], first);
+	memcpy ((char *) data + first, b->data, length - first);
+}
+
+static void
+push (LogBuffer *b, const char *message, unsigned int length)
+{
+	LogRecord record;
+	unsigned int head = b->head, size = sizeof (LogRecord) + length;
+	unsigned int tail = __atomic_load_n (&b->tail, __ATOMIC_ACQUIRE);
+
+	if (BUFFER_SIZE - (head - tail) < size) {
+		__atomic_add_fetch (&b->dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	record.sequence = __atomic_fetch_add (&sequence, 1, __ATOMIC_RELAXED);
+	record.length = length;
+
+	copy_in (b, head, &record, sizeof (LogRecord));
+	copy_in (b, head + sizeof (LogRecord), message, length);
+
+	__atomic_store_n (&b->head, head + size, __ATOMIC_RELEASE);
+
+	/* don't wait for the next flush if the buffer is filling up.
+	 * that's the only case in which logging takes a lock.
+	 */
+	if (head + size - tail > BUFFER_SIZE / 2 &&
+	    !__atomic_exchange_n (&wake_requested, true, __ATOMIC_ACQ_REL)) {
+		pthread_mutex_lock (&wake_mutex);
+		pthread_cond_signal (&wake_cond);
+		pthread_mutex_unlock (&wake_mutex);
+	}
+}
+
+void
+log_write (const char *format, ...)
+{
+	char message[MAX_MESSAGE];
+	va_list args;
+	int length;
+
+	va_start (args, format);
+	length = vsnprintf (message, sizeof (message), format, args);
+	va_end (args);
+
+	if (length < 0)
+		return;
+
+	if (length >= (int) sizeof (message)) {
+		length = sizeof (message) - 1;
+		message[length - 1] = '\n';
+	}
+
+	/* before log_start() and after log_stop(), there's only one
+	 * thread left.
+	 */
+	if (!__atomic_load_n (&thread_running, __ATOMIC_ACQUIRE)) {
+		write_all (STDERR_FILENO, message, length);
+		return;
+	}
+
+	if (!local)
+		local = buffer_new ();
+
+	if (local)
+		push (local, message, length);
+}
+
+static void
+rotate (int count)
+{
+	char from[PATH_MAX], to[PATH_MAX];
+	int fd;
+
+	/* logfile.log.2 becomes logfile.log.3, etc */
+	for (int i = count; i > 0; i--) {
+		if (i == 1)
+			snprintf (from, sizeof (from), "%s", filename);
+		else
+			snprintf (from, sizeof (from), "%s.%i", filename, i - 1);
+
+		snprintf (to, sizeof (to), "%s.%i", filename, i);
+		rename (from, to);
+	}
+
+	fd = open (filename, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0640);
+
+	if (fd == -1)
+		return;
+
+	dup2 (fd, STDERR_FILENO);
+	close (fd);
+
+	written = 0;
+}
+
+typedef struct {
+	struct iovec iov[MAX_IOVECS];
+	int count;
+
+	List *buffers; /* the ones that are being merged */
+} Batch;
+
+/* writes the batch and hands the space of the merged messages back to
+ * their threads. whatever cannot be written is dropped.
+ */
+static void
+write_batch (Batch *batch)
+{
+	struct iovec *p = batch->iov;
+	int left = batch->count;
+
+	while (left) {
+		ssize_t w = writev (STDERR_FILENO, p, left);
+
+		if (w == -1 && errno == EINTR)
+			continue;
+
+		if (w == -1)
+			break;
+
+		written += w;
+
+		while (left && (size_t) w >= p->iov_len) {
+			w -= p->iov_len;
+			p++;
+			left--;
+		}
+
+		if (left) {
+			p->iov_base = (char *) p->iov_base + w;
+			p->iov_len -= w;
+		}
+	}
+
+	batch->count = 0;
+
+	for (List *l = batch->buffers; l; l = l->next) {
+		LogBuffer *b = l->data;
+
+		__atomic_store_n (&b->tail, b->cursor, __ATOMIC_RELEASE);
+	}
+}
+
+/* adds the message at the buffer's cursor to the batch */
+static void
+add_to_batch (Batch *batch, LogBuffer *b)
+{
+	unsigned int start = b->cursor + sizeof (LogRecord);
+	unsigned int offset = start & (BUFFER_SIZE - 1);
+	unsigned int length = b->next.length;
+	unsigned int first = BUFFER_SIZE - offset;
+
+	if (batch->count + 2 > MAX_IOVECS)
+		write_batch (batch);
+
+	if (first > length)
+		first = length;
+
+	batch->iov[batch->count].iov_base = &b->data[offset];
+	batch->iov[batch->count].iov_len = first;
+	batch->count++;
+
+	if (first < length) {
+		batch->iov[batch->count].iov_base = b->data;
+		batch->iov[batch->count].iov_len = length - first;
+		batch->count++;
+	}
+
+	b->cursor = start + length;
+
+	if (b->cursor != b->end)
+		copy_out (b, b->cursor, &b->next, sizeof (LogRecord));
+}
+
+/* only called by the writer, or once it's gone */
+static void
+flush (void)
+{
+	static Batch batch;
+	unsigned long dropped = 0;
+	long rotate_at;
+	int rotate_keep;
+	List **link, *freed = NULL;
+
+	/* buffers that are added while this runs are left for the next
+	 * flush.
+	 */
+	pthread_mutex_lock (&buffers_mutex);
+	batch.buffers = buffers;
+	rotate_at = max_size;
+	rotate_keep = keep;
+	pthread_mutex_unlock (&buffers_mutex);
+
+	for (List *l = batch.buffers; l; l = l->next) {
+		LogBuffer *b = l->data;
+
+		b->cursor = b->tail;
+		b->end = __atomic_load_n (&b->head, __ATOMIC_ACQUIRE);
+
+		if (b->cursor != b->end)
+			copy_out (b, b->cursor, &b->next, sizeof (LogRecord));
+
+		dropped += __atomic_exchange_n (&b->dropped, 0, __ATOMIC_RELAXED);
+	}
+
+	/* the buffers are sorted already, so merging them only takes
+	 * looking at the first record of each.
+	 */
+	for (;;) {
+		LogBuffer *oldest = NULL;
+
+		for (List *l = batch.buffers; l; l = l->next) {
+			LogBuffer *b = l->data;
+
+			if (b->cursor != b->end &&
+			    (!oldest || b->next.sequence < oldest->next.sequence))
+				oldest = b;
+		}
+
+		if (!oldest)
+			break;
+
+		add_to_batch (&batch, oldest);
+	}
+
+	write_batch (&batch);
+
+	if (dropped) {
+		char message[64];
+		int length;
+
+		length = snprintf (message, sizeof (message),
+		                   "log: dropped %lu messages\n", dropped);
+		write_all (STDERR_FILENO, message, length);
+		written += length;
+	}
+
+	if (filename && rotate_at > 0 && written >= rotate_at)
+		rotate (rotate_keep);
+
+	/* the threads of orphaned buffers are gone, so nothing new
+	 * can have been added to them.
+	 */
+	pthread_mutex_lock (&buffers_mutex);
+
+	link = &buffers;
+
+	while (*link) {
+		LogBuffer *b = (*link)->data;
+
+		if (__atomic_load_n (&b->orphaned, __ATOMIC_ACQUIRE) &&
+		    b->head == b->tail) {
+			freed = list_prepend (freed, b);
+			*link = list_remove_head (*link);
+		} else {
+			link = &(*link)->next;
+		}
+	}
+
+	pthread_mutex_unlock (&buffers_mutex);
+
+	while (freed) {
+		buffer_free (freed->data);
+		freed = list_remove_head (freed);
+	}
+}
+
+static void *
+log_thread (void *arg)
+{
+	bool done = false;
+
+	while (!done) {
+		struct timespec ts;
+
+		clock_gettime (CLOCK_REALTIME, &ts);
+
+		ts.tv_nsec += FLUSH_INTERVAL * 1000000;
+
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+
+		pthread_mutex_lock (&wake_mutex);
+
+		if (!shutdown_thread &&
+		    !__atomic_load_n (&wake_requested, __ATOMIC_ACQUIRE))
+			pthread_cond_timedwait (&wake_cond, &wake_mutex, &ts);
+
+		done = shutdown_thread;
+
+		pthread_mutex_unlock (&wake_mutex);
+
+		__atomic_store_n (&wake_requested, false, __ATOMIC_RELEASE);
+
+		flush ();
+	}
+
+	return NULL;
+}
+
+/* points stderr at 'filename' (appending to it) and starts the writer
+ * thread. returns false if the file cannot be opened, the messages
+ * go to the old stderr then.
+ */
+bool
+log_start (const char *name)
+{
+	struct stat st;
+	int fd;
+
+	fd = open (name, O_WRONLY | O_CREAT | O_APPEND, 0640);
+
+	if (fd != -1) {
+		dup2 (fd, STDERR_FILENO);
+		close (fd);
+
+		filename = strdup (name);
+
+		if (!fstat (STDERR_FILENO, &st))
+			written = st.st_size;
+	}
+
+	pthread_key_create (&buffer_key, on_thread_exit);
+	shutdown_thread = false;
+
+	if (!pthread_create (&thread, NULL, log_thread, NULL))
+		__atomic_store_n (&thread_running, true, __ATOMIC_RELEASE);
+
+	return fd != -1;
+}
+
+/* writes what's left and stops the writer thread.
+ * other threads may still be logging, eg if main() returns early. their
+ * messages go straight to stderr from then on, and their buffers are
+ * kept, since they might be in the middle of adding to them.
+ */
+void
+log_stop (void)
+{
+	if (!thread_running)
+		return;
+
+	pthread_mutex_lock (&wake_mutex);
+	shutdown_thread = true;
+	pthread_cond_signal (&wake_cond);
+	pthread_mutex_unlock (&wake_mutex);
+
+	pthread_join (thread, NULL);
+	__atomic_store_n (&thread_running, false, __ATOMIC_RELEASE);
+
+	/* catch what was added after the writer's last flush */
+	flush ();
+
+	free (filename);
+	filename = NULL;
+}
+
+/* once the log is larger than 'max_size' bytes, it's renamed to
+ * logfile.log.1 (and that one to logfile.log.2, etc) and a new one is
+ * started. 'keep' old files are kept. a 'max_size' of 0 lets the log
+ * grow without bounds.
+ */
+void
+log_set_rotation (long size, int count)
+{
+	pthread_mutex_lock (&buffers_mutex);
+	max_size = size;
+	keep = count;
+	pthread_mutex_unlock (&buffers_mutex);
+}
@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2009 Tilman Sauerbeck (tilman at xmms org)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _LOG_H
+#define _LOG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "ring.h"
+
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARNING 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_DEBUG 3
+
+/* messages above this level aren't even compiled in.
+ * "make LOG_LEVEL=DEBUG" gets all of them.
+ */
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL LOG_LEVEL_INFO
+#endif
+
+#define log_at(level, ...) \
+	do { \
+		if ((level) <= LOG_MAX_LEVEL) \
+			log_write (__VA_ARGS__); \
+	} while (0)
+
+#define log_error(...) log_at (LOG_LEVEL_ERROR, __VA_ARGS__)
+#define log_warning(...) log_at (LOG_LEVEL_WARNING, __VA_ARGS__)
+#define log_info(...) log_at (LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_debug(...) log_at (LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+/* precedes every message in a buffer. the writer merges the buffers
+ * by sequence number, so the log is in the order the messages were
+ * logged in.
+ */
+typedef struct {
+	uint64_t sequence;
+	uint32_t length;
+} LogRecord;
+
+/* every thread that logs gets a buffer of its own, which only it
+ * writes to and only the writer thread reads from, so that logging
+ * doesn't take a lock or make a syscall.
+ * if the buffer is full, the message is dropped and counted.
+ */
+typedef struct {
+	char *data;
+
+	/* written by the thread that logs */
+	unsigned int head __attribute__ ((aligned (CACHELINE)));
+	unsigned long dropped;
+
+	/* written by the writer thread */
+	unsigned int tail __attribute__ ((aligned (CACHELINE)));
+
+	/* the part of the buffer that's being merged, and the record at
+	 * 'cursor'. only used by the writer.
+	 */
+	unsigned int cursor, end;
+	LogRecord next;
+
+	/* set when the thread exits. the writer frees the buffer once
+	 * it's empty.
+	 */
+	bool orphaned;
+} LogBuffer;
+
+bool log_start (const char *filename);
+void log_stop (void);
+void log_set_rotation (long max_size, int keep);
+void log_write (const char *format, ...)
+	__attribute__ ((format (printf, 1, 2)));
+
+#endif
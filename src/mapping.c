@@ -0,0 +1,140 @@
+/*
+ * Copyright (c) 2009 Tilman Sauerbeck (tilman at xmms org)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mapping.h"
+
+#define CHUNK_SIZE (64 * 1024)
+
+typedef struct __MappingChunk {
+	struct __MappingChunk *next;
+	size_t used;
+	char data[CHUNK_SIZE];
+} MappingChunk;
+
+/* returns NULL if the file cannot be read.
+ * an empty file gets an empty mapping, whose 'data' is NULL.
+ */
+Mapping *
+mapping_open (const char *filename)
+{
+	Mapping *m;
+	struct stat st;
+	void *addr = NULL;
+	int fd;
+
+	fd = open (filename, O_RDONLY);
+
+	if (fd == -1)
+		return NULL;
+
+	if (fstat (fd, &st)) {
+		close (fd);
+		return NULL;
+	}
+
+	/* mmap() refuses to map nothing */
+	if (st.st_size)
+		addr = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+	/* the mapping stays valid after the file is closed */
+	close (fd);
+
+	if (addr == MAP_FAILED)
+		return NULL;
+
+	/* we're going to read the file from start to end */
+	if (addr)
+		madvise (addr, st.st_size, MADV_SEQUENTIAL);
+
+	m = malloc (sizeof (Mapping));
+
+	m->data = addr;
+	m->length = st.st_size;
+	m->refcount = 1;
+	m->chunks = NULL;
+
+	return m;
+}
+
+Mapping *
+mapping_ref (Mapping *m)
+{
+	__sync_add_and_fetch (&m->refcount, 1);
+
+	return m;
+}
+
+void
+mapping_unref (Mapping *m)
+{
+	if (__sync_sub_and_fetch (&m->refcount, 1))
+		return;
+
+	while (m->chunks) {
+		MappingChunk *next = m->chunks->next;
+
+		free (m->chunks);
+		m->chunks = next;
+	}
+
+	if (m->data)
+		munmap ((void *) m->data, m->length);
+
+	free (m);
+}
+
+/* allocate 'size' bytes that are released together with the mapping.
+ * this isn't thread-safe, it's meant to be used while the file is
+ * being parsed.
+ */
+void *
+mapping_alloc (Mapping *m, size_t size)
+{
+	MappingChunk *chunk = m->chunks;
+	void *ret;
+
+	/* keep the returned memory suitably aligned */
+	size = (size + sizeof (void *) - 1) & ~(sizeof (void *) - 1);
+
+	if (size > CHUNK_SIZE)
+		return NULL;
+
+	if (!chunk || chunk->used + size > CHUNK_SIZE) {
+		chunk = malloc (sizeof (MappingChunk));
+		chunk->next = m->chunks;
+		chunk->used = 0;
+
+		m->chunks = chunk;
+	}
+
+	ret = chunk->data + chunk->used;
+	chunk->used += size;
+
+	return ret;
+}
@@ -0,0 +1,47 @@
+/*
+ * Copyright (c) 2009 Tilman Sauerbeck (tilman at xmms org)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _MAPPING_H
+#define _MAPPING_H
+
+#include <stddef.h>
+
+/* a read-only, reference counted memory mapping of a file.
+ * mapping_alloc() hands out memory that lives as long as the mapping,
+ * so that objects that point into the mapping don't need to be
+ * allocated one by one.
+ */
+typedef struct {
+	const char *data;
+	size_t length;
+	int refcount;
+
+	struct __MappingChunk *chunks;
+} Mapping;
+
+Mapping *mapping_open (const char *filename);
+Mapping *mapping_ref (Mapping *m);
+void mapping_unref (Mapping *m);
+void *mapping_alloc (Mapping *m, size_t size);
+
+#endif
@@ -0,0 +1,444 @@
+/*
+ * Copyright (c) 2009 Tilman Sauerbeck (tilman at xmms org)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "pool.h"
+
+/* a task's state only changes through these atomics. they're
+ * sequentially consistent, so that a worker that starts running a
+ * task sees everything that was done before it was scheduled, or the
+ * scheduler sees that it's running and asks for another run.
+ */
+#define LOAD(p) __atomic_load_n ((p), __ATOMIC_SEQ_CST)
+#define STORE(p, v) __atomic_store_n ((p), (v), __ATOMIC_SEQ_CST)
+#define CAS(p, e, v) \
+	__atomic_compare_exchange_n ((p), (e), (v), false, \
+	                             __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
+
+/* tasks that are fired per look at the pool's timers */
+#define TIMER_BATCH 16
+
+enum {
+	TASK_IDLE,
+	TASK_QUEUED,
+	TASK_RUNNING,
+	TASK_RERUN /* scheduled again while it was running */
+};
+
+/* the worker that's running on this thread, if any */
+static __thread PoolWorker *self;
+
+void
+pool_task_init (PoolTask *task, void (*func) (PoolTask *task), void *data)
+{
+	task->func = func;
+	task->data = data;
+	task->state = TASK_IDLE;
+
+	timer_init (&task->timer, task);
+}
+
+/* true if the task is neither queued nor running */
+bool
+pool_task_is_idle (PoolTask *task)
+{
+	return LOAD (&task->state) == TASK_IDLE;
+}
+
+/* marks the task as scheduled. returns true if it has to be queued,
+ * false if it's going to run anyway.
+ */
+static bool
+claim (PoolTask *task)
+{
+	int state = LOAD (&task->state);
+
+	for (;;) {
+		switch (state) {
+			case TASK_IDLE:
+				if (CAS (&task->state, &state, TASK_QUEUED))
+					return true;
+
+				break;
+			case TASK_RUNNING:
+				if (CAS (&task->state, &state, TASK_RERUN))
+					return false;
+
+				break;
+			default:
+				return false;
+		}
+	}
+}
+
+/* returns the number of tasks in the deque */
+static int
+deque_push (PoolDeque *d, PoolTask *task)
+{
+	int count;
+
+	pthread_mutex_lock (&d->mutex);
+
+	if (d->count == d->allocated) {
+		int allocated = d->allocated * 2 + 16;
+		PoolTask **tasks = malloc (allocated * sizeof (PoolTask *));
+
+		for (int i = 0; i < d->count; i++)
+			tasks[i] = d->tasks[(d->top + i) % d->allocated];
+
+		free (d->tasks);
+		d->tasks = tasks;
+		d->allocated = allocated;
+		d->top = 0;
+	}
+
+	d->tasks[(d->top + d->count) % d->allocated] = task;
+	count = ++d->count;
+
+	pthread_mutex_unlock (&d->mutex);
+
+	return count;
+}
+
+/* the owner takes the newest task */
+static PoolTask *
+deque_pop (PoolDeque *d)
+{
+	PoolTask *task = NULL;
+
+	pthread_mutex_lock (&d->mutex);
+
+	if (d->count) {
+		d->count--;
+		task = d->tasks[(d->top + d->count) % d->allocated];
+	}
+
+	pthread_mutex_unlock (&d->mutex);
+
+	return task;
+}
+
+/* thieves take the oldest one */
+static PoolTask *
+deque_steal (PoolDeque *d)
+{
+	PoolTask *task = NULL;
+
+	pthread_mutex_lock (&d->mutex);
+
+	if (d->count) {
+		task = d->tasks[d->top];
+		d->top = (d->top + 1) % d->allocated;
+		d->count--;
+	}
+
+	pthread_mutex_unlock (&d->mutex);
+
+	return task;
+}
+
+/* a worker queues tasks on its own deque, everybody else spreads
+ * them over all deques.
+ */
+static void
+push (Pool *pool, PoolTask *task)
+{
+	PoolWorker *w = self;
+	int count;
+
+	if (!w || w->pool != pool)
+		w = &pool->workers[__atomic_fetch_add (&pool->next, 1,
+		                                       __ATOMIC_RELAXED) %
+		                   pool->count];
+
+	count = deque_push (&w->deque, task);
+
+	/* pairs with the check in worker_main(): either the worker sees
+	 * the new task, or we see that it's about to sleep. a worker
+	 * gets to its own tasks anyway, unless it has more than one.
+	 */
+	__atomic_add_fetch (&pool->queued, 1, __ATOMIC_SEQ_CST);
+
+	if (LOAD (&pool->sleeping) && (w != self || count > 1)) {
+		pthread_mutex_lock (&pool->mutex);
+		pthread_cond_signal (&pool->cond);
+		pthread_mutex_unlock (&pool->mutex);
+	}
+}
+
+/* returns a task from the worker's own deque, or one that it stole
+ * from another worker, or NULL if there's nothing to do.
+ */
+static PoolTask *
+take (PoolWorker *w)
+{
+	Pool *pool = w->pool;
+	PoolTask *task;
+	int start;
+
+	if (LOAD (&pool->queued) <= 0)
+		return NULL;
+
+	task = deque_pop (&w->deque);
+
+	/* start at a random worker, so that thieves spread out */
+	start = rand_r (&w->seed);
+
+	for (int i = 0; !task && i < pool->count; i++) {
+		PoolWorker *victim = &pool->workers[(start + i) % pool->count];
+
+		if (victim == w)
+			continue;
+
+		task = deque_steal (&victim->deque);
+
+		if (task)
+			__atomic_add_fetch (&pool->stolen, 1, __ATOMIC_RELAXED);
+	}
+
+	if (task)
+		__atomic_sub_fetch (&pool->queued, 1, __ATOMIC_SEQ_CST);
+
+	return task;
+}
+
+static void
+run (Pool *pool, PoolTask *task)
+{
+	int state = TASK_RUNNING;
+
+	STORE (&task->state, TASK_RUNNING);
+
+	task->func (task);
+
+	__atomic_add_fetch (&pool->run, 1, __ATOMIC_RELAXED);
+
+	if (!CAS (&task->state, &state, TASK_IDLE)) {
+		STORE (&task->state, TASK_QUEUED);
+		push (pool, task);
+	}
+}
+
+/* schedules the tasks whose timers have expired. they're claimed
+ * while the mutex is held, see pool_cancel().
+ */
+static void
+fire_timers (Pool *pool)
+{
+	PoolTask *expired[TIMER_BATCH];
+	Timer *t;
+	int count = 0;
+	int64_t now;
+
+	pthread_mutex_lock (&pool->mutex);
+
+	if (pool->timers.count) {
+		now = timer_now ();
+
+		while (count < TIMER_BATCH &&
+		       (t = timer_heap_pop_expired (&pool->timers, now)))
+			if (claim (t->data))
+				expired[count++] = t->data;
+	}
+
+	pthread_mutex_unlock (&pool->mutex);
+
+	for (int i = 0; i < count; i++)
+		push (pool, expired[i]);
+}
+
+static void *
+worker_main (void *arg)
+{
+	PoolWorker *w = arg;
+	Pool *pool = w->pool;
+
+	self = w;
+
+	for (;;) {
+		PoolTask *task;
+		Timer *t;
+
+		fire_timers (pool);
+
+		task = take (w);
+
+		if (task) {
+			run (pool, task);
+			continue;
+		}
+
+		pthread_mutex_lock (&pool->mutex);
+
+		if (pool->shutdown) {
+			pthread_mutex_unlock (&pool->mutex);
+			break;
+		}
+
+		__atomic_add_fetch (&pool->sleeping, 1, __ATOMIC_SEQ_CST);
+
+		if (LOAD (&pool->queued) <= 0) {
+			t = timer_heap_peek (&pool->timers);
+
+			if (!t) {
+				pthread_cond_wait (&pool->cond, &pool->mutex);
+			} else if (t->expires > timer_now ()) {
+				struct timespec ts;
+
+				ts.tv_sec = t->expires / 1000;
+				ts.tv_nsec = (t->expires % 1000) * 1000000;
+
+				pthread_cond_timedwait (&pool->cond, &pool->mutex,
+				                        &ts);
+			}
+		}
+
+		__atomic_sub_fetch (&pool->sleeping, 1, __ATOMIC_SEQ_CST);
+
+		pthread_mutex_unlock (&pool->mutex);
+	}
+
+	return NULL;
+}
+
+/* starts 'workers' threads. returns NULL if none could be started. */
+Pool *
+pool_new (int workers)
+{
+	Pool *pool;
+	pthread_condattr_t attr;
+
+	pool = calloc (1, sizeof (Pool));
+	pool->workers = calloc (workers, sizeof (PoolWorker));
+
+	pthread_mutex_init (&pool->mutex, NULL);
+
+	/* the timers are on the monotonic clock, see timer_now() */
+	pthread_condattr_init (&attr);
+	pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+	pthread_cond_init (&pool->cond, &attr);
+	pthread_condattr_destroy (&attr);
+
+	timer_heap_init (&pool->timers);
+
+	for (int i = 0; i < workers; i++) {
+		PoolWorker *w = &pool->workers[i];
+
+		w->pool = pool;
+		w->seed = i + 1;
+		pthread_mutex_init (&w->deque.mutex, NULL);
+	}
+
+	/* the workers only look at the ones that were started */
+	for (pool->count = 0; pool->count < workers; pool->count++)
+		if (pthread_create (&pool->workers[pool->count].thread, NULL,
+		                    worker_main, &pool->workers[pool->count]))
+			break;
+
+	pool->running = pool->count;
+
+	if (!pool->count) {
+		pool_free (pool);
+		return NULL;
+	}
+
+	return pool;
+}
+
+/* lets the workers run the tasks that are queued, then stops them.
+ * timers that haven't expired yet are dropped.
+ */
+void
+pool_stop (Pool *pool)
+{
+	pthread_mutex_lock (&pool->mutex);
+	pool->shutdown = true;
+	pthread_cond_broadcast (&pool->cond);
+	pthread_mutex_unlock (&pool->mutex);
+
+	for (int i = 0; i < pool->running; i++)
+		pthread_join (pool->workers[i].thread, NULL);
+
+	pool->running = 0;
+}
+
+void
+pool_free (Pool *pool)
+{
+	pool_stop (pool);
+
+	for (int i = 0; i < pool->count; i++) {
+		pthread_mutex_destroy (&pool->workers[i].deque.mutex);
+		free (pool->workers[i].deque.tasks);
+	}
+
+	timer_heap_clear (&pool->timers);
+	pthread_cond_destroy (&pool->cond);
+	pthread_mutex_destroy (&pool->mutex);
+
+	free (pool->workers);
+	free (pool);
+}
+
+/* makes sure the task runs (again) soon */
+void
+pool_schedule (Pool *pool, PoolTask *task)
+{
+	if (claim (task))
+		push (pool, task);
+}
+
+/* schedules the task at 'when' (see timer_now()). if its timer is
+ * scheduled already, it's moved, even if that's later.
+ */
+void
+pool_schedule_at (Pool *pool, PoolTask *task, int64_t when)
+{
+	pthread_mutex_lock (&pool->mutex);
+
+	timer_heap_schedule (&pool->timers, &task->timer, when);
+
+	/* a sleeping worker might have to wake up earlier */
+	if (timer_heap_peek (&pool->timers) == &task->timer)
+		pthread_cond_signal (&pool->cond);
+
+	pthread_mutex_unlock (&pool->mutex);
+}
+
+/* cancels the task's timer. once this returns, the timer won't
+ * schedule the task anymore; if it has just expired, the task is
+ * queued already.
+ */
+void
+pool_cancel (Pool *pool, PoolTask *task)
+{
+	pthread_mutex_lock (&pool->mutex);
+
+	if (timer_is_scheduled (&task->timer))
+		timer_heap_cancel (&pool->timers, &task->timer);
+
+	pthread_mutex_unlock (&pool->mutex);
+}
@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2009 Tilman Sauerbeck (tilman at xmms org)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _POOL_H
+#define _POOL_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "timer.h"
+
+typedef struct __PoolTask PoolTask;
+
+/* a piece of work that's run by one of the pool's workers, eg
+ * everything a server has to do. a task is embedded in the object
+ * it works on, so scheduling it doesn't allocate anything. it's
+ * never queued more than once and never run by two workers at the
+ * same time; if it's scheduled while it's running, it's run again
+ * afterwards.
+ */
+struct __PoolTask {
+	void (*func) (PoolTask *task);
+	void *data;
+	int state;
+	Timer timer; /* see pool_schedule_at() */
+};
+
+/* the tasks that are waiting for a worker. the worker takes the
+ * newest one from the bottom, other workers steal the oldest one from
+ * the top.
+ */
+typedef struct {
+	pthread_mutex_t mutex;
+	PoolTask **tasks;
+	int top, count, allocated;
+} PoolDeque;
+
+typedef struct {
+	struct __Pool *pool;
+	pthread_t thread;
+	unsigned int seed;
+	PoolDeque deque;
+} PoolWorker;
+
+typedef struct __Pool {
+	PoolWorker *workers;
+	int count;
+	int running; /* workers that haven't been stopped yet */
+
+	/* protects the timers and 'shutdown'. idle workers wait on
+	 * 'cond' until a task is queued or the next timer expires.
+	 */
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	TimerHeap timers;
+	bool shutdown;
+
+	int queued; /* tasks in all deques */
+	int sleeping;
+	unsigned int next; /* the deque for tasks from other threads */
+
+	unsigned long run, stolen;
+} Pool;
+
+void pool_task_init (PoolTask *task, void (*func) (PoolTask *task),
+                     void *data);
+bool pool_task_is_idle (PoolTask *task);
+
+Pool *pool_new (int workers);
+void pool_stop (Pool *pool);
+void pool_free (Pool *pool);
+
+void pool_schedule (Pool *pool, PoolTask *task);
+void pool_schedule_at (Pool *pool, PoolTask *task, int64_t when);
+void pool_cancel (Pool *pool, PoolTask *task);
+
+#endif
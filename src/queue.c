@@ -25,52 +25,108 @@
 
 #include "queue.h"
 
+/* the number of drained chunks to hold on to */
+#define MAX_SPARE_CHUNKS 4
+
 void
 queue_init (Queue *q)
 {
-	q->head = q->tail = NULL;
+	q->head = q->tail = q->spare = NULL;
+	q->head_index = q->tail_index = 0;
+	q->length = 0;
 }
 
+/* frees all chunks. the items themselves are left alone. */
 void
-queue_push (Queue *q, void *data)
+queue_clear (Queue *q)
 {
-	QueueItem *item;
+	QueueChunk *lists[] = { q->head, q->spare };
+
+	for (int i = 0; i < 2; i++) {
+		while (lists[i]) {
+			QueueChunk *next = lists[i]->next;
+
+			free (lists[i]);
+			lists[i] = next;
+		}
+	}
 
-	item = malloc (sizeof (QueueItem));
+	queue_init (q);
+}
+
+static QueueChunk *
+chunk_new (Queue *q)
+{
+	QueueChunk *chunk;
 
-	item->next = NULL;
-	item->data = data;
+	if (q->spare) {
+		chunk = q->spare;
+		q->spare = chunk->next;
+	} else {
+		chunk = malloc (sizeof (QueueChunk));
+	}
 
-	if (q->tail)
-		q->tail->next = item;
+	chunk->next = NULL;
 
-	q->tail = item;
+	return chunk;
+}
 
-	if (!q->head)
-		q->head = item;
+static void
+chunk_release (Queue *q, QueueChunk *chunk)
+{
+	int spares = 0;
+
+	for (QueueChunk *c = q->spare; c; c = c->next)
+		spares++;
+
+	if (spares >= MAX_SPARE_CHUNKS) {
+		free (chunk);
+	} else {
+		chunk->next = q->spare;
+		q->spare = chunk;
+	}
+}
+
+void
+queue_push (Queue *q, void *data)
+{
+	if (!q->tail) {
+		q->head = q->tail = chunk_new (q);
+		q->head_index = q->tail_index = 0;
+	} else if (q->tail_index == QUEUE_CHUNK_SIZE) {
+		q->tail->next = chunk_new (q);
+		q->tail = q->tail->next;
+		q->tail_index = 0;
+	}
+
+	q->tail->items[q->tail_index++] = data;
+	q->length++;
 }
 
 void *
 queue_pop (Queue *q)
 {
-	QueueItem *item;
 	void *data;
 
-	if (!q->head)
+	if (!q->length)
 		return NULL;
 
-	item = q->head;
-	data = item->data;
-
-	q->head = q->head->next;
+	data = q->head->items[q->head_index++];
+	q->length--;
 
-	/* if we just removed the last item in the queue,
-	 * we also need to reset the tail pointer.
+	/* if we just removed the last item in the queue, head and tail
+	 * are the same chunk, and we can start over at its beginning.
 	 */
-	if (!q->head)
-		q->tail = NULL;
+	if (!q->length) {
+		q->head_index = q->tail_index = 0;
+	} else if (q->head_index == QUEUE_CHUNK_SIZE) {
+		QueueChunk *chunk = q->head;
 
-	free (item);
+		q->head = chunk->next;
+		q->head_index = 0;
+
+		chunk_release (q, chunk);
+	}
 
 	return data;
 }
@@ -78,5 +134,27 @@ queue_pop (Queue *q)
 void *
 queue_peek (Queue *q)
 {
-	return q->head ? q->head->data : NULL;
+	return q->length ? q->head->items[q->head_index] : NULL;
+}
+
+void *
+queue_peek_nth (Queue *q, int n)
+{
+	QueueChunk *chunk = q->head;
+
+	if (n < 0 || n >= q->length)
+		return NULL;
+
+	n += q->head_index;
+
+	for (; n >= QUEUE_CHUNK_SIZE; n -= QUEUE_CHUNK_SIZE)
+		chunk = chunk->next;
+
+	return chunk->items[n];
+}
+
+int
+queue_length (Queue *q)
+{
+	return q->length;
 }
@@ -24,20 +24,35 @@
 #ifndef _QUEUE_H
 #define _QUEUE_H
 
-typedef struct __QueueItem {
-	struct __QueueItem *next;
+/* number of items per chunk */
+#define QUEUE_CHUNK_SIZE 256
 
-	void *data;
-} QueueItem;
+typedef struct __QueueChunk {
+	struct __QueueChunk *next;
 
+	void *items[QUEUE_CHUNK_SIZE];
+} QueueChunk;
+
+/* a deque of fixed size chunks. items are appended at 'tail_index' of
+ * the tail chunk and removed at 'head_index' of the head chunk. chunks
+ * that have been drained are kept on the 'spare' list for reuse.
+ */
 typedef struct {
-	QueueItem *head;
-	QueueItem *tail;
+	QueueChunk *head;
+	QueueChunk *tail;
+	QueueChunk *spare;
+
+	int head_index;
+	int tail_index;
+	int length;
 } Queue;
 
 void queue_init (Queue *q);
+void queue_clear (Queue *q);
 void queue_push (Queue *q, void *data);
 void *queue_pop (Queue *q);
 void *queue_peek (Queue *q);
+void *queue_peek_nth (Queue *q, int n);
+int queue_length (Queue *q);
 
 #endif
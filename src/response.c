@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2009 Tilman Sauerbeck (tilman at xmms org)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <string.h>
+
+#include "response.h"
+
+void
+response_parser_init (ResponseParser *p, ResponseType type)
+{
+	p->type = type;
+	p->wanted = (type == RESPONSE_HANDSHAKE) ? RESPONSE_LINES : 1;
+	p->line = 0;
+	p->length = 0;
+	p->truncated = false;
+	p->too_long = false;
+
+	for (int i = 0; i < RESPONSE_LINES; i++)
+		p->lines[i][0] = 0;
+}
+
+/* terminates the current line and moves on to the next one */
+static void
+end_line (ResponseParser *p)
+{
+	char *line = p->lines[p->line];
+
+	/* lines might end in "\r\n" */
+	if (p->length && line[p->length - 1] == '\r')
+		p->length--;
+
+	line[p->length] = 0;
+
+	if (p->truncated && p->line != RESPONSE_LINE_STATUS)
+		p->too_long = true;
+
+	p->line++;
+	p->length = 0;
+	p->truncated = false;
+}
+
+void
+response_parser_feed (ResponseParser *p, const char *data, size_t length)
+{
+	const char *end = data + length;
+
+	while (data < end && p->line < p->wanted) {
+		const char *newline;
+		size_t n, room;
+
+		newline = memchr (data, '\n', end - data);
+		n = (newline ? newline : end) - data;
+
+		/* leave room for the terminator. a '\r' at the end of
+		 * the line is stored like any other character until
+		 * end_line() strips it.
+		 */
+		room = RESPONSE_MAX_LINE - 1 - p->length;
+
+		if (n > room) {
+			p->truncated = true;
+			n = room;
+		}
+
+		memcpy (p->lines[p->line] + p->length, data, n);
+		p->length += n;
+
+		if (!newline)
+			break;
+
+		end_line (p);
+		data = newline + 1;
+	}
+}
+
+/* evaluates the response once all of it has been fed to the parser.
+ * 'complete' is false if the transfer failed, in which case the last
+ * line only counts if it ended in a newline.
+ */
+ResponseStatus
+response_parser_finish (ResponseParser *p, bool complete)
+{
+	const char *status = p->lines[RESPONSE_LINE_STATUS];
+
+	if (complete && p->line < p->wanted && (p->length || p->truncated))
+		end_line (p);
+
+	if (!p->line)
+		return RESPONSE_INVALID;
+
+	if (!strncmp (status, "FAILED", 6))
+		return RESPONSE_FAILED;
+
+	if (!strcmp (status, "BADSESSION"))
+		return RESPONSE_BADSESSION;
+
+	if (strcmp (status, "OK"))
+		return RESPONSE_INVALID;
+
+	if (p->line < p->wanted || p->too_long)
+		return RESPONSE_INVALID;
+
+	for (int i = 1; i < p->wanted; i++)
+		if (!p->lines[i][0])
+			return RESPONSE_INVALID;
+
+	return RESPONSE_OK;
+}
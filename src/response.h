@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2009 Tilman Sauerbeck (tilman at xmms org)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _RESPONSE_H
+#define _RESPONSE_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+/* lines that are longer than this are cut off, except for the status
+ * line they make the response invalid.
+ */
+#define RESPONSE_MAX_LINE 256
+
+typedef enum {
+	RESPONSE_HANDSHAKE, /* status, session id, now-playing url, */
+	                    /* submission url */
+	RESPONSE_SUBMISSION /* status */
+} ResponseType;
+
+typedef enum {
+	RESPONSE_OK,
+	RESPONSE_BADSESSION,
+	RESPONSE_FAILED,
+	RESPONSE_INVALID /* anything else, incl. incomplete responses */
+} ResponseStatus;
+
+enum {
+	RESPONSE_LINE_STATUS,
+	RESPONSE_LINE_SESSION_ID,
+	RESPONSE_LINE_NP_URL,
+	RESPONSE_LINE_SUBM_URL,
+	RESPONSE_LINES
+};
+
+/* parses the body of a handshake or submission response, which can
+ * arrive in any number of pieces. the parser doesn't allocate: the
+ * lines that are of interest are collected in 'lines', everything
+ * else is skipped.
+ */
+typedef struct {
+	ResponseType type;
+	int wanted; /* number of lines that are of interest */
+	int line; /* the line that's being read */
+	int length; /* its length so far */
+	bool truncated; /* whether it was cut off */
+	bool too_long; /* whether a line other than the status was */
+
+	char lines[RESPONSE_LINES][RESPONSE_MAX_LINE];
+} ResponseParser;
+
+void response_parser_init (ResponseParser *p, ResponseType type);
+void response_parser_feed (ResponseParser *p, const char *data,
+                           size_t length);
+ResponseStatus response_parser_finish (ResponseParser *p, bool complete);
+
+#endif
@@ -0,0 +1,246 @@
+/*
+ * Copyright (c) 2009 Tilman Sauerbeck (tilman at xmms org)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include "ring.h"
+
+#define LOAD(p) __atomic_load_n ((p), __ATOMIC_ACQUIRE)
+#define STORE(p, v) __atomic_store_n ((p), (v), __ATOMIC_RELEASE)
+
+/* the wakeup channel is an eventfd where available, and a pipe
+ * otherwise. either way, wake_fd[0] is read and wake_fd[1] is written.
+ */
+static bool
+wake_fd_open (Ring *r)
+{
+#ifdef __linux__
+	r->wake_fd[0] = r->wake_fd[1] = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	return r->wake_fd[0] != -1;
+#else
+	if (pipe (r->wake_fd))
+		return false;
+
+	for (int i = 0; i < 2; i++) {
+		fcntl (r->wake_fd[i], F_SETFL, O_NONBLOCK);
+		fcntl (r->wake_fd[i], F_SETFD, FD_CLOEXEC);
+	}
+
+	return true;
+#endif
+}
+
+static void
+wake_fd_close (Ring *r)
+{
+	close (r->wake_fd[0]);
+
+	if (r->wake_fd[1] != r->wake_fd[0])
+		close (r->wake_fd[1]);
+}
+
+Ring *
+ring_new (unsigned int capacity)
+{
+	Ring *r;
+	unsigned int size = 1;
+
+	while (size < capacity)
+		size *= 2;
+
+	if (posix_memalign ((void **) &r, CACHELINE, sizeof (Ring)))
+		return NULL;
+
+	if (!wake_fd_open (r)) {
+		free (r);
+		return NULL;
+	}
+
+	r->slots = malloc (size * sizeof (void *));
+	r->mask = size - 1;
+
+	r->head = r->tail = 0;
+	r->waiting = 0;
+	r->overflowed = 0;
+
+	pthread_mutex_init (&r->overflow_mutex, NULL);
+	queue_init (&r->overflow);
+	r->overflowing = 0;
+
+	return r;
+}
+
+/* items that are still in the ring are left alone */
+void
+ring_free (Ring *r)
+{
+	wake_fd_close (r);
+
+	pthread_mutex_destroy (&r->overflow_mutex);
+	queue_clear (&r->overflow);
+
+	free (r->slots);
+	free (r);
+}
+
+void
+ring_push (Ring *r, void *data)
+{
+	/* once the ring has overflowed, new items must go to the overflow
+	 * queue until it's empty again, so they stay in order.
+	 * only the producer ever sets 'overflowing', so if it's clear
+	 * here, it stays clear.
+	 */
+	if (!LOAD (&r->overflowing)) {
+		unsigned int tail = r->tail;
+
+		if (tail - LOAD (&r->head) <= r->mask) {
+			r->slots[tail & r->mask] = data;
+			STORE (&r->tail, tail + 1);
+
+			goto out;
+		}
+	}
+
+	pthread_mutex_lock (&r->overflow_mutex);
+	queue_push (&r->overflow, data);
+	STORE (&r->overflowing, 1);
+	r->overflowed++;
+	pthread_mutex_unlock (&r->overflow_mutex);
+
+out:
+	/* pairs with the fence in ring_wait(): either the consumer sees
+	 * the new item, or we see that it's about to sleep. only the
+	 * first push after it went to sleep needs to wake it up.
+	 */
+	__atomic_thread_fence (__ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n (&r->waiting, __ATOMIC_RELAXED) &&
+	    __atomic_exchange_n (&r->waiting, 0, __ATOMIC_RELAXED))
+		ring_wake (r);
+}
+
+/* returns the oldest item, or NULL if there is none */
+void *
+ring_pop (Ring *r)
+{
+	void *data;
+
+	while (true) {
+		unsigned int head = r->head;
+
+		if (head != LOAD (&r->tail)) {
+			data = r->slots[head & r->mask];
+			STORE (&r->head, head + 1);
+
+			return data;
+		}
+
+		if (!LOAD (&r->overflowing))
+			return NULL;
+
+		pthread_mutex_lock (&r->overflow_mutex);
+
+		/* the items in the ring are older than the ones in the
+		 * overflow queue, and the producer might have filled the
+		 * ring again before it overflowed.
+		 */
+		if (head != LOAD (&r->tail)) {
+			pthread_mutex_unlock (&r->overflow_mutex);
+			continue;
+		}
+
+		data = queue_pop (&r->overflow);
+
+		if (!queue_peek (&r->overflow))
+			STORE (&r->overflowing, 0);
+
+		pthread_mutex_unlock (&r->overflow_mutex);
+
+		return data;
+	}
+}
+
+static bool
+is_empty (Ring *r)
+{
+	return r->head == LOAD (&r->tail) && !LOAD (&r->overflowing);
+}
+
+/* sleeps until an item is pushed, ring_wake() is called or 'timeout'
+ * milliseconds have passed. a negative timeout means no timeout.
+ * returns false on timeout.
+ */
+bool
+ring_wait (Ring *r, int timeout)
+{
+	struct pollfd pfd = { .fd = r->wake_fd[0], .events = POLLIN };
+	char buf[8];
+	int n;
+
+	__atomic_store_n (&r->waiting, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence (__ATOMIC_SEQ_CST);
+
+	if (!is_empty (r)) {
+		__atomic_store_n (&r->waiting, 0, __ATOMIC_RELAXED);
+		return true;
+	}
+
+	do {
+		n = poll (&pfd, 1, timeout);
+	} while (n == -1 && errno == EINTR);
+
+	__atomic_store_n (&r->waiting, 0, __ATOMIC_RELAXED);
+
+	if (n <= 0)
+		return false;
+
+	while (read (r->wake_fd[0], buf, sizeof (buf)) > 0)
+		;
+
+	return true;
+}
+
+void
+ring_wake (Ring *r)
+{
+	static const uint64_t one = 1;
+	ssize_t n;
+
+	/* an eventfd wants an 8 byte counter, a pipe takes anything.
+	 * if the write fails because the counter or pipe is full, there's
+	 * a wakeup pending already.
+	 */
+	n = write (r->wake_fd[1], &one, sizeof (one));
+	(void) n;
+}
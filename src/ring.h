@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2009 Tilman Sauerbeck (tilman at xmms org)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _RING_H
+#define _RING_H
+
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "queue.h"
+
+#define CACHELINE 64
+
+/* a bounded single-producer/single-consumer ring of pointers.
+ * ring_push() doesn't take a lock as long as there's room in the ring;
+ * when it's full, items are put on the 'overflow' queue instead, and
+ * keep going there until the consumer has emptied it.
+ *
+ * the consumer can sleep in ring_wait(), which is woken up by the next
+ * push. the producer only makes a syscall if the consumer is asleep.
+ */
+typedef struct {
+	void **slots;
+	unsigned int mask;
+
+	/* written by the consumer */
+	unsigned int head __attribute__ ((aligned (CACHELINE)));
+	int waiting;
+
+	/* written by the producer */
+	unsigned int tail __attribute__ ((aligned (CACHELINE)));
+	unsigned long overflowed;
+
+	/* the slow path */
+	pthread_mutex_t overflow_mutex __attribute__ ((aligned (CACHELINE)));
+	Queue overflow;
+	int overflowing;
+
+	int wake_fd[2];
+} Ring;
+
+Ring *ring_new (unsigned int capacity);
+void ring_free (Ring *r);
+void ring_push (Ring *r, void *data);
+void *ring_pop (Ring *r);
+bool ring_wait (Ring *r, int timeout);
+void ring_wake (Ring *r);
+
+#endif
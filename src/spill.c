@@ -0,0 +1,387 @@
+/*
+ * Copyright (c) 2009 Tilman Sauerbeck (tilman at xmms org)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#include "spill.h"
+#include "log.h"
+
+/* a new segment is started once the current one is this big */
+#define SEGMENT_SIZE (4 * 1024 * 1024)
+
+/* pending lines are written in chunks of (at least) this size, and
+ * segments are read in chunks of this size.
+ */
+#define CHUNK_SIZE (64 * 1024)
+
+static bool
+write_all (int fd, const char *buf, size_t len)
+{
+	while (len) {
+		ssize_t w = write (fd, buf, len);
+
+		if (w == -1 && errno == EINTR)
+			continue;
+
+		if (w == -1)
+			return false;
+
+		buf += w;
+		len -= w;
+	}
+
+	return true;
+}
+
+static void
+segment_name (Spill *s, unsigned int segment, char *buf, size_t size)
+{
+	snprintf (buf, size, "%s.%u", s->prefix, segment);
+}
+
+static int
+open_segment (Spill *s, unsigned int segment, int flags)
+{
+	char filename[PATH_MAX + 16];
+	int fd;
+
+	segment_name (s, segment, filename, sizeof (filename));
+
+	fd = open (filename, flags, 0600);
+
+	if (fd == -1)
+		log_error ("spill: cannot open '%s': %s\n",
+		           filename, strerror (errno));
+	else if (!(flags & O_WRONLY))
+		posix_fadvise (fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	return fd;
+}
+
+static void
+remove_segment (Spill *s, unsigned int segment)
+{
+	char filename[PATH_MAX + 16];
+
+	segment_name (s, segment, filename, sizeof (filename));
+	unlink (filename);
+}
+
+/* removes the segments that a previous run left behind */
+static void
+remove_stale_segments (Spill *s)
+{
+	char dir[PATH_MAX], filename[PATH_MAX * 2];
+	const char *base, *slash;
+	struct dirent *dirent;
+	size_t base_length;
+	DIR *dp;
+
+	slash = strrchr (s->prefix, '/');
+
+	if (slash) {
+		snprintf (dir, sizeof (dir), "%.*s",
+		          (int) (slash - s->prefix), s->prefix);
+		base = slash + 1;
+	} else {
+		strcpy (dir, ".");
+		base = s->prefix;
+	}
+
+	base_length = strlen (base);
+
+	dp = opendir (dir);
+
+	if (!dp)
+		return;
+
+	while ((dirent = readdir (dp))) {
+		if (strncmp (dirent->d_name, base, base_length) ||
+		    dirent->d_name[base_length] != '.')
+			continue;
+
+		snprintf (filename, sizeof (filename), "%s/%s",
+		          dir, dirent->d_name);
+		unlink (filename);
+	}
+
+	closedir (dp);
+}
+
+static bool
+open_writer (Spill *s)
+{
+	s->write_fd = open_segment (s, s->last, O_WRONLY | O_CREAT |
+	                            O_TRUNC | O_APPEND);
+
+	return s->write_fd != -1;
+}
+
+/* writes the pending lines to the newest segment. if that fails, they
+ * stay pending, so they're written on the next try or handed to the
+ * reader by take_pending().
+ */
+static bool
+flush_pending (Spill *s)
+{
+	if (!s->pending->length)
+		return true;
+
+	if (s->write_fd == -1 && !open_writer (s))
+		return false;
+
+	if (!write_all (s->write_fd, s->pending->buf, s->pending->length)) {
+		log_error ("spill: cannot write to '%s.%u': %s\n",
+		           s->prefix, s->last, strerror (errno));
+
+		/* drop the part that was written, it's written again */
+		if (ftruncate (s->write_fd, s->write_size))
+			log_error ("spill: cannot truncate '%s.%u': %s\n",
+			           s->prefix, s->last, strerror (errno));
+
+		/* don't try again for every single line */
+		s->flush_at = s->pending->length + CHUNK_SIZE;
+
+		return false;
+	}
+
+	s->write_size += s->pending->length;
+	s->flush_at = CHUNK_SIZE;
+	strbuf_truncate (s->pending, 0);
+
+	return true;
+}
+
+/* moves the pending lines to the read-ahead buffer. that's only done
+ * once the newest segment has been read completely, so they stay in
+ * order.
+ */
+static bool
+take_pending (Spill *s)
+{
+	int length = s->pending->length;
+
+	if (!length)
+		return false;
+
+	if (s->buf_end + length > s->buf_size) {
+		s->buf_size = s->buf_end + length;
+		s->buf = realloc (s->buf, s->buf_size);
+	}
+
+	memcpy (s->buf + s->buf_end, s->pending->buf, length);
+	s->buf_end += length;
+
+	strbuf_truncate (s->pending, 0);
+
+	return true;
+}
+
+/* starts over with an empty segment once everything has been read */
+static void
+reset (Spill *s)
+{
+	if (s->read_fd > -1)
+		close (s->read_fd);
+
+	if (s->write_fd > -1)
+		close (s->write_fd);
+
+	for (unsigned int i = s->first; i <= s->last; i++)
+		remove_segment (s, i);
+
+	s->first = s->last = s->last + 1;
+	s->read_fd = s->write_fd = -1;
+	s->write_size = 0;
+	s->buf_start = s->buf_end = 0;
+	s->count = 0;
+	s->flush_at = CHUNK_SIZE;
+
+	strbuf_truncate (s->pending, 0);
+}
+
+Spill *
+spill_new (const char *prefix)
+{
+	Spill *s;
+
+	s = malloc (sizeof (Spill));
+
+	strncpy (s->prefix, prefix, sizeof (s->prefix));
+	s->prefix[sizeof (s->prefix) - 1] = 0;
+
+	s->first = s->last = 0;
+	s->read_fd = s->write_fd = -1;
+	s->write_size = 0;
+	s->count = 0;
+
+	s->pending = strbuf_new ();
+	s->flush_at = CHUNK_SIZE;
+
+	s->buf_size = CHUNK_SIZE;
+	s->buf = malloc (s->buf_size);
+	s->buf_start = s->buf_end = 0;
+
+	remove_stale_segments (s);
+
+	return s;
+}
+
+void
+spill_free (Spill *s)
+{
+	reset (s);
+
+	strbuf_free (s->pending);
+	free (s->buf);
+	free (s);
+}
+
+/* appends a line, which must not contain newlines.
+ * returns false if the line cannot be stored, which can only happen
+ * while the spill is empty. once it holds lines, newer ones must queue
+ * up behind them, so lines that cannot be written are kept in memory
+ * instead.
+ */
+bool
+spill_write (Spill *s, const char *line, int length)
+{
+	if (!s->count && s->write_fd == -1 && !open_writer (s))
+		return false;
+
+	strbuf_append_len (s->pending, line, length);
+	strbuf_append (s->pending, "\n");
+	s->count++;
+
+	if (s->pending->length < s->flush_at || !flush_pending (s))
+		return true;
+
+	/* the reader opens the segment by itself */
+	if (s->write_size >= SEGMENT_SIZE) {
+		close (s->write_fd);
+		s->write_fd = -1;
+		s->write_size = 0;
+		s->last++;
+	}
+
+	return true;
+}
+
+/* returns the oldest line that hasn't been read yet, or NULL.
+ * the line isn't NUL-terminated and stays valid until the next call.
+ */
+const char *
+spill_read (Spill *s, int *length)
+{
+	while (s->count) {
+		char *line = s->buf + s->buf_start, *newline;
+		ssize_t r;
+
+		newline = memchr (line, '\n', s->buf_end - s->buf_start);
+
+		if (newline) {
+			*length = newline - line;
+			s->buf_start += *length + 1;
+
+			/* the line stays valid; reset() only rewinds the
+			 * read-ahead buffer.
+			 */
+			if (!--s->count)
+				reset (s);
+
+			return line;
+		}
+
+		/* make room for the next chunk */
+		memmove (s->buf, line, s->buf_end - s->buf_start);
+		s->buf_end -= s->buf_start;
+		s->buf_start = 0;
+
+		/* the line is longer than the buffer */
+		if (s->buf_end == s->buf_size) {
+			s->buf_size *= 2;
+			s->buf = realloc (s->buf, s->buf_size);
+		}
+
+		/* the lines that were written last might still be in
+		 * memory.
+		 */
+		if (s->first == s->last)
+			flush_pending (s);
+
+		if (s->read_fd == -1) {
+			s->read_fd = open_segment (s, s->first, O_RDONLY);
+
+			if (s->read_fd == -1) {
+				if (s->first == s->last && take_pending (s))
+					continue;
+
+				break;
+			}
+		}
+
+		r = read (s->read_fd, s->buf + s->buf_end,
+		          s->buf_size - s->buf_end);
+
+		if (r == -1 && errno == EINTR)
+			continue;
+
+		if (r == -1) {
+			log_error ("spill: cannot read '%s.%u': %s\n",
+			           s->prefix, s->first, strerror (errno));
+			break;
+		}
+
+		if (r > 0) {
+			s->buf_end += r;
+			continue;
+		}
+
+		/* the newest segment cannot end before the last line,
+		 * unless the rest couldn't be written.
+		 */
+		if (s->first == s->last) {
+			if (take_pending (s))
+				continue;
+
+			break;
+		}
+
+		close (s->read_fd);
+		s->read_fd = -1;
+		remove_segment (s, s->first++);
+	}
+
+	if (s->count) {
+		log_error ("spill: lost %i lines\n", s->count);
+		reset (s);
+	}
+
+	return NULL;
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2009 Tilman Sauerbeck (tilman at xmms org)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _SPILL_H
+#define _SPILL_H
+
+#include <limits.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include "strbuf.h"
+
+/* a spill is a FIFO of lines that lives in a series of segment files
+ * (<prefix>.0, <prefix>.1, ...), so that long queues don't have to be
+ * kept in memory. lines are written to the newest segment and read back
+ * from the oldest one, which is removed once it has been read.
+ * the segments are only a cache: they aren't synced and they are
+ * removed by spill_new() and spill_free(). lines that cannot be written
+ * are kept in memory and read back from there.
+ */
+typedef struct {
+	char prefix[PATH_MAX];
+
+	/* the segments being read and written */
+	unsigned int first, last;
+	int read_fd, write_fd;
+	off_t write_size;
+
+	/* lines that haven't been written yet. they're written once
+	 * there are 'flush_at' bytes.
+	 */
+	StrBuf *pending;
+	int flush_at;
+
+	/* read-ahead buffer */
+	char *buf;
+	int buf_size, buf_start, buf_end;
+
+	/* lines that haven't been read back yet */
+	int count;
+} Spill;
+
+Spill *spill_new (const char *prefix);
+void spill_free (Spill *s);
+bool spill_write (Spill *s, const char *line, int length);
+const char *spill_read (Spill *s, int *length);
+
+#endif
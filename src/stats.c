@@ -0,0 +1,257 @@
+/*
+ * Copyright (c) 2009 Tilman Sauerbeck (tilman at xmms org)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "stats.h"
+
+#define STATS_READ_TRIES 100000
+
+static StatsSegment *segment;
+static char segment_name[64];
+static int segment_fd = -1;
+
+void
+stats_segment_name (char *buf, size_t size, uid_t uid)
+{
+	snprintf (buf, size, "/xmms2-scrobbler-%lu", (unsigned long) uid);
+}
+
+/* creates the segment for this process.
+ * an existing segment is taken over, since it can only have been left
+ * behind by an instance that is gone now or that will be gone soon.
+ */
+bool
+stats_open (void)
+{
+	uint32_t capacity = STATS_INITIAL_SERVERS;
+	struct stat st;
+	void *p;
+
+	stats_segment_name (segment_name, sizeof (segment_name), getuid ());
+
+	segment_fd = shm_open (segment_name, O_RDWR | O_CREAT, 0644);
+
+	if (segment_fd == -1)
+		return false;
+
+	/* a segment that is taken over doesn't shrink, in case a reader
+	 * is still looking at its slots.
+	 */
+	if (!fstat (segment_fd, &st))
+		while (capacity < STATS_MAX_SERVERS &&
+		       STATS_SEGMENT_SIZE (capacity) < (size_t) st.st_size)
+			capacity *= 2;
+
+	if (ftruncate (segment_fd, STATS_SEGMENT_SIZE (capacity)))
+		goto fail;
+
+	p = mmap (NULL, STATS_SEGMENT_SIZE (STATS_MAX_SERVERS),
+	          PROT_READ | PROT_WRITE, MAP_SHARED, segment_fd, 0);
+
+	if (p == MAP_FAILED)
+		goto fail;
+
+	segment = p;
+
+	/* readers check the magic value last, so clear it first */
+	__atomic_store_n (&segment->magic, 0, __ATOMIC_RELEASE);
+	memset ((char *) segment + sizeof (segment->magic), 0,
+	        STATS_SEGMENT_SIZE (capacity) - sizeof (segment->magic));
+
+	segment->capacity = capacity;
+	segment->version = STATS_VERSION;
+	segment->pid = getpid ();
+	segment->started = time (NULL);
+
+	__atomic_store_n (&segment->magic, STATS_MAGIC, __ATOMIC_RELEASE);
+
+	return true;
+
+fail:
+	close (segment_fd);
+	segment_fd = -1;
+	shm_unlink (segment_name);
+
+	return false;
+}
+
+void
+stats_close (void)
+{
+	if (!segment)
+		return;
+
+	munmap (segment, STATS_SEGMENT_SIZE (STATS_MAX_SERVERS));
+	close (segment_fd);
+	shm_unlink (segment_name);
+
+	segment = NULL;
+	segment_fd = -1;
+}
+
+/* returns NULL if stats aren't available, or if the segment cannot
+ * grow any further.
+ */
+StatsServer *
+stats_add_server (const char *name)
+{
+	StatsServer *s;
+
+	if (!segment)
+		return NULL;
+
+	/* a server that was removed and added again keeps its slot */
+	for (uint32_t i = 0; i < segment->count; i++)
+		if (!strncmp (segment->servers[i].name, name,
+		              sizeof (segment->servers[i].name) - 1))
+			return &segment->servers[i];
+
+	if (segment->count == segment->capacity) {
+		uint32_t capacity = segment->capacity * 2;
+
+		if (capacity > STATS_MAX_SERVERS ||
+		    ftruncate (segment_fd, STATS_SEGMENT_SIZE (capacity)))
+			return NULL;
+
+		__atomic_store_n (&segment->capacity, capacity,
+		                  __ATOMIC_RELEASE);
+	}
+
+	s = &segment->servers[segment->count];
+
+	strncpy (s->name, name, sizeof (s->name));
+	s->name[sizeof (s->name) - 1] = 0;
+
+	__atomic_store_n (&segment->count, segment->count + 1,
+	                  __ATOMIC_RELEASE);
+
+	return s;
+}
+
+void
+stats_begin (StatsServer *s)
+{
+	uint32_t seq;
+
+	do {
+		seq = __atomic_load_n (&s->sequence, __ATOMIC_RELAXED);
+	} while ((seq & 1) ||
+	         !__atomic_compare_exchange_n (&s->sequence, &seq, seq + 1,
+	                                       true, __ATOMIC_ACQUIRE,
+	                                       __ATOMIC_RELAXED));
+
+	/* readers mustn't see the new values without the odd sequence */
+	__atomic_thread_fence (__ATOMIC_RELEASE);
+}
+
+void
+stats_end (StatsServer *s)
+{
+	__atomic_store_n (&s->sequence, s->sequence + 1, __ATOMIC_RELEASE);
+}
+
+/* maps the segment of the xmms2-scrobbler instance that runs as 'uid'.
+ * that's all the interaction there is: reading the counters doesn't
+ * involve the daemon at all.
+ */
+const StatsSegment *
+stats_attach (uid_t uid)
+{
+	char name[64];
+	StatsSegment *p;
+	struct stat st;
+	int fd;
+
+	stats_segment_name (name, sizeof (name), uid);
+
+	fd = shm_open (name, O_RDONLY, 0);
+
+	if (fd == -1)
+		return NULL;
+
+	/* it might not have been set up yet */
+	if (fstat (fd, &st) || (size_t) st.st_size < STATS_SEGMENT_SIZE (0)) {
+		close (fd);
+
+		return NULL;
+	}
+
+	p = mmap (NULL, STATS_SEGMENT_SIZE (STATS_MAX_SERVERS), PROT_READ,
+	          MAP_SHARED, fd, 0);
+	close (fd);
+
+	if (p == MAP_FAILED)
+		return NULL;
+
+	if (__atomic_load_n (&p->magic, __ATOMIC_ACQUIRE) != STATS_MAGIC ||
+	    p->version != STATS_VERSION) {
+		stats_detach (p);
+
+		return NULL;
+	}
+
+	return p;
+}
+
+void
+stats_detach (const StatsSegment *segment)
+{
+	munmap ((void *) segment, STATS_SEGMENT_SIZE (STATS_MAX_SERVERS));
+}
+
+/* takes a consistent snapshot of 's'.
+ * fails if the record stays locked, which happens if the daemon died
+ * while updating it.
+ */
+bool
+stats_read (const StatsServer *s, StatsServer *copy)
+{
+	uint32_t before, after;
+
+	for (int tries = 0; tries < STATS_READ_TRIES; tries++) {
+		before = __atomic_load_n (&s->sequence, __ATOMIC_ACQUIRE);
+
+		if (before & 1) {
+			sched_yield ();
+			continue;
+		}
+
+		memcpy (copy, s, sizeof (StatsServer));
+
+		__atomic_thread_fence (__ATOMIC_ACQUIRE);
+		after = __atomic_load_n (&s->sequence, __ATOMIC_RELAXED);
+
+		if (before == after)
+			return true;
+	}
+
+	return false;
+}
@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2009 Tilman Sauerbeck (tilman at xmms org)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define STATS_MAGIC 0x78327363 /* "x2sc" */
+#define STATS_VERSION 4
+
+/* the segment starts out with room for STATS_INITIAL_SERVERS and
+ * doubles in size when it's full, up to STATS_MAX_SERVERS.
+ */
+#define STATS_INITIAL_SERVERS 16
+#define STATS_MAX_SERVERS 16384
+
+/* the counters of one server.
+ * they're protected by a seqlock: writers make 'sequence' odd while
+ * they're updating the record, and readers retry until they've seen
+ * the same even value before and after copying it.
+ * as the xmms2 thread and the server's thread both update the record,
+ * making 'sequence' odd also serves as a lock between writers.
+ */
+typedef struct {
+	uint32_t sequence;
+	char name[64];
+
+	uint64_t queue_depth; /* profile submissions that haven't been sent */
+	uint64_t queued_bytes; /* size of their text fields */
+	uint64_t spilled; /* queued submissions that are kept on disk */
+	uint64_t sent, acked, failed; /* counted in submissions */
+	uint64_t handshakes;
+	uint64_t bad_sessions;
+	uint64_t now_playing_coalesced; /* superseded before being sent */
+	uint32_t hard_failures;
+	int64_t last_success; /* unix time, 0 if never */
+} __attribute__ ((aligned (64))) StatsServer;
+
+/* the layout of the shared memory segment.
+ * 'count' only ever grows, and a slot's name is written before
+ * 'count' is bumped. the segment is grown before that, so the slots
+ * below 'count' are always backed.
+ * everybody maps room for STATS_MAX_SERVERS slots, so the segment
+ * never has to be mapped again when it grows.
+ */
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	int32_t pid;
+	uint32_t count;
+	int64_t started; /* unix time */
+	uint32_t capacity; /* slots that the segment has room for */
+
+	StatsServer servers[];
+} StatsSegment;
+
+#define STATS_SEGMENT_SIZE(servers) \
+	(sizeof (StatsSegment) + (servers) * sizeof (StatsServer))
+
+void stats_segment_name (char *buf, size_t size, uid_t uid);
+
+/* used by xmms2-scrobbler */
+bool stats_open (void);
+void stats_close (void);
+StatsServer *stats_add_server (const char *name);
+void stats_begin (StatsServer *s);
+void stats_end (StatsServer *s);
+
+/* used by readers */
+const StatsSegment *stats_attach (uid_t uid);
+void stats_detach (const StatsSegment *segment);
+bool stats_read (const StatsServer *s, StatsServer *copy);
+
+#endif
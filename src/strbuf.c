@@ -26,14 +26,39 @@
 
 #include "strbuf.h"
 
-#define GOODCHAR(a) ((((a) >= 'a') && ((a) <= 'z')) || \
-                     (((a) >= 'A') && ((a) <= 'Z')) || \
-                     (((a) >= '0') && ((a) <= '9')) || \
-                     ((a) == ':') || \
-                     ((a) == '/') || \
-                     ((a) == '-') || \
-                     ((a) == '.') || \
-                     ((a) == '_'))
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_SIMD_ENCODERS 1
+#include <immintrin.h>
+#endif
+
+/* how each byte is encoded: copied as-is, turned into a '+' or
+ * escaped as %xx.
+ */
+enum {
+	ESCAPE = 0,
+	COPY,
+	SPACE
+};
+
+static const uint8_t byte_class[256] = {
+	['a' ... 'z'] = COPY,
+	['A' ... 'Z'] = COPY,
+	['0' ... '9'] = COPY,
+	[':'] = COPY,
+	['/'] = COPY,
+	['-'] = COPY,
+	['.'] = COPY,
+	['_'] = COPY,
+	[' '] = SPACE
+};
+
+static const char hex[16] = "0123456789abcdef";
+
+typedef char *(*EncodeFunc) (char *dest, const uint8_t *src, size_t len);
+
+static char *encode_scalar (char *dest, const uint8_t *src, size_t len);
+
+static EncodeFunc encode = encode_scalar;
 
 StrBuf *
 strbuf_new (void)
@@ -88,40 +113,237 @@ strbuf_append (StrBuf *sb, const char *other)
 }
 
 void
-strbuf_append_encoded (StrBuf *sb, const uint8_t *other)
+strbuf_append_len (StrBuf *sb, const char *other, size_t len)
 {
-	static const char hex[16] = "0123456789abcdef";
-	char *dest;
-	int len = 0;
-
-	for (const uint8_t *src = other; *src; src++) {
-		if (GOODCHAR (*src))
-			len++;
-		else if (*src == ' ')
-			len++;
-		else
-			len += 3;
-	}
-
 	resize (sb, len);
 
-	dest = sb->buf + sb->length;
+	memcpy (sb->buf + sb->length, other, len);
+	sb->length += len;
+	sb->buf[sb->length] = 0;
+}
 
-	for (const uint8_t *src = other; *src; src++) {
-		if (GOODCHAR (*src)) {
-			*dest++ = *src;
-		} else if (*src == ' ') {
+static inline char *
+encode_byte (char *dest, uint8_t c)
+{
+	switch (byte_class[c]) {
+		case COPY:
+			*dest++ = c;
+			break;
+		case SPACE:
 			*dest++ = '+';
-		} else {
+			break;
+		default:
 			*dest++ = '%';
-			*dest++ = hex[((*src & 0xf0) >> 4)];
-			*dest++ = hex[(*src & 0x0f)];
+			*dest++ = hex[c >> 4];
+			*dest++ = hex[c & 0x0f];
+			break;
+	}
+
+	return dest;
+}
+
+static char *
+encode_scalar (char *dest, const uint8_t *src, size_t len)
+{
+	for (const uint8_t *end = src + len; src < end; src++)
+		dest = encode_byte (dest, *src);
+
+	return dest;
+}
+
+#ifdef HAVE_SIMD_ENCODERS
+
+/* the vector kernels classify a whole block at once and store it with
+ * spaces already turned into pluses. the run of copyable bytes at the
+ * start of the block is kept, the bytes after it that need escaping
+ * are escaped one by one and the next block starts right after them.
+ * the buffer is sized for the worst case, so the stores may spill past
+ * the end of the copied run.
+ *
+ * the characters '-' to ':' are contiguous, and or'ing 0x20 maps upper
+ * case letters onto lower case ones, so two range checks and a compare
+ * for '_' are enough. bytes >= 0x80 are negative as signed chars and
+ * thus fail every range check.
+ */
+
+#define RANGE(v, lo, hi, set1, cmpgt, and) \
+	and (cmpgt (v, set1 ((lo) - 1)), cmpgt (set1 ((hi) + 1), v))
+
+static inline char *
+escape_run (char *dest, const uint8_t **src, uint32_t copyable, int n)
+{
+	/* number of bytes after the copied run that need escaping */
+	int escaped = copyable ? __builtin_ctz (copyable) : n;
+
+	for (int i = 0; i < escaped; i++) {
+		uint8_t c = *(*src)++;
+
+		*dest++ = '%';
+		*dest++ = hex[c >> 4];
+		*dest++ = hex[c & 0x0f];
+	}
+
+	return dest;
+}
+
+__attribute__((target ("sse2")))
+static char *
+encode_sse2 (char *dest, const uint8_t *src, size_t len)
+{
+	const uint8_t *end = src + len;
+
+	while (end - src >= 16) {
+		__m128i v, lower, copy, space;
+		uint32_t copyable;
+		int run;
+
+		v = _mm_loadu_si128 ((const __m128i *) src);
+		lower = _mm_or_si128 (v, _mm_set1_epi8 (0x20));
+
+		copy = _mm_or_si128 (
+			RANGE (v, '-', ':', _mm_set1_epi8, _mm_cmpgt_epi8,
+			       _mm_and_si128),
+			RANGE (lower, 'a', 'z', _mm_set1_epi8, _mm_cmpgt_epi8,
+			       _mm_and_si128));
+		copy = _mm_or_si128 (copy,
+			_mm_cmpeq_epi8 (v, _mm_set1_epi8 ('_')));
+		space = _mm_cmpeq_epi8 (v, _mm_set1_epi8 (' '));
+
+		/* space & ('+' ^ ' ') turns spaces into pluses */
+		v = _mm_xor_si128 (v, _mm_and_si128 (space,
+		                   _mm_set1_epi8 ('+' ^ ' ')));
+		_mm_storeu_si128 ((__m128i *) dest, v);
+
+		copyable = _mm_movemask_epi8 (_mm_or_si128 (copy, space));
+
+		if (copyable == 0xffff) {
+			dest += 16;
+			src += 16;
+			continue;
 		}
+
+		run = __builtin_ctz (~copyable);
+
+		dest += run;
+		src += run;
+		dest = escape_run (dest, &src, copyable >> run, 16 - run);
 	}
 
-	*dest++ = 0;
+	return encode_scalar (dest, src, end - src);
+}
 
-	sb->length += len;
+__attribute__((target ("avx2")))
+static char *
+encode_avx2 (char *dest, const uint8_t *src, size_t len)
+{
+	const uint8_t *end = src + len;
+
+	while (end - src >= 32) {
+		__m256i v, lower, copy, space;
+		uint32_t copyable;
+		int run;
+
+		v = _mm256_loadu_si256 ((const __m256i *) src);
+		lower = _mm256_or_si256 (v, _mm256_set1_epi8 (0x20));
+
+		copy = _mm256_or_si256 (
+			RANGE (v, '-', ':', _mm256_set1_epi8, _mm256_cmpgt_epi8,
+			       _mm256_and_si256),
+			RANGE (lower, 'a', 'z', _mm256_set1_epi8,
+			       _mm256_cmpgt_epi8, _mm256_and_si256));
+		copy = _mm256_or_si256 (copy,
+			_mm256_cmpeq_epi8 (v, _mm256_set1_epi8 ('_')));
+		space = _mm256_cmpeq_epi8 (v, _mm256_set1_epi8 (' '));
+
+		v = _mm256_xor_si256 (v, _mm256_and_si256 (space,
+		                      _mm256_set1_epi8 ('+' ^ ' ')));
+		_mm256_storeu_si256 ((__m256i *) dest, v);
+
+		copyable = _mm256_movemask_epi8 (
+			_mm256_or_si256 (copy, space));
+
+		if (copyable == 0xffffffff) {
+			dest += 32;
+			src += 32;
+			continue;
+		}
+
+		run = __builtin_ctz (~copyable);
+
+		dest += run;
+		src += run;
+		dest = escape_run (dest, &src, copyable >> run, 32 - run);
+	}
+
+	return encode_sse2 (dest, src, end - src);
+}
+
+#endif
+
+bool
+strbuf_set_encoder (StrBufEncoder encoder)
+{
+	switch (encoder) {
+		case STRBUF_ENCODER_AUTO:
+#ifdef HAVE_SIMD_ENCODERS
+			__builtin_cpu_init ();
+
+			if (__builtin_cpu_supports ("avx2"))
+				encode = encode_avx2;
+			else if (__builtin_cpu_supports ("sse2"))
+				encode = encode_sse2;
+			else
+#endif
+				encode = encode_scalar;
+			return true;
+		case STRBUF_ENCODER_SCALAR:
+			encode = encode_scalar;
+			return true;
+#ifdef HAVE_SIMD_ENCODERS
+		case STRBUF_ENCODER_SSE2:
+			__builtin_cpu_init ();
+
+			if (!__builtin_cpu_supports ("sse2"))
+				return false;
+
+			encode = encode_sse2;
+			return true;
+		case STRBUF_ENCODER_AVX2:
+			__builtin_cpu_init ();
+
+			if (!__builtin_cpu_supports ("avx2"))
+				return false;
+
+			encode = encode_avx2;
+			return true;
+#endif
+		default:
+			return false;
+	}
+}
+
+__attribute__((constructor))
+static void
+select_encoder (void)
+{
+	strbuf_set_encoder (STRBUF_ENCODER_AUTO);
+}
+
+void
+strbuf_append_encoded (StrBuf *sb, const uint8_t *other)
+{
+	size_t len;
+	char *end;
+
+	len = strlen ((const char *) other);
+
+	/* reserve for the worst case, every byte escaped */
+	resize (sb, len * 3);
+
+	end = encode (sb->buf + sb->length, other, len);
+	*end = 0;
+
+	sb->length = end - sb->buf;
 }
 
 void
@@ -24,6 +24,8 @@
 #ifndef _STRBUF_H
 #define _STRBUF_H
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 typedef struct {
@@ -32,10 +34,19 @@ typedef struct {
 	int length;
 } StrBuf;
 
+typedef enum {
+	STRBUF_ENCODER_AUTO,
+	STRBUF_ENCODER_SCALAR,
+	STRBUF_ENCODER_SSE2,
+	STRBUF_ENCODER_AVX2
+} StrBufEncoder;
+
 StrBuf *strbuf_new (void);
 void strbuf_free (StrBuf *sb);
 void strbuf_append (StrBuf *sb, const char *other);
+void strbuf_append_len (StrBuf *sb, const char *other, size_t len);
 void strbuf_append_encoded (StrBuf *sb, const uint8_t *other);
+bool strbuf_set_encoder (StrBufEncoder encoder);
 void strbuf_truncate (StrBuf *sb, int length);
 
 #endif
@@ -22,16 +22,157 @@
  */
 
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
 #include "submission.h"
 
-Submission *
-submission_new (StrBuf *sb, SubmissionType type)
+/* create a submission whose string fields are copied to memory that's
+ * allocated together with it. 'fields' must have four entries: artist,
+ * title, album and musicbrainz id.
+ */
+static Submission *
+submission_new (SubmissionType type, const char *fields[4])
 {
 	Submission *submission;
+	SubmissionField *dest[4];
+	size_t lengths[4], total = 0;
+	char *p;
+
+	for (int i = 0; i < 4; i++) {
+		lengths[i] = fields[i] ? strlen (fields[i]) : 0;
+		total += lengths[i] + 1;
+	}
 
-	submission = malloc (sizeof (Submission));
-	submission->sb = sb;
+	submission = malloc (sizeof (Submission) + total);
 	submission->type = type;
+	submission->refcount = 1;
+	submission->encoded = false;
+	submission->duration = -1;
+	submission->timestamp = 0;
+	submission->source = 'P';
+	submission->mapping = NULL;
+
+	dest[0] = &submission->artist;
+	dest[1] = &submission->title;
+	dest[2] = &submission->album;
+	dest[3] = &submission->mbid;
+
+	p = submission->storage;
+
+	for (int i = 0; i < 4; i++) {
+		memcpy (p, fields[i] ? fields[i] : "", lengths[i] + 1);
+
+		dest[i]->data = p;
+		dest[i]->length = lengths[i];
+
+		p += lengths[i] + 1;
+	}
+
+	return submission;
+}
+
+/* parse a profile submission in the format written by
+ * submission_encode(), as found in the queue journal.
+ * if 'mapping' is non-NULL, 'line' points into it and the submission
+ * will reference it instead of copying the data.
+ * the fields are kept URL encoded.
+ */
+Submission *
+submission_parse (Mapping *mapping, const char *line, int length)
+{
+	Submission *submission;
+	const char *p, *end;
+	bool have_timestamp = false;
+
+	if (mapping) {
+		submission = mapping_alloc (mapping, sizeof (Submission));
+		submission->mapping = mapping_ref (mapping);
+	} else {
+		submission = malloc (sizeof (Submission) + length + 1);
+		submission->mapping = NULL;
+
+		memcpy (submission->storage, line, length);
+		submission->storage[length] = 0;
+		line = submission->storage;
+	}
+
+	submission->type = SUBMISSION_TYPE_PROFILE;
+	submission->refcount = 1;
+	submission->encoded = true;
+	submission->artist.length = submission->title.length = 0;
+	submission->album.length = submission->mbid.length = 0;
+	submission->artist.data = submission->title.data = "";
+	submission->album.data = submission->mbid.data = "";
+	submission->duration = -1;
+	submission->timestamp = 0;
+	submission->source = 'P';
+
+	for (p = line, end = line + length; p < end; ) {
+		const char *amp, *eq, *value;
+		int value_length;
+		char num[32];
+
+		amp = memchr (p, '&', end - p);
+		if (!amp)
+			amp = end;
+
+		eq = memchr (p, '=', amp - p);
+
+		if (eq) {
+			SubmissionField *field = NULL;
+
+			value = eq + 1;
+			value_length = amp - value;
+
+			switch (*p) {
+				case 'a':
+					field = &submission->artist;
+					break;
+				case 't':
+					field = &submission->title;
+					break;
+				case 'b':
+					field = &submission->album;
+					break;
+				case 'm':
+					field = &submission->mbid;
+					break;
+				case 'o':
+					if (value_length)
+						submission->source = *value;
+					break;
+				case 'i':
+				case 'l':
+					if (!value_length || value_length >= sizeof (num))
+						break;
+
+					memcpy (num, value, value_length);
+					num[value_length] = 0;
+
+					if (*p == 'l') {
+						submission->duration = atoi (num);
+					} else {
+						submission->timestamp = strtoul (num, NULL, 10);
+						have_timestamp = true;
+					}
+
+					break;
+			}
+
+			if (field) {
+				field->data = value;
+				field->length = value_length;
+			}
+		}
+
+		p = amp + 1;
+	}
+
+	if (!submission->artist.length || !submission->title.length ||
+	    !have_timestamp) {
+		submission_unref (submission);
+		return NULL;
+	}
 
 	return submission;
 }
@@ -39,76 +180,44 @@ submission_new (StrBuf *sb, SubmissionType type)
 Submission *
 now_playing_submission_new (xmmsv_t *dict)
 {
-	StrBuf *sb;
-	const char *artist, *title, *val_s;
+	Submission *submission;
+	const char *fields[4] = { NULL, NULL, NULL, NULL };
 	int32_t val_i;
 	int s;
 
 	/* artist is required */
-	s = xmmsv_dict_entry_get_string (dict, "artist", &artist);
+	s = xmmsv_dict_entry_get_string (dict, "artist", &fields[0]);
 	if (!s)
 		return NULL;
 
 	/* title is required */
-	s = xmmsv_dict_entry_get_string (dict, "title", &title);
+	s = xmmsv_dict_entry_get_string (dict, "title", &fields[1]);
 	if (!s)
 		return NULL;
 
-	sb = strbuf_new ();
-
-	/* note that the session id isn't written here yet, we'll do
-	 * that just before we submit the data.
-	 */
-
-	/* artist */
-	strbuf_append (sb, "a=");
-	strbuf_append_encoded (sb, (const uint8_t *) artist);
-
-	/* title */
-	strbuf_append (sb, "&t=");
-	strbuf_append_encoded (sb, (const uint8_t *) title);
+	xmmsv_dict_entry_get_string (dict, "album", &fields[2]);
 
-	/* album */
-	strbuf_append (sb, "&b=");
+	/* musicbrainz track id */
+	xmmsv_dict_entry_get_string (dict, "track_id", &fields[3]);
 
-	s = xmmsv_dict_entry_get_string (dict, "album", &val_s);
-	if (s)
-		strbuf_append_encoded (sb, (const uint8_t *) val_s);
+	submission = submission_new (SUBMISSION_TYPE_NOW_PLAYING, fields);
 
 	/* duration in seconds */
-	strbuf_append (sb, "&l=");
-
 	s = xmmsv_dict_entry_get_int (dict, "duration", &val_i);
-	if (s) {
-		char buf32[32];
-
-		sprintf (buf32, "%i", val_i / 1000);
-		strbuf_append (sb, buf32);
-	}
-
-	/* position of the track on the album.
-	 * xmms2 doesn't enforce any format for this field, so we're not
-	 * submitting it at all.
-	 */
-	strbuf_append (sb, "&n=");
-
-	/* musicbrainz track id */
-	strbuf_append (sb, "&m=");
-
-	s = xmmsv_dict_entry_get_string (dict, "track_id", &val_s);
 	if (s)
-		strbuf_append (sb, val_s);
+		submission->duration = val_i / 1000;
 
-	return submission_new (sb, SUBMISSION_TYPE_NOW_PLAYING);
+	return submission;
 }
 
+/* builds the profile submission for a track that started playing at
+ * 'started_playing'. whether it's actually submitted depends on how
+ * long it's played, see profile_submission_is_due().
+ */
 Submission *
-profile_submission_new (xmmsv_t *dict, uint32_t seconds_played,
-                        time_t started_playing)
+profile_submission_new (xmmsv_t *dict, time_t started_playing)
 {
-	StrBuf *sb;
-	const char *artist, *title, *val_s;
-	char buf32[32];
+	const char *fields[4] = { NULL, NULL, NULL, NULL };
 	int32_t val_i;
 	int s;
 
@@ -117,90 +226,217 @@ profile_submission_new (xmmsv_t *dict, uint32_t seconds_played,
 	if (!s)
 		return NULL;
 
-	if (seconds_played < 240 && seconds_played < (val_i / 2000)) {
-		fprintf (stderr, "seconds_played FAIL: %u\n", seconds_played);
-		return NULL;
-	}
-
 	/* artist is required */
-	s = xmmsv_dict_entry_get_string (dict, "artist", &artist);
+	s = xmmsv_dict_entry_get_string (dict, "artist", &fields[0]);
 	if (!s)
 		return NULL;
 
 	/* title is required */
-	s = xmmsv_dict_entry_get_string (dict, "title", &title);
+	s = xmmsv_dict_entry_get_string (dict, "title", &fields[1]);
 	if (!s)
 		return NULL;
 
-	sb = strbuf_new ();
+	xmmsv_dict_entry_get_string (dict, "album", &fields[2]);
 
-	/* note that the session id isn't written here yet, we'll do
-	 * that just before we submit the data.
-	 */
+	/* musicbrainz track id */
+	xmmsv_dict_entry_get_string (dict, "track_id", &fields[3]);
 
-	/* artist */
-	strbuf_append (sb, "a[0]=");
-	strbuf_append_encoded (sb, (const uint8_t *) artist);
+	return profile_submission_from_fields (fields, val_i / 1000,
+	                                       started_playing);
+}
 
-	/* title */
-	strbuf_append (sb, "&t[0]=");
-	strbuf_append_encoded (sb, (const uint8_t *) title);
+/* builds a profile submission from 'fields' (artist, title, album and
+ * musicbrainz id, see submission_new()). 'duration' is in seconds.
+ * like submission_parse(), returns NULL if artist or title are empty.
+ */
+Submission *
+profile_submission_from_fields (const char *fields[4], int duration,
+                                time_t timestamp)
+{
+	Submission *submission;
+
+	if (!fields[0] || !*fields[0] || !fields[1] || !*fields[1])
+		return NULL;
+
+	submission = submission_new (SUBMISSION_TYPE_PROFILE, fields);
 
-	/* timestamp */
-	sprintf (buf32, "%lu", started_playing);
-	strbuf_append (sb, "&i[0]=");
-	strbuf_append (sb, buf32);
+	submission->timestamp = timestamp;
+	submission->duration = duration;
 
 	/* source: chosen by user */
-	strbuf_append (sb, "&o[0]=P");
+	submission->source = 'P';
 
-	/* rating: unknown */
-	strbuf_append (sb, "&r[0]=");
+	return submission;
+}
 
-	/* duration in seconds */
-	sprintf (buf32, "%i", val_i / 1000);
+/* a track must be played for half its duration or for four minutes,
+ * whichever comes first.
+ */
+bool
+profile_submission_is_due (Submission *s, uint32_t seconds_played)
+{
+	return seconds_played >= 240 || seconds_played >= s->duration / 2;
+}
 
-	strbuf_append (sb, "&l[0]=");
-	strbuf_append (sb, buf32);
+Submission *
+submission_ref (Submission *s)
+{
+	__sync_add_and_fetch (&s->refcount, 1);
 
-	/* album */
-	strbuf_append (sb, "&b[0]=");
+	return s;
+}
+
+void
+submission_unref (Submission *s)
+{
+	if (__sync_sub_and_fetch (&s->refcount, 1))
+		return;
+
+	/* mapped submissions are released together with the mapping */
+	if (s->mapping)
+		mapping_unref (s->mapping);
+	else
+		free (s);
+}
 
-	s = xmmsv_dict_entry_get_string (dict, "album", &val_s);
-	if (s) {
-		strbuf_append_encoded (sb, (const uint8_t *) val_s);
+static uint64_t
+hash_bytes (uint64_t hash, const char *data, int length)
+{
+	/* FNV-1a */
+	for (int i = 0; i < length; i++) {
+		hash ^= (uint8_t) data[i];
+		hash *= 0x100000001b3ULL;
 	}
 
-	/* position of the track on the album.
-	 * xmms2 doesn't enforce any format for this field, so we're not
-	 * submitting it at all.
-	 */
-	strbuf_append (sb, "&n[0]=");
+	return hash;
+}
 
-	/* musicbrainz track id */
-	strbuf_append (sb, "&m[0]=");
+/* a hash of the fields that identify a profile submission: artist,
+ * title and timestamp. submissions that were read from disk and new
+ * ones hash the same, as the fields are always hashed URL encoded.
+ */
+uint64_t
+submission_hash (Submission *s)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	char timestamp[32];
+	int length;
 
-	s = xmmsv_dict_entry_get_string (dict, "track_id", &val_s);
-	if (s)
-		strbuf_append (sb, val_s);
+	if (s->encoded) {
+		hash = hash_bytes (hash, s->artist.data, s->artist.length);
+		hash = hash_bytes (hash, "&", 1);
+		hash = hash_bytes (hash, s->title.data, s->title.length);
+	} else {
+		StrBuf *sb = strbuf_new ();
+
+		strbuf_append_encoded (sb, (const uint8_t *) s->artist.data);
+		strbuf_append (sb, "&");
+		strbuf_append_encoded (sb, (const uint8_t *) s->title.data);
+
+		hash = hash_bytes (hash, sb->buf, sb->length);
+
+		strbuf_free (sb);
+	}
+
+	/* '&' never appears in encoded fields, so it separates them */
+	length = sprintf (timestamp, "&%lu", (unsigned long) s->timestamp);
 
-	return submission_new (sb, SUBMISSION_TYPE_PROFILE);
+	return hash_bytes (hash, timestamp, length);
 }
 
-Submission *
-submission_clone (Submission *s)
+/* the number of bytes taken up by the text fields of 's'. */
+int
+submission_size (Submission *s)
 {
-	StrBuf *sb;
+	return s->artist.length + s->title.length +
+	       s->album.length + s->mbid.length;
+}
 
-	sb = strbuf_new ();
-	strbuf_append (sb, s->sb->buf);
+static void
+append_key (StrBuf *sb, const char *key, const char *subscript)
+{
+	strbuf_append (sb, key);
+	strbuf_append (sb, subscript);
+	strbuf_append (sb, "=");
+}
 
-	return submission_new (sb, s->type);
+static void
+append_field (StrBuf *sb, Submission *s, SubmissionField *field)
+{
+	if (s->encoded)
+		strbuf_append_len (sb, field->data, field->length);
+	else
+		strbuf_append_encoded (sb, (const uint8_t *) field->data);
 }
 
+/* appends the URL encoded fields of 's' to 'sb'.
+ * the fields of profile submissions get the subscript 'index', so
+ * that several of them can be packed into a single request.
+ * note that the session id isn't written here, it's added just before
+ * the data is submitted.
+ */
 void
-submission_free (Submission *s)
+submission_encode (StrBuf *sb, Submission *s, int index)
 {
-	strbuf_free (s->sb);
-	free (s);
+	char subscript[32], buf32[32];
+
+	if (s->type == SUBMISSION_TYPE_NOW_PLAYING)
+		*subscript = 0;
+	else
+		sprintf (subscript, "[%i]", index);
+
+	/* artist */
+	append_key (sb, "a", subscript);
+	append_field (sb, s, &s->artist);
+
+	/* title */
+	append_key (sb, "&t", subscript);
+	append_field (sb, s, &s->title);
+
+	if (s->type == SUBMISSION_TYPE_PROFILE) {
+		/* timestamp */
+		sprintf (buf32, "%lu", s->timestamp);
+		append_key (sb, "&i", subscript);
+		strbuf_append (sb, buf32);
+
+		/* source */
+		sprintf (buf32, "%c", s->source);
+		append_key (sb, "&o", subscript);
+		strbuf_append (sb, buf32);
+
+		/* rating: unknown */
+		append_key (sb, "&r", subscript);
+
+		/* duration in seconds */
+		append_key (sb, "&l", subscript);
+
+		if (s->duration >= 0) {
+			sprintf (buf32, "%i", s->duration);
+			strbuf_append (sb, buf32);
+		}
+	}
+
+	/* album */
+	append_key (sb, "&b", subscript);
+	append_field (sb, s, &s->album);
+
+	if (s->type == SUBMISSION_TYPE_NOW_PLAYING) {
+		/* duration in seconds */
+		append_key (sb, "&l", subscript);
+
+		if (s->duration >= 0) {
+			sprintf (buf32, "%i", s->duration);
+			strbuf_append (sb, buf32);
+		}
+	}
+
+	/* position of the track on the album.
+	 * xmms2 doesn't enforce any format for this field, so we're not
+	 * submitting it at all.
+	 */
+	append_key (sb, "&n", subscript);
+
+	/* musicbrainz track id. it's submitted as is. */
+	append_key (sb, "&m", subscript);
+	strbuf_append_len (sb, s->mbid.data, s->mbid.length);
 }
@@ -25,9 +25,11 @@
 #define _SUBMISSION_H
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <time.h>
 #include <xmmsclient/xmmsclient.h>
 #include "strbuf.h"
+#include "mapping.h"
 
 typedef enum {
 	SUBMISSION_TYPE_NOW_PLAYING,
@@ -35,14 +37,40 @@ typedef enum {
 } SubmissionType;
 
 typedef struct {
-	StrBuf *sb;
+	const char *data;
+	int length;
+} SubmissionField;
+
+/* the string fields either point into the memory that's allocated
+ * together with the submission or into 'mapping', in which case they
+ * aren't NUL-terminated.
+ * submissions that were read from disk keep their fields URL encoded;
+ * all others are only encoded when a request is built.
+ * submissions are immutable, so they can be shared by all servers.
+ */
+typedef struct {
 	SubmissionType type;
+	int refcount;
+	bool encoded;
+
+	SubmissionField artist, title, album, mbid;
+	time_t timestamp;
+	int duration; /* seconds, -1 if unknown */
+	char source;
+
+	Mapping *mapping;
+	char storage[];
 } Submission;
 
-Submission *submission_new (StrBuf *sb, SubmissionType type);
+Submission *submission_parse (Mapping *mapping, const char *line, int length);
 Submission *now_playing_submission_new (xmmsv_t *dict);
-Submission *profile_submission_new (xmmsv_t *dict, uint32_t seconds_played, time_t started_playing);
-Submission *submission_clone (Submission *s);
-void submission_free (Submission *s);
+Submission *profile_submission_new (xmmsv_t *dict, time_t started_playing);
+Submission *profile_submission_from_fields (const char *fields[4], int duration, time_t timestamp);
+bool profile_submission_is_due (Submission *s, uint32_t seconds_played);
+Submission *submission_ref (Submission *s);
+void submission_unref (Submission *s);
+int submission_size (Submission *s);
+uint64_t submission_hash (Submission *s);
+void submission_encode (StrBuf *sb, Submission *s, int index);
 
 #endif
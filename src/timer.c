@@ -0,0 +1,226 @@
+/*
+ * Copyright (c) 2009 Tilman Sauerbeck (tilman at xmms org)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "timer.h"
+
+int64_t
+timer_now (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+
+	return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void
+timer_init (Timer *t, void *data)
+{
+	t->expires = 0;
+	t->index = -1;
+	t->data = data;
+}
+
+bool
+timer_is_scheduled (Timer *t)
+{
+	return t->index != -1;
+}
+
+void
+timer_heap_init (TimerHeap *h)
+{
+	h->timers = NULL;
+	h->count = h->allocated = 0;
+}
+
+void
+timer_heap_clear (TimerHeap *h)
+{
+	for (int i = 0; i < h->count; i++)
+		h->timers[i]->index = -1;
+
+	free (h->timers);
+	timer_heap_init (h);
+}
+
+static void
+place (TimerHeap *h, Timer *t, int index)
+{
+	h->timers[index] = t;
+	t->index = index;
+}
+
+static void
+sift_up (TimerHeap *h, int index)
+{
+	Timer *t = h->timers[index];
+
+	while (index) {
+		int parent = (index - 1) / 2;
+
+		if (h->timers[parent]->expires <= t->expires)
+			break;
+
+		place (h, h->timers[parent], index);
+		index = parent;
+	}
+
+	place (h, t, index);
+}
+
+static void
+sift_down (TimerHeap *h, int index)
+{
+	Timer *t = h->timers[index];
+
+	for (;;) {
+		int child = index * 2 + 1;
+
+		if (child >= h->count)
+			break;
+
+		if (child + 1 < h->count &&
+		    h->timers[child + 1]->expires < h->timers[child]->expires)
+			child++;
+
+		if (t->expires <= h->timers[child]->expires)
+			break;
+
+		place (h, h->timers[child], index);
+		index = child;
+	}
+
+	place (h, t, index);
+}
+
+/* schedules 't' to expire at 'expires'. if it's scheduled already, it's
+ * moved.
+ */
+void
+timer_heap_schedule (TimerHeap *h, Timer *t, int64_t expires)
+{
+	if (timer_is_scheduled (t)) {
+		int64_t old = t->expires;
+
+		t->expires = expires;
+
+		if (expires < old)
+			sift_up (h, t->index);
+		else
+			sift_down (h, t->index);
+
+		return;
+	}
+
+	if (h->count == h->allocated) {
+		h->allocated = h->allocated * 2 + 8;
+		h->timers = realloc (h->timers,
+		                     h->allocated * sizeof (Timer *));
+	}
+
+	t->expires = expires;
+	place (h, t, h->count++);
+	sift_up (h, t->index);
+}
+
+void
+timer_heap_cancel (TimerHeap *h, Timer *t)
+{
+	int index = t->index;
+	Timer *last;
+
+	if (index == -1)
+		return;
+
+	t->index = -1;
+	last = h->timers[--h->count];
+
+	if (last == t)
+		return;
+
+	/* fill the hole with the last timer and restore the heap order */
+	place (h, last, index);
+
+	if (index && h->timers[(index - 1) / 2]->expires > last->expires)
+		sift_up (h, index);
+	else
+		sift_down (h, index);
+}
+
+/* returns the timer that expires first, or NULL if there's none */
+Timer *
+timer_heap_peek (TimerHeap *h)
+{
+	return h->count ? h->timers[0] : NULL;
+}
+
+/* removes and returns a timer that expired at or before 'now' */
+Timer *
+timer_heap_pop_expired (TimerHeap *h, int64_t now)
+{
+	Timer *t = timer_heap_peek (h);
+
+	if (!t || t->expires > now)
+		return NULL;
+
+	timer_heap_cancel (h, t);
+
+	return t;
+}
+
+void
+backoff_init (Backoff *b, int min, int max)
+{
+	b->min = min;
+	b->max = max;
+	b->seed = (unsigned int) timer_now () ^ (unsigned int) (uintptr_t) b;
+
+	backoff_reset (b);
+}
+
+void
+backoff_reset (Backoff *b)
+{
+	b->step = b->min;
+}
+
+/* the jitter keeps servers that failed at the same time (eg because
+ * the network went down) from retrying in lockstep.
+ */
+int
+backoff_next (Backoff *b)
+{
+	int half = b->step / 2;
+	int delay = b->step - half + rand_r (&b->seed) % (half + 1);
+
+	if (b->step <= b->max / 2)
+		b->step *= 2;
+	else
+		b->step = b->max;
+
+	return delay;
+}
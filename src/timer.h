@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2009 Tilman Sauerbeck (tilman at xmms org)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _TIMER_H
+#define _TIMER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* a timer that can be put on a TimerHeap. 'expires' is in milliseconds
+ * on the CLOCK_MONOTONIC clock, see timer_now().
+ */
+typedef struct {
+	int64_t expires;
+	int index; /* position in the heap, -1 if not scheduled */
+	void *data;
+} Timer;
+
+/* a binary min-heap of timers, ordered by expiry time.
+ * the timers are owned by the caller; the heap only keeps pointers.
+ */
+typedef struct {
+	Timer **timers;
+	int count;
+	int allocated;
+} TimerHeap;
+
+/* capped exponential backoff with jitter. each call to backoff_next()
+ * returns a delay between half the current step and the full step,
+ * then doubles the step, up to 'max'.
+ */
+typedef struct {
+	int min, max; /* milliseconds */
+	int step;
+	unsigned int seed;
+} Backoff;
+
+int64_t timer_now (void);
+
+void timer_init (Timer *t, void *data);
+bool timer_is_scheduled (Timer *t);
+
+void timer_heap_init (TimerHeap *h);
+void timer_heap_clear (TimerHeap *h);
+void timer_heap_schedule (TimerHeap *h, Timer *t, int64_t expires);
+void timer_heap_cancel (TimerHeap *h, Timer *t);
+Timer *timer_heap_peek (TimerHeap *h);
+Timer *timer_heap_pop_expired (TimerHeap *h, int64_t now);
+
+void backoff_init (Backoff *b, int min, int max);
+void backoff_reset (Backoff *b);
+int backoff_next (Backoff *b);
+
+#endif
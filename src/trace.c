@@ -0,0 +1,279 @@
+/*
+ * Copyright (c) 2009 Tilman Sauerbeck (tilman at xmms org)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "trace.h"
+#include "log.h"
+
+/* a varint of a 64 bit number takes up to 10 bytes */
+#define MAX_VARINT 10
+
+static void
+append_varint (StrBuf *sb, uint64_t n)
+{
+	char buf[MAX_VARINT];
+	int length = 0;
+
+	while (n >= 0x80) {
+		buf[length++] = (n & 0x7f) | 0x80;
+		n >>= 7;
+	}
+
+	buf[length++] = n;
+
+	strbuf_append_len (sb, buf, length);
+}
+
+static bool
+read_varint (TraceReader *r, uint64_t *n)
+{
+	*n = 0;
+
+	for (int shift = 0; shift < 64; shift += 7) {
+		uint8_t byte;
+
+		if (r->p == r->end)
+			return false;
+
+		byte = *r->p++;
+		*n |= (uint64_t) (byte & 0x7f) << shift;
+
+		if (!(byte & 0x80))
+			return true;
+	}
+
+	return false;
+}
+
+static uint32_t
+zigzag (int32_t n)
+{
+	return ((uint32_t) n << 1) ^ (uint32_t) (n >> 31);
+}
+
+static int32_t
+unzigzag (uint32_t n)
+{
+	return (int32_t) (n >> 1) ^ -(int32_t) (n & 1);
+}
+
+static bool
+write_all (int fd, const char *buf, size_t len)
+{
+	while (len) {
+		ssize_t w = write (fd, buf, len);
+
+		if (w == -1 && errno == EINTR)
+			continue;
+
+		if (w == -1)
+			return false;
+
+		buf += w;
+		len -= w;
+	}
+
+	return true;
+}
+
+/* 'started' is the unix time in milliseconds that the events' times
+ * are relative to. an existing file is replaced.
+ */
+TraceWriter *
+trace_writer_new (const char *filename, int64_t started)
+{
+	TraceWriter *w;
+	int fd;
+
+	fd = open (filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+
+	if (fd == -1)
+		return NULL;
+
+	w = malloc (sizeof (TraceWriter));
+	w->fd = fd;
+	w->buf = strbuf_new ();
+	w->last = 0;
+
+	strbuf_append_len (w->buf, TRACE_MAGIC, 4);
+	strbuf_append_len (w->buf, (const char[]) { TRACE_VERSION }, 1);
+	append_varint (w->buf, started);
+
+	if (!write_all (w->fd, w->buf->buf, w->buf->length)) {
+		trace_writer_free (w);
+		return NULL;
+	}
+
+	return w;
+}
+
+void
+trace_writer_free (TraceWriter *w)
+{
+	close (w->fd);
+	strbuf_free (w->buf);
+	free (w);
+}
+
+/* every event is written right away, so that the trace is complete
+ * even if xmms2-scrobbler doesn't get to exit cleanly.
+ * events are rare enough for that not to matter.
+ */
+bool
+trace_write (TraceWriter *w, const TraceEvent *event)
+{
+	int64_t delta = event->time - w->last;
+
+	strbuf_truncate (w->buf, 0);
+
+	strbuf_append_len (w->buf, (const char[]) { event->type }, 1);
+	append_varint (w->buf, delta > 0 ? delta : 0);
+	append_varint (w->buf, zigzag (event->value));
+
+	if (delta > 0)
+		w->last = event->time;
+
+	if (event->type == TRACE_MEDIALIB_INFO) {
+		xmmsv_t *serialized = xmmsv_serialize (event->info);
+		const unsigned char *data;
+		unsigned int length;
+
+		if (!serialized)
+			return false;
+
+		xmmsv_get_bin (serialized, &data, &length);
+
+		append_varint (w->buf, length);
+		strbuf_append_len (w->buf, (const char *) data, length);
+
+		xmmsv_unref (serialized);
+	}
+
+	if (!write_all (w->fd, w->buf->buf, w->buf->length)) {
+		log_error ("trace: cannot write: %s\n", strerror (errno));
+		return false;
+	}
+
+	return true;
+}
+
+/* returns NULL if 'filename' cannot be read or isn't a trace */
+TraceReader *
+trace_reader_new (const char *filename)
+{
+	TraceReader *r;
+	uint64_t started;
+
+	r = malloc (sizeof (TraceReader));
+	r->mapping = mapping_open (filename);
+
+	if (!r->mapping) {
+		free (r);
+		return NULL;
+	}
+
+	r->p = r->mapping->data;
+	r->end = r->p + r->mapping->length;
+	r->time = 0;
+
+	if (r->end - r->p < 5 || memcmp (r->p, TRACE_MAGIC, 4) ||
+	    r->p[4] != TRACE_VERSION) {
+		trace_reader_free (r);
+		return NULL;
+	}
+
+	r->p += 5;
+
+	if (!read_varint (r, &started)) {
+		trace_reader_free (r);
+		return NULL;
+	}
+
+	r->started = started;
+
+	return r;
+}
+
+void
+trace_reader_free (TraceReader *r)
+{
+	mapping_unref (r->mapping);
+	free (r);
+}
+
+/* returns false at the end of the trace, or if the rest of it is
+ * broken.
+ */
+bool
+trace_read (TraceReader *r, TraceEvent *event)
+{
+	uint64_t delta, value, length;
+	xmmsv_t *serialized;
+
+	if (r->p == r->end)
+		return false;
+
+	event->type = (uint8_t) *r->p++;
+	event->info = NULL;
+
+	if (event->type < TRACE_CURRENT_ID ||
+	    event->type > TRACE_MEDIALIB_INFO ||
+	    !read_varint (r, &delta) || !read_varint (r, &value))
+		goto broken;
+
+	r->time += delta;
+
+	event->time = r->time;
+	event->value = unzigzag (value);
+
+	if (event->type != TRACE_MEDIALIB_INFO)
+		return true;
+
+	if (!read_varint (r, &length) || length > (uint64_t) (r->end - r->p))
+		goto broken;
+
+	serialized = xmmsv_new_bin ((const unsigned char *) r->p, length);
+	event->info = xmmsv_deserialize (serialized);
+	xmmsv_unref (serialized);
+
+	r->p += length;
+
+	if (!event->info)
+		goto broken;
+
+	return true;
+
+broken:
+	log_error ("trace: broken event at offset %li\n",
+	           (long) (r->p - r->mapping->data));
+
+	/* don't report it again */
+	r->p = r->end;
+
+	return false;
+}
@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2009 Tilman Sauerbeck (tilman at xmms org)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <xmmsclient/xmmsclient.h>
+
+#include "mapping.h"
+#include "strbuf.h"
+
+/* a trace starts with "x2tr", a version byte and the unix time (in
+ * milliseconds) at which it was started. each event is a type byte,
+ * the milliseconds since the previous event, the value and, for
+ * medialib replies, the length of the serialized info followed by the
+ * info itself. numbers are stored as varints, the value is zigzag
+ * encoded.
+ */
+#define TRACE_MAGIC "x2tr"
+#define TRACE_VERSION 1
+
+typedef enum {
+	TRACE_CURRENT_ID = 1,
+	TRACE_PLAYBACK_STATUS,
+	TRACE_MEDIALIB_INFO
+} TraceEventType;
+
+typedef struct {
+	TraceEventType type;
+	int64_t time; /* milliseconds since the trace was started */
+	int32_t value; /* the medialib id or the playback status */
+	xmmsv_t *info; /* TRACE_MEDIALIB_INFO only, owned by the caller */
+} TraceEvent;
+
+typedef struct {
+	int fd;
+	StrBuf *buf;
+	int64_t last; /* time of the previous event */
+} TraceWriter;
+
+typedef struct {
+	Mapping *mapping;
+	const char *p, *end;
+	int64_t started; /* unix time in milliseconds */
+	int64_t time;
+} TraceReader;
+
+TraceWriter *trace_writer_new (const char *filename, int64_t started);
+void trace_writer_free (TraceWriter *w);
+bool trace_write (TraceWriter *w, const TraceEvent *event);
+
+TraceReader *trace_reader_new (const char *filename);
+void trace_reader_free (TraceReader *r);
+bool trace_read (TraceReader *r, TraceEvent *event);
+
+#endif
@@ -0,0 +1,133 @@
+/*
+ * Copyright (c) 2009 Tilman Sauerbeck (tilman at xmms org)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#include "watch.h"
+#include "log.h"
+
+/* servers are added and removed by creating, renaming or deleting
+ * their directories. the generic config file lives in the top
+ * directory, too.
+ */
+#define DIR_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+                    IN_CLOSE_WRITE | IN_ONLYDIR)
+
+/* editors either rewrite the file or replace it */
+#define SERVER_DIR_EVENTS (IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO | \
+                           IN_DELETE | IN_ONLYDIR)
+
+/* returns NULL if the directory cannot be watched */
+ConfigWatch *
+config_watch_new (const char *dir)
+{
+	ConfigWatch *w;
+
+	w = malloc (sizeof (ConfigWatch));
+
+	w->fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+
+	if (w->fd == -1) {
+		free (w);
+		return NULL;
+	}
+
+	w->dir_wd = inotify_add_watch (w->fd, dir, DIR_EVENTS);
+
+	if (w->dir_wd == -1) {
+		close (w->fd);
+		free (w);
+		return NULL;
+	}
+
+	return w;
+}
+
+void
+config_watch_free (ConfigWatch *w)
+{
+	close (w->fd);
+	free (w);
+}
+
+/* adding the same directory again is harmless. the watch goes away
+ * by itself when the directory is removed.
+ */
+void
+config_watch_add_server (ConfigWatch *w, const char *dir)
+{
+	if (inotify_add_watch (w->fd, dir, SERVER_DIR_EVENTS) == -1)
+		log_warning ("cannot watch '%s': %s\n",
+		             dir, strerror (errno));
+}
+
+static bool
+is_relevant (ConfigWatch *w, const struct inotify_event *event)
+{
+	if (event->mask & IN_Q_OVERFLOW)
+		return true;
+
+	if (event->mask & IN_IGNORED)
+		return false;
+
+	/* journals, sessions and spill files come and go all the time */
+	if (event->len && !strcmp (event->name, "config"))
+		return true;
+
+	return event->wd == w->dir_wd && (event->mask & IN_ISDIR);
+}
+
+/* consumes the pending events and returns true if any of the config
+ * files might have changed.
+ */
+bool
+config_watch_read (ConfigWatch *w)
+{
+	char buf[4096]
+		__attribute__ ((aligned (__alignof__ (struct inotify_event))));
+	bool changed = false;
+
+	for (;;) {
+		ssize_t r = read (w->fd, buf, sizeof (buf));
+
+		if (r == -1 && errno == EINTR)
+			continue;
+
+		if (r <= 0)
+			break;
+
+		for (char *p = buf; p < buf + r; ) {
+			const struct inotify_event *event = (void *) p;
+
+			changed = changed || is_relevant (w, event);
+			p += sizeof (struct inotify_event) + event->len;
+		}
+	}
+
+	return changed;
+}
@@ -0,0 +1,200 @@
+/*
+ * Copyright (c) 2009 Tilman Sauerbeck (tilman at xmms org)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* prints the counters that xmms2-scrobbler publishes in its shared
+ * memory segment, see stats.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stats.h"
+
+static bool
+is_running (const StatsSegment *segment)
+{
+	return !kill (segment->pid, 0) || errno == EPERM;
+}
+
+static void
+print_table (const StatsSegment *segment, time_t now)
+{
+	uint32_t count = __atomic_load_n (&segment->count, __ATOMIC_ACQUIRE);
+
+	printf ("pid %i%s, up %lis\n", segment->pid,
+	        is_running (segment) ? "" : " (not running)",
+	        (long) (now - segment->started));
+	printf ("%-16s %8s %10s %8s %8s %8s %8s %6s %6s %5s %6s %8s\n",
+	        "server", "queued", "bytes", "spilled", "sent", "acked",
+	        "failed",
+	        "hs", "badses", "hard", "npdrop", "success");
+
+	for (uint32_t i = 0; i < count; i++) {
+		StatsServer s;
+		char last[32];
+
+		if (!stats_read (&segment->servers[i], &s)) {
+			printf ("%-16s (locked)\n", segment->servers[i].name);
+			continue;
+		}
+
+		if (s.last_success)
+			snprintf (last, sizeof (last), "%lis ago",
+			          (long) (now - s.last_success));
+		else
+			strcpy (last, "never");
+
+		printf ("%-16s %8" PRIu64 " %10" PRIu64 " %8" PRIu64
+		        " %8" PRIu64 " %8" PRIu64 " %8" PRIu64 " %6" PRIu64
+		        " %6" PRIu64 " %5" PRIu32 " %6" PRIu64 " %8s\n",
+		        s.name, s.queue_depth, s.queued_bytes, s.spilled, s.sent,
+		        s.acked, s.failed, s.handshakes, s.bad_sessions,
+		        s.hard_failures, s.now_playing_coalesced, last);
+	}
+}
+
+static void
+print_json_string (const char *str)
+{
+	putchar ('"');
+
+	for (const unsigned char *p = (const unsigned char *) str; *p; p++) {
+		if (*p == '"' || *p == '\\')
+			printf ("\\%c", *p);
+		else if (*p < 0x20)
+			printf ("\\u%04x", *p);
+		else
+			putchar (*p);
+	}
+
+	putchar ('"');
+}
+
+static void
+print_json (const StatsSegment *segment, time_t now)
+{
+	uint32_t count = __atomic_load_n (&segment->count, __ATOMIC_ACQUIRE);
+	bool first = true;
+
+	printf ("{\"time\": %li, \"pid\": %i, \"running\": %s, "
+	        "\"started\": %" PRId64 ", \"servers\": [",
+	        (long) now, segment->pid,
+	        is_running (segment) ? "true" : "false", segment->started);
+
+	for (uint32_t i = 0; i < count; i++) {
+		StatsServer s;
+
+		if (!stats_read (&segment->servers[i], &s))
+			continue;
+
+		printf ("%s\n  {\"name\": ", first ? "" : ",");
+		print_json_string (s.name);
+		printf (", \"queue_depth\": %" PRIu64
+		        ", \"queued_bytes\": %" PRIu64
+		        ", \"spilled\": %" PRIu64 ", \"sent\": %" PRIu64
+		        ", \"acked\": %" PRIu64 ", \"failed\": %" PRIu64
+		        ", \"handshakes\": %" PRIu64
+		        ", \"bad_sessions\": %" PRIu64
+		        ", \"hard_failures\": %" PRIu32
+		        ", \"now_playing_coalesced\": %" PRIu64
+		        ", \"last_success\": %" PRId64 "}",
+		        s.queue_depth, s.queued_bytes, s.spilled, s.sent,
+		        s.acked,
+		        s.failed, s.handshakes, s.bad_sessions,
+		        s.hard_failures, s.now_playing_coalesced,
+		        s.last_success);
+
+		first = false;
+	}
+
+	printf ("]}\n");
+}
+
+static void
+usage (const char *argv0)
+{
+	fprintf (stderr, "usage: %s [-j] [-i SECONDS] [-u UID]\n", argv0);
+}
+
+int
+main (int argc, char **argv)
+{
+	const StatsSegment *segment;
+	bool json = false;
+	int interval = 0, opt;
+	uid_t uid = getuid ();
+
+	while ((opt = getopt (argc, argv, "ji:u:")) != -1) {
+		switch (opt) {
+			case 'j':
+				json = true;
+				break;
+			case 'i':
+				interval = atoi (optarg);
+				break;
+			case 'u':
+				uid = atoi (optarg);
+				break;
+			default:
+				usage (argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+
+	segment = stats_attach (uid);
+
+	if (!segment) {
+		fprintf (stderr, "xmms2-scrobbler isn't running\n");
+
+		return EXIT_FAILURE;
+	}
+
+	for (;;) {
+		time_t now = time (NULL);
+
+		if (json)
+			print_json (segment, now);
+		else
+			print_table (segment, now);
+
+		if (interval <= 0)
+			break;
+
+		fflush (stdout);
+		sleep (interval);
+
+		if (!json)
+			printf ("\n");
+	}
+
+	stats_detach (segment);
+
+	return EXIT_SUCCESS;
+}
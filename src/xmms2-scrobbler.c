@@ -27,6 +27,8 @@
 #include <stdbool.h>
 #include <assert.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <poll.h>
 #include <xmmsclient/xmmsclient.h>
 #include <pthread.h>
@@ -34,11 +36,24 @@
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/file.h>
 #include <dirent.h>
 #include <unistd.h>
 #include "list.h"
 #include "queue.h"
 #include "submission.h"
+#include "journal.h"
+#include "ring.h"
+#include "stats.h"
+#include "timer.h"
+#include "dedup.h"
+#include "import.h"
+#include "spill.h"
+#include "response.h"
+#include "watch.h"
+#include "log.h"
+#include "trace.h"
+#include "pool.h"
 #include "md5.h"
 
 #define PROTOCOL "1.2"
@@ -48,6 +63,65 @@
 
 #define INVALID_MEDIA_ID -1
 
+/* seconds to wait before retrying a failed handshake */
+#define HANDSHAKE_DELAY_MIN 30
+#define HANDSHAKE_DELAY_MAX 7200
+
+/* seconds to wait before retrying a failed submission */
+#define RETRY_DELAY_MIN 1
+#define RETRY_DELAY_MAX 600
+
+/* protocol 1.2 accepts up to 50 scrobbles per submission request */
+#define MAX_BATCH_SIZE 50
+#define DEFAULT_BATCH_WINDOW 250
+
+/* number of submissions that can be passed to a server without locking */
+#define INCOMING_SIZE 256
+
+/* milliseconds between checks whether --drain is done */
+#define DRAIN_CHECK_INTERVAL 10
+
+/* maximum number of threads that parse the file passed to --import */
+#define IMPORT_MAX_WORKERS 8
+
+/* default memory budget of a server's queue, in KiB */
+#define DEFAULT_QUEUE_MEMORY 1024
+
+/* sessions that are older than this (in seconds) aren't reused */
+#define SESSION_MAX_AGE (7 * 24 * 60 * 60)
+
+/* milliseconds to wait after a config file was changed before it's
+ * read, so that editors can finish writing it.
+ */
+#define RELOAD_DELAY 250
+
+/* milliseconds between checks for the threads of removed servers */
+#define RETIRE_CHECK_INTERVAL 100
+
+/* events that are replayed per main loop iteration with --fast */
+#define REPLAY_BATCH 1024
+
+/* the log is rotated when it gets larger than this (in KiB) */
+#define DEFAULT_LOG_SIZE 1024
+#define DEFAULT_LOG_FILES 3
+
+#define DEFAULT_JOURNAL_SYNC_INTERVAL 1000
+#define DEFAULT_REQUEST_TIMEOUT 30
+
+typedef enum {
+	ENGINE_THREADS,
+	ENGINE_MULTI,
+	ENGINE_POOL
+} Engine;
+
+typedef enum {
+	MULTI_IDLE,
+	MULTI_BATCHING,
+	MULTI_BACKOFF,
+	MULTI_HANDSHAKE,
+	MULTI_SUBMISSION
+} MultiState;
+
 typedef struct {
 	char name[NAME_MAX + 1];
 	int hard_failure_count;
@@ -55,28 +129,175 @@ typedef struct {
 	char session_id[256], np_url[256], subm_url[256];
 	char handshake_url[256];
 
+	/* the last session is saved here, so that it can be used again
+	 * after a restart.
+	 */
+	char session_file[PATH_MAX];
+
+	/* the server's directory, flock'ed so that no other instance
+	 * uses its journal at the same time.
+	 */
+	int lock_fd;
+
+	/* md5 of the config file, to tell whether it changed */
+	char config_digest[33];
+
+	int batch_size;
+	int batch_window; /* milliseconds */
+	StrBuf *request;
+
+	/* the curl handle is created by the server's thread and reused for
+	 * all its requests, so that connections can be kept alive.
+	 * with the pool engine, it's the handle of the worker that's
+	 * running the server's task, see pool_step().
+	 */
+	CURL *curl;
+	unsigned long connections_new, connections_reused;
+
+	/* new submissions are passed from the xmms2 thread through
+	 * 'incoming'. the sending side (the server's thread, main_loop()
+	 * with the curl_multi engine or the server's task with the pool
+	 * engine) moves them to 'submissions', which only it touches, and
+	 * keeps them there until they have been sent.
+	 */
+	Ring *incoming;
 	Queue submissions;
+	int pending; /* submissions that haven't been sent yet */
+
+	/* once the submissions in 'submissions' take up more than
+	 * 'memory_limit' bytes, newer ones are moved to 'spill' and
+	 * read back as the queue drains. like 'submissions', that's
+	 * only touched by the sending side.
+	 */
+	Spill *spill;
+	StrBuf *spill_line;
+	int memory_limit;
+	int resident_bytes;
+
+	/* spilled entries that couldn't be read back are dropped, but
+	 * their journal records can only be acked along with the ones
+	 * ahead of them. these are the numbers of queued submissions
+	 * that are ahead of each such record, oldest first.
+	 */
+	int *skipped;
+	int skipped_count;
+
+	/* hashes of the profile submissions in the queue, so that
+	 * duplicates can be skipped. entries are added by the xmms2
+	 * thread and removed by the sending side.
+	 */
+	DedupSet *queued;
+	pthread_mutex_t queued_mutex;
+
+	int max_age; /* days, 0 if submissions never expire */
+
+	/* now-playing submissions don't queue up: the xmms2 thread
+	 * replaces the one in 'now_playing' if it hasn't been picked up
+	 * yet, since only the newest one is of interest.
+	 */
+	Submission *now_playing;
+	Submission *now_playing_in_flight;
+	Journal *journal;
 	pthread_t thread;
-	pthread_mutex_t submissions_mutex;
-	pthread_cond_t cond;
+
+	Backoff handshake_backoff;
+	Backoff retry_backoff;
+
+	/* used by the curl_multi and pool engines only */
+	MultiState multi_state;
+	Timer timer; /* ends MULTI_BATCHING and MULTI_BACKOFF */
+	PoolTask task;
+	int in_flight; /* number of queue items covered by the transfer */
+	SubmissionType in_flight_type;
+
+	/* NULL if the counters aren't published */
+	StatsServer *stats;
+
+	/* the response to the current request */
+	ResponseParser response;
 
 	bool need_handshake;
 	bool submission_was_success;
 	bool shutdown_thread;
+	bool removed; /* aborts the transfer that's in progress */
+	bool thread_done;
 } Server;
 
-static void handle_queue_line (const char *line, void *user_data);
+static bool handle_journal_entry (Mapping *mapping, const char *line,
+                                  int length, void *user_data);
+static void handle_legacy_queue_line (const char *line, void *user_data);
+static void pool_step (PoolTask *task);
+static void update_queue_stats (Server *server, int depth, int bytes);
 
 static xmmsc_connection_t *conn;
 static int32_t current_id = INVALID_MEDIA_ID;
+static Submission *current_track; /* its profile submission */
 static uint32_t seconds_played;
 static time_t started_playing, last_unpause;
 static List *servers;
 
+/* .../clients/xmms2-scrobbler */
+static char config_dir[PATH_MAX];
+
+/* protects the proxy settings and the request timeout, which can be
+ * changed while the servers' threads are running.
+ */
+static pthread_mutex_t config_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 static char proxy_host[128];
 static int proxy_port;
 static char proxy_userpwd[128];
 
+static int journal_sync_interval = DEFAULT_JOURNAL_SYNC_INTERVAL;
+static int request_timeout = DEFAULT_REQUEST_TIMEOUT; /* seconds */
+static int log_size = DEFAULT_LOG_SIZE, log_files = DEFAULT_LOG_FILES;
+
+/* NULL if the config files aren't watched */
+static ConfigWatch *config_watch;
+static int64_t reload_at = -1; /* see timer_now() */
+static bool reload_deferred;
+
+/* removed servers whose threads haven't finished yet */
+static List *retired;
+
+/* with --drain, only send what's queued and exit */
+static bool drain_only;
+static Mapping *import_mapping; /* the file passed to --import */
+
+/* --record writes the xmms2 events to a trace, --replay feeds them to
+ * the same callbacks again.
+ */
+static TraceWriter *recorder;
+static int64_t recording_started; /* see timer_now() */
+static TraceReader *replayer;
+static bool replay_fast; /* don't wait between events */
+static TraceEvent replay_next;
+static bool replay_pending; /* replay_next hasn't been handled yet */
+static int64_t replay_started = -1; /* see timer_now() */
+static struct timespec replay_begin;
+static unsigned long replayed;
+static time_t replay_clock; /* when the current event was recorded */
+
+/* DNS cache, TLS sessions and connections are shared between servers */
+static CURLSH *share;
+static pthread_mutex_t share_mutexes[CURL_LOCK_DATA_LAST];
+
+static Engine engine = ENGINE_THREADS;
+
+/* state of the curl_multi engine */
+static CURLM *multi;
+static struct pollfd *multi_fds;
+static int multi_fds_count, multi_fds_allocated;
+static int64_t multi_timeout_at = -1;
+static TimerHeap multi_timers;
+
+/* state of the pool engine. the workers' curl handles are kept in
+ * 'worker_curl', and cleaned up when the workers exit.
+ */
+static Pool *pool;
+static int workers; /* 0 means one per processor */
+static pthread_key_t worker_curl;
+
 static bool keep_running = true;
 
 static struct sigaction sig;
@@ -86,16 +307,39 @@ server_new (const char *name)
 {
 	Server *server;
 
-	server = malloc (sizeof (Server));
+	/* everything that isn't set below starts out zeroed */
+	server = calloc (1, sizeof (Server));
+
+	server->incoming = ring_new (INCOMING_SIZE);
+
+	if (!server->incoming) {
+		free (server);
+		return NULL;
+	}
 
 	strncpy (server->name, name, sizeof (server->name));
 	server->name[sizeof (server->name) - 1] = 0;
 
-	pthread_mutex_init (&server->submissions_mutex, NULL);
-	pthread_cond_init (&server->cond, NULL);
-
 	server->need_handshake = true;
-	server->shutdown_thread = false;
+	server->lock_fd = -1;
+	server->queued = dedup_set_new ();
+	pthread_mutex_init (&server->queued_mutex, NULL);
+
+	server->spill_line = strbuf_new ();
+	server->memory_limit = DEFAULT_QUEUE_MEMORY * 1024;
+
+	backoff_init (&server->handshake_backoff, HANDSHAKE_DELAY_MIN * 1000,
+	              HANDSHAKE_DELAY_MAX * 1000);
+	backoff_init (&server->retry_backoff, RETRY_DELAY_MIN * 1000,
+	              RETRY_DELAY_MAX * 1000);
+
+	server->multi_state = MULTI_IDLE;
+	timer_init (&server->timer, server);
+	pool_task_init (&server->task, pool_step, server);
+
+	server->batch_size = MAX_BATCH_SIZE;
+	server->batch_window = DEFAULT_BATCH_WINDOW;
+	server->request = strbuf_new ();
 
 	queue_init (&server->submissions);
 
@@ -105,8 +349,25 @@ server_new (const char *name)
 static void
 server_free (Server *server)
 {
-	pthread_mutex_destroy (&server->submissions_mutex);
-	pthread_cond_destroy (&server->cond);
+	ring_free (server->incoming);
+	queue_clear (&server->submissions);
+
+	if (server->now_playing)
+		submission_unref (server->now_playing);
+
+	dedup_set_free (server->queued);
+	pthread_mutex_destroy (&server->queued_mutex);
+
+	if (server->spill)
+		spill_free (server->spill);
+
+	strbuf_free (server->spill_line);
+	free (server->skipped);
+
+	strbuf_free (server->request);
+
+	if (server->lock_fd > -1)
+		close (server->lock_fd);
 
 	free (server);
 }
@@ -117,17 +378,29 @@ server_check_config (Server *server)
 	bool config_ok = true;
 
 	if (!*server->user) {
-		fprintf (stderr, "[%s] username not specified\n", server->name);
+		log_warning ("[%s] username not specified\n", server->name);
 		config_ok = false;
 	}
 
 	if (!*server->hashed_password) {
-		fprintf (stderr, "[%s] password not specified\n", server->name);
+		log_warning ("[%s] password not specified\n", server->name);
 		config_ok = false;
 	}
 
 	if (!*server->handshake_url) {
-		fprintf (stderr, "[%s] handshake URL not specified\n", server->name);
+		log_warning ("[%s] handshake URL not specified\n", server->name);
+		config_ok = false;
+	}
+
+	if (server->batch_size < 1 || server->batch_size > MAX_BATCH_SIZE) {
+		log_warning ("[%s] batch_size must be between 1 and %i\n",
+		             server->name, MAX_BATCH_SIZE);
+		config_ok = false;
+	}
+
+	if (server->batch_window < 0) {
+		log_warning ("[%s] batch_window must not be negative\n",
+		             server->name);
 		config_ok = false;
 	}
 
@@ -142,156 +415,186 @@ signal_handler (int sig)
 }
 
 static size_t
-handle_handshake_reponse (void *rawptr, size_t size, size_t nmemb,
-                          void *data)
+on_response_data (void *ptr, size_t size, size_t nmemb, void *data)
 {
 	Server *server = data;
-	size_t total = size * nmemb, left = total;
-	char *ptr = rawptr, *newline;
-	int len;
+	size_t total = size * nmemb;
 
-        /* parse buffer as chunk-encoded string if \r\n pattern found */
-        char *endline = ptr;
+	response_parser_feed (&server->response, ptr, total);
 
-        len = 0;
-        while ((newline = strstr(endline, "\r\n"))) {
-            newline += 2;
-            endline = strstr(newline, "\r\n");
-            if (!endline) {
-                fprintf (stderr, "chunk conversion error\n");
-                return total;
-            }
-            strncpy(ptr + len, newline, endline - newline);
-            len += endline - newline;
-            endline += 2;
-        }
+	return total;
+}
 
-        if (len) {
-            *(ptr + len) = '\0';
-        }
+/* the file is only a cache, so it isn't synced */
+static void
+save_session (Server *server)
+{
+	char tmp_filename[PATH_MAX + 4];
+	FILE *fp = NULL;
+	int fd;
 
+	if (!server->session_file[0])
+		return;
 
-	newline = memchr (ptr, '\n', left);
-	if (!newline) {
-		fprintf (stderr, "no newline (0)\n");
-		return total;
-	}
+	snprintf (tmp_filename, sizeof (tmp_filename), "%s.tmp",
+	          server->session_file);
 
-	*newline = 0;
+	/* the session id is as good as the password */
+	fd = open (tmp_filename, O_WRONLY | O_CREAT | O_TRUNC, 0600);
 
-	if (strcmp (ptr, "OK")) {
-		fprintf (stderr, "handshake failed\n");
-		return total;
-	}
+	if (fd > -1)
+		fp = fdopen (fd, "w");
 
-	len = newline - ptr + 1;
+	if (!fp) {
+		log_error ("[%s] cannot save session: %s\n",
+		           server->name, strerror (errno));
 
-	left -= len;
-	ptr += len;
+		if (fd > -1)
+			close (fd);
 
-	newline = memchr (ptr, '\n', left);
-	if (!newline) {
-		fprintf (stderr, "no newline (1)\n");
-		return total;
+		return;
 	}
 
-	*newline = 0;
-
-	len = newline - ptr + 1;
-
-	if (len > 255) {
-		fprintf (stderr, "session ID is too long (%i characters)\n", len);
-		return total;
+	fprintf (fp, "created: %li\n", (long) time (NULL));
+	fprintf (fp, "user: %s\n", server->user);
+	fprintf (fp, "handshake_url: %s\n", server->handshake_url);
+	fprintf (fp, "session_id: %s\n", server->session_id);
+	fprintf (fp, "np_url: %s\n", server->np_url);
+	fprintf (fp, "subm_url: %s\n", server->subm_url);
+
+	if (fclose (fp) || rename (tmp_filename, server->session_file)) {
+		log_error ("[%s] cannot save session: %s\n",
+		           server->name, strerror (errno));
+		unlink (tmp_filename);
 	}
+}
 
-	strcpy (server->session_id, ptr);
+static void
+forget_session (Server *server)
+{
+	if (server->session_file[0])
+		unlink (server->session_file);
+}
 
-	left -= len;
-	ptr += len;
+static void
+finish_handshake (Server *server, ResponseStatus status)
+{
+	ResponseParser *p = &server->response;
 
-	/* now playing URL */
-	newline = memchr (ptr, '\n', left);
-	if (!newline) {
-		fprintf (stderr, "no newline (2)\n");
-		return total;
+	if (status != RESPONSE_OK) {
+		log_warning ("[%s] handshake failed: '%s'\n",
+		             server->name, p->lines[RESPONSE_LINE_STATUS]);
+		return;
 	}
 
-	*newline = 0;
+	strcpy (server->session_id, p->lines[RESPONSE_LINE_SESSION_ID]);
+	strcpy (server->np_url, p->lines[RESPONSE_LINE_NP_URL]);
+	strcpy (server->subm_url, p->lines[RESPONSE_LINE_SUBM_URL]);
 
-	len = newline - ptr + 1;
+	log_debug ("got:\n'%s' '%s' '%s'\n",
+	           server->session_id, server->np_url, server->subm_url);
 
-	if (len > 255) {
-		fprintf (stderr, "now_playing URL is too long "
-		         "(%i characters)\n", len);
-		return total;
-	}
-
-	strcpy (server->np_url, ptr);
+	save_session (server);
 
-	left -= len;
-	ptr += len;
+	server->need_handshake = false;
+	server->hard_failure_count = 0;
 
-	/* submission URL */
-	newline = memchr (ptr, '\n', left);
-	if (!newline) {
-		printf("no newline (3)\n");
-		return total;
+	if (server->stats) {
+		stats_begin (server->stats);
+		server->stats->handshakes++;
+		server->stats->hard_failures = 0;
+		stats_end (server->stats);
 	}
+}
 
-	*newline = 0;
+static void
+finish_response (Server *server, ResponseStatus status)
+{
+	const char *line = server->response.lines[RESPONSE_LINE_STATUS];
 
-	len = newline - ptr + 1;
+	log_debug ("[%s] response: '%s'\n", server->name, line);
 
-	if (len > 255) {
-		fprintf (stderr, "submission URL is too long "
-		         "(%i characters)\n", len);
-		return total;
+	switch (status) {
+		case RESPONSE_BADSESSION:
+			/* need to perform handshake again */
+			server->need_handshake = true;
+			forget_session (server);
+			log_warning ("[%s] BADSESSION\n", server->name);
+
+			if (server->stats) {
+				stats_begin (server->stats);
+				server->stats->bad_sessions++;
+				stats_end (server->stats);
+			}
+			break;
+		case RESPONSE_OK:
+			/* submission succeeded */
+			log_info ("[%s] success \\o/\n", server->name);
+			server->submission_was_success = true;
+			break;
+		case RESPONSE_FAILED:
+			log_warning ("[%s] couldn't submit: '%s'\n",
+			             server->name, line);
+			break;
+		default:
+			break;
 	}
+}
 
-	strcpy (server->subm_url, ptr);
+/* evaluates the response to the request on the server's curl handle.
+ * 'result' says whether the transfer itself succeeded.
+ */
+static void
+handle_response (Server *server, CURLcode result)
+{
+	ResponseParser *p = &server->response;
+	ResponseStatus status;
 
-	fprintf (stderr, "got:\n'%s' '%s' '%s'\n",
-	         server->session_id, server->np_url, server->subm_url);
+	status = response_parser_finish (p, result == CURLE_OK);
 
-	server->need_handshake = false;
-	server->hard_failure_count = 0;
+	if (p->type == RESPONSE_HANDSHAKE)
+		finish_handshake (server, status);
+	else
+		finish_response (server, status);
+}
 
-	return total;
+static void
+share_lock (CURL *curl, curl_lock_data data, curl_lock_access access,
+            void *udata)
+{
+	pthread_mutex_lock (&share_mutexes[data]);
 }
 
-static size_t
-handle_submission_reponse (void *ptr, size_t size, size_t nmemb,
-                           void *data)
+static void
+share_unlock (CURL *curl, curl_lock_data data, void *udata)
 {
-	Server *server = data;
-	size_t total = size * nmemb;
-	char *newline;
+	pthread_mutex_unlock (&share_mutexes[data]);
+}
 
-	newline = memchr (ptr, '\n', total);
-	if (!newline) {
-		fprintf (stderr, "[%s] no newline\n", server->name);
-		return total;
-	}
+static void
+share_init ()
+{
+	for (int i = 0; i < CURL_LOCK_DATA_LAST; i++)
+		pthread_mutex_init (&share_mutexes[i], NULL);
 
-	*newline = 0;
+	share = curl_share_init ();
 
-	fprintf (stderr, "[%s] response: '%s'\n",
-	         server->name, (char *) ptr);
+	curl_share_setopt (share, CURLSHOPT_LOCKFUNC, share_lock);
+	curl_share_setopt (share, CURLSHOPT_UNLOCKFUNC, share_unlock);
+	curl_share_setopt (share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt (share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+	curl_share_setopt (share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+}
 
-	if (!strcmp (ptr, "BADSESSION")) {
-		/* need to perform handshake again */
-		server->need_handshake = true;
-		fprintf (stderr, "[%s] BADSESSION\n", server->name);
-	} else if (!strcmp (ptr, "OK")) {
-		/* submission succeeded */
-		fprintf (stderr, "[%s] success \\o/\n", server->name);
-		server->submission_was_success = true;
-	} else if (total >= strlen ("FAILED ")) {
-		fprintf (stderr, "[%s] couldn't submit: '%s'\n",
-		         server->name, (char *) ptr);
-	}
+static void
+share_cleanup ()
+{
+	curl_share_cleanup (share);
 
-	return total;
+	for (int i = 0; i < CURL_LOCK_DATA_LAST; i++)
+		pthread_mutex_destroy (&share_mutexes[i]);
 }
 
 static void
@@ -309,11 +612,76 @@ set_proxy (Server *server, CURL *curl)
 		curl_easy_setopt (curl, CURLOPT_PROXYUSERPWD, proxy_userpwd);
 }
 
-/* perform the handshake and return true on success, false otherwise. */
-static bool
-do_handshake (Server *server)
+/* lets a server that has been removed abort its transfer */
+static int
+on_transfer_progress (void *data, curl_off_t dltotal, curl_off_t dlnow,
+                      curl_off_t ultotal, curl_off_t ulnow)
 {
-	CURL *curl;
+	Server *server = data;
+
+	return __atomic_load_n (&server->removed, __ATOMIC_ACQUIRE);
+}
+
+/* reset the server's curl handle for a new kind of request.
+ * curl_easy_reset() keeps the handle's connections alive.
+ */
+static void
+reset_handle (Server *server)
+{
+	curl_easy_reset (server->curl);
+
+	curl_easy_setopt (server->curl, CURLOPT_SHARE, share);
+	curl_easy_setopt (server->curl, CURLOPT_PRIVATE, server);
+
+	curl_easy_setopt (server->curl, CURLOPT_NOPROGRESS, 0L);
+	curl_easy_setopt (server->curl, CURLOPT_XFERINFOFUNCTION,
+	                  on_transfer_progress);
+	curl_easy_setopt (server->curl, CURLOPT_XFERINFODATA, server);
+
+	/* curl copies the strings */
+	pthread_mutex_lock (&config_mutex);
+
+	if (request_timeout > 0)
+		curl_easy_setopt (server->curl, CURLOPT_TIMEOUT,
+		                  (long) request_timeout);
+
+	set_proxy (server, server->curl);
+
+	pthread_mutex_unlock (&config_mutex);
+}
+
+/* must be called when a transfer on the server's curl handle is done */
+static void
+count_connections (Server *server)
+{
+	long connects = 0;
+
+	/* CURLINFO_NUM_CONNECTS is the number of new connections
+	 * that were needed for this transfer.
+	 */
+	curl_easy_getinfo (server->curl, CURLINFO_NUM_CONNECTS, &connects);
+
+	if (connects)
+		server->connections_new += connects;
+	else
+		server->connections_reused++;
+}
+
+static void
+perform (Server *server)
+{
+	CURLcode result;
+
+	result = curl_easy_perform (server->curl);
+	count_connections (server);
+	handle_response (server, result);
+}
+
+/* set up the server's curl handle for a handshake request */
+static void
+setup_handshake (Server *server)
+{
+	CURL *curl = server->curl;
 	char hashed[64], post_data[512];
 	time_t timestamp;
 	int pos;
@@ -338,611 +706,2434 @@ do_handshake (Server *server)
 	 */
 	md5 (hashed, &post_data[pos]);
 
-	curl = curl_easy_init ();
+	reset_handle (server);
 
-	set_proxy (server, curl);
+	response_parser_init (&server->response, RESPONSE_HANDSHAKE);
 
 	curl_easy_setopt (curl, CURLOPT_URL, post_data);
-	curl_easy_setopt (curl, CURLOPT_WRITEFUNCTION,
-	                  handle_handshake_reponse);
+	curl_easy_setopt (curl, CURLOPT_WRITEFUNCTION, on_response_data);
 	curl_easy_setopt (curl, CURLOPT_WRITEDATA, server);
-	curl_easy_setopt(curl, CURLOPT_HTTP_TRANSFER_DECODING, 0);
-	curl_easy_perform (curl);
-	curl_easy_cleanup (curl);
+}
+
+/* perform the handshake and return true on success, false otherwise. */
+static bool
+do_handshake (Server *server)
+{
+	setup_handshake (server);
+	perform (server);
 
 	return !server->need_handshake;
 }
 
 static bool
-handshake_if_needed (Server *server)
+shutting_down (Server *server)
 {
-	int delay = 30;
+	return __atomic_load_n (&server->shutdown_thread, __ATOMIC_ACQUIRE);
+}
 
-	while (server->need_handshake) {
-		struct timespec ts;
-		bool shutdown;
+/* the memory that a queued submission takes up, roughly */
+static int
+resident_size (Submission *s)
+{
+	return sizeof (Submission) + submission_size (s);
+}
 
-		if (do_handshake (server))
-			return true;
+static void
+update_spill_stats (Server *server, int delta)
+{
+	if (!server->stats)
+		return;
 
-		delay *= 2;
+	stats_begin (server->stats);
+	server->stats->spilled += delta;
+	stats_end (server->stats);
+}
 
-		/* there's a maximum delay of two hours */
-		if (delay > 7200)
-			delay = 7200;
+/* true if a submission of 'size' bytes would go to the spill.
+ * a full batch is always kept in memory.
+ */
+static bool
+must_spill (Server *server, int size)
+{
+	return server->spill->count ||
+	       (server->resident_bytes + size > server->memory_limit &&
+	        queue_length (&server->submissions) >= server->batch_size);
+}
 
-#ifdef CLOCK_REALTIME
-		clock_gettime (CLOCK_REALTIME, &ts);
-#else
-		struct timeval tv;
+/* adds a submission to the tail of the queue. if the queue's memory
+ * budget is used up, it's written to the spill instead, unless the
+ * spill cannot take it.
+ */
+static void
+keep_submission (Server *server, Submission *s)
+{
+	int size = resident_size (s);
 
-		gettimeofday (&tv, NULL);
+	if (must_spill (server, size)) {
+		strbuf_truncate (server->spill_line, 0);
+		submission_encode (server->spill_line, s, 0);
 
-		ts.tv_sec = tv.tv_sec;
-		ts.tv_nsec = tv.tv_usec * 1000;
-#endif
+		if (spill_write (server->spill, server->spill_line->buf,
+		                 server->spill_line->length)) {
+			submission_unref (s);
+			update_spill_stats (server, 1);
+			return;
+		}
+	}
 
-		ts.tv_sec += delay;
+	queue_push (&server->submissions, s);
+	server->resident_bytes += size;
+}
 
-		int e;
+/* forgets about a queued submission that cannot be sent.
+ * its size is unknown, and so is its hash, which stays in 'queued'.
+ */
+static void
+drop_unreadable (Server *server)
+{
+	__atomic_sub_fetch (&server->pending, 1, __ATOMIC_RELEASE);
+	update_queue_stats (server, -1, 0);
+}
 
-		do {
-			pthread_mutex_lock (&server->submissions_mutex);
-			e = pthread_cond_timedwait (&server->cond,
-			                            &server->submissions_mutex, &ts);
-			shutdown = server->shutdown_thread;
-			pthread_mutex_unlock (&server->submissions_mutex);
+/* the journal record of the submission that would go to the tail of
+ * the queue is to be acked as soon as the ones ahead of it are.
+ */
+static void
+skip_record (Server *server)
+{
+	int ahead = queue_length (&server->submissions);
 
-			if (shutdown)
-				return false;
-		} while (e != ETIMEDOUT);
+	if (!ahead) {
+		journal_ack (server->journal, 1);
+		return;
 	}
 
-	return true;
+	server->skipped = realloc (server->skipped,
+	                           (server->skipped_count + 1) * sizeof (int));
+	server->skipped[server->skipped_count++] = ahead;
 }
 
-static void *
-curl_thread (void *arg)
+/* returns the number of skipped journal records that are acked
+ * together with the 'count' submissions at the head of the queue.
+ */
+static int
+take_skipped (Server *server, int count)
 {
-	Server *server = arg;
-	CURL *curl;
+	int n = 0;
 
-	fprintf (stderr, "starting thread for %s\n", server->name);
-
-	pthread_mutex_lock (&server->submissions_mutex);
-
-	while (!server->shutdown_thread) {
-		/* check whether there's data waiting to be
-		 * submitted.
-		 */
-		if (!queue_peek (&server->submissions)) {
-			pthread_cond_wait (&server->cond, &server->submissions_mutex);
-			continue;
-		}
+	while (n < server->skipped_count && server->skipped[n] <= count)
+		n++;
 
-		pthread_mutex_unlock (&server->submissions_mutex);
+	server->skipped_count -= n;
+	memmove (server->skipped, server->skipped + n,
+	         server->skipped_count * sizeof (int));
 
-		curl = curl_easy_init ();
+	for (int i = 0; i < server->skipped_count; i++)
+		server->skipped[i] -= count;
 
-		set_proxy (server, curl);
+	return n;
+}
 
-		curl_easy_setopt (curl, CURLOPT_POST, 1);
-		curl_easy_setopt (curl, CURLOPT_WRITEFUNCTION,
-		                  handle_submission_reponse);
-		curl_easy_setopt (curl, CURLOPT_WRITEDATA, server);
+/* moves spilled submissions back to the queue while there's room */
+static void
+refill_queue (Server *server)
+{
+	int count = 0;
 
-		while (true) {
-			Submission *submission;
-			bool shutdown;
-			int orig_length;
+	while (server->spill->count &&
+	       (server->resident_bytes < server->memory_limit ||
+	        queue_length (&server->submissions) < server->batch_size)) {
+		Submission *s;
+		const char *line;
+		int length;
 
-			server->submission_was_success = false;
+		line = spill_read (server->spill, &length);
 
-			pthread_mutex_lock (&server->submissions_mutex);
-			submission = queue_peek (&server->submissions);
-			shutdown = server->shutdown_thread;
-			pthread_mutex_unlock (&server->submissions_mutex);
+		if (!line)
+			break;
 
-			if (!submission || shutdown)
-				break;
+		count++;
 
-			if (!handshake_if_needed (server))
-				break;
+		/* the line was written by keep_submission() */
+		s = submission_parse (NULL, line, length);
 
-			/* append the current session id, but remember
-			 * the current length of the string first.
-			 */
-			orig_length = submission->sb->length;
-
-			strbuf_append (submission->sb, "&s=");
-			strbuf_append (submission->sb, server->session_id);
-
-			fprintf (stderr, "[%s] submitting '%s'\n",
-			         server->name, submission->sb->buf);
-
-			if (submission->type == SUBMISSION_TYPE_NOW_PLAYING)
-				curl_easy_setopt (curl, CURLOPT_URL, server->np_url);
-			else
-				curl_easy_setopt (curl, CURLOPT_URL, server->subm_url);
-
-			curl_easy_setopt (curl, CURLOPT_POSTFIELDS,
-			                  submission->sb->buf);
-			curl_easy_perform (curl);
-
-			if (!server->submission_was_success &&
-			    !server->need_handshake &&
-			    ++server->hard_failure_count == 3)
-				server->need_handshake = true;
-
-			if (server->submission_was_success ||
-			    submission->type == SUBMISSION_TYPE_NOW_PLAYING) {
-				/* if the submission was successful, or if it was a
-				 * now-playing submission, remove the item from the
-				 * queue.
-				 */
-				pthread_mutex_lock (&server->submissions_mutex);
-				queue_pop (&server->submissions);
-				pthread_mutex_unlock (&server->submissions_mutex);
-
-				submission_free (submission);
-			} else if (!server->submission_was_success) {
-				/* if the (profile) submission wasn't successful,
-				 * remove the session id from the string again.
-				 */
-				strbuf_truncate (submission->sb, orig_length);
-			}
+		if (!s) {
+			log_error ("[%s] cannot parse spilled entry "
+			           "'%.*s'\n", server->name, length, line);
+			drop_unreadable (server);
+			skip_record (server);
+			continue;
 		}
 
-		curl_easy_cleanup (curl);
-
-		pthread_mutex_lock (&server->submissions_mutex);
+		queue_push (&server->submissions, s);
+		server->resident_bytes += resident_size (s);
 	}
 
-	return NULL;
+	if (count)
+		update_spill_stats (server, -count);
 }
 
+/* moves newly queued submissions to the server's own queue */
 static void
-enqueue (Server *server, Submission *submission)
+receive_submissions (Server *server)
 {
-	pthread_mutex_lock (&server->submissions_mutex);
-	queue_push (&server->submissions, submission);
-	pthread_cond_signal (&server->cond);
-	pthread_mutex_unlock (&server->submissions_mutex);
+	Submission *s;
+
+	while ((s = ring_pop (server->incoming)))
+		keep_submission (server, s);
 }
 
-static void
-submit_now_playing (xmmsv_t *val)
+static bool
+has_now_playing (Server *server)
 {
-	Submission *submission;
-	xmmsv_t *dict;
-
-	dict = xmmsv_propdict_to_dict (val, NULL);
-	submission = now_playing_submission_new (dict);
-	xmmsv_unref (dict);
-
-	if (submission) {
-		enqueue (servers->data, submission);
-
-		for (List *l = servers->next; l; l = l->next) {
-			Server *server = l->data;
+	return !!__atomic_load_n (&server->now_playing, __ATOMIC_ACQUIRE);
+}
 
-			enqueue (server, submission_clone (submission));
-		}
-	}
+/* takes the latest now-playing submission, if there is one */
+static Submission *
+take_now_playing (Server *server)
+{
+	return __atomic_exchange_n (&server->now_playing, NULL,
+	                            __ATOMIC_ACQ_REL);
 }
 
+/* sleeps until 'deadline' (see timer_now()) while taking in new
+ * submissions, so that the ring doesn't fill up during long waits.
+ * returns false if the thread should stop.
+ */
 static bool
-submit_to_profile (xmmsv_t *val)
+wait_until (Server *server, int64_t deadline)
 {
-	Submission *submission;
-	xmmsv_t *dict;
-
-	dict = xmmsv_propdict_to_dict (val, NULL);
-	submission = profile_submission_new (dict, seconds_played,
-	                                     started_playing);
-	xmmsv_unref (dict);
-
-	if (submission) {
-		enqueue (servers->data, submission);
-
-		for (List *l = servers->next; l; l = l->next) {
-			Server *server = l->data;
+	int64_t now;
 
-			enqueue (server, submission_clone (submission));
-		}
+	while (!shutting_down (server) && (now = timer_now ()) < deadline) {
+		ring_wait (server->incoming, deadline - now);
+		receive_submissions (server);
 	}
 
-	return !!submission;
+	return !shutting_down (server);
 }
 
-static int
-on_medialib_get_info2 (xmmsv_t *val, void *udata)
+static bool
+handshake_if_needed (Server *server)
 {
-	bool reset_current_id = XPOINTER_TO_INT (udata);
-
-	seconds_played += time (NULL) - last_unpause;
-	fprintf (stderr, "submitting: seconds_played %i\n", seconds_played);
+	while (server->need_handshake) {
+		if (do_handshake (server)) {
+			backoff_reset (&server->handshake_backoff);
+			return true;
+		}
 
-	/* if we could submit this song we might have to reset
-	 * 'current_id', so we don't submit it again.
-	 */
-	if (submit_to_profile (val) && reset_current_id)
-		current_id = INVALID_MEDIA_ID;
+		if (!wait_until (server, timer_now () +
+		                 backoff_next (&server->handshake_backoff)))
+			return false;
+	}
 
-	return 0;
+	return true;
 }
 
+/* returns the number of submissions at the head of the queue that
+ * can go into a single request.
+ * if 'complete' is non-NULL, it's set to true if waiting for more
+ * submissions cannot make the batch any larger.
+ */
 static int
-on_medialib_get_info (xmmsv_t *val, void *udata)
+count_batchable (Server *server, bool *complete)
 {
-	submit_now_playing (val);
+	int count = queue_length (&server->submissions);
 
-	fprintf (stderr, "resetting seconds_played\n");
-	last_unpause = started_playing = time (NULL);
-	seconds_played = 0;
+	if (count > server->batch_size)
+		count = server->batch_size;
 
-	return 0;
+	if (complete)
+		*complete = count == server->batch_size;
+
+	return count;
+}
+
+/* wait up to 'batch_window' milliseconds for more profile submissions
+ * to arrive, so that they can be sent in a single request.
+ * returns the number of submissions to send.
+ */
+static int
+wait_for_batch (Server *server)
+{
+	bool complete;
+	int count;
+	int64_t deadline, now;
+
+	receive_submissions (server);
+	count = count_batchable (server, &complete);
+
+	if (complete || !server->batch_window)
+		return count;
+
+	deadline = timer_now () + server->batch_window;
+
+	while (!complete && !shutting_down (server) &&
+	       (now = timer_now ()) < deadline) {
+		ring_wait (server->incoming, deadline - now);
+		receive_submissions (server);
+		count = count_batchable (server, &complete);
+	}
+
+	return count;
 }
 
+/* build the request body for the 'count' submissions at the head of
+ * the queue, or for the now-playing submission 'head', and set up the
+ * server's curl handle to send it.
+ */
 static void
-maybe_submit_to_profile (bool reset_current_id)
+setup_submission (Server *server, Submission *head, int count)
 {
-	xmmsc_result_t *mediainfo_result;
+	CURL *curl = server->curl;
+	StrBuf *request = server->request;
 
-	/* check whether we're interesting in this track at all */
-	if (current_id == INVALID_MEDIA_ID)
+	strbuf_truncate (request, 0);
+
+	if (head->type == SUBMISSION_TYPE_NOW_PLAYING) {
+		submission_encode (request, head, 0);
+	} else {
+		for (int i = 0; i < count; i++) {
+			Submission *s = queue_peek_nth (&server->submissions, i);
+
+			if (i)
+				strbuf_append (request, "&");
+
+			submission_encode (request, s, i);
+		}
+	}
+
+	strbuf_append (request, "&s=");
+	strbuf_append (request, server->session_id);
+
+	log_info ("[%s] submitting %i item(s)\n", server->name, count);
+	log_debug ("[%s] request: '%s'\n", server->name, request->buf);
+
+	server->submission_was_success = false;
+	response_parser_init (&server->response, RESPONSE_SUBMISSION);
+
+	reset_handle (server);
+
+	curl_easy_setopt (curl, CURLOPT_POST, 1);
+	curl_easy_setopt (curl, CURLOPT_WRITEFUNCTION, on_response_data);
+	curl_easy_setopt (curl, CURLOPT_WRITEDATA, server);
+
+	if (head->type == SUBMISSION_TYPE_NOW_PLAYING)
+		curl_easy_setopt (curl, CURLOPT_URL, server->np_url);
+	else
+		curl_easy_setopt (curl, CURLOPT_URL, server->subm_url);
+
+	curl_easy_setopt (curl, CURLOPT_POSTFIELDS, request->buf);
+}
+
+/* 'depth' and 'bytes' are negative if submissions were removed. */
+static void
+update_queue_stats (Server *server, int depth, int bytes)
+{
+	if (!server->stats)
 		return;
 
-	mediainfo_result = xmmsc_medialib_get_info (conn, current_id);
-	xmmsc_result_notifier_set (mediainfo_result,
-	                           on_medialib_get_info2,
-	                           XINT_TO_POINTER (reset_current_id));
-	xmmsc_result_unref (mediainfo_result);
+	stats_begin (server->stats);
+	server->stats->queue_depth += depth;
+	server->stats->queued_bytes += bytes;
+	stats_end (server->stats);
 }
 
-static int
-on_playback_current_id (xmmsv_t *val, void *udata)
+static void
+update_submission_stats (Server *server, int count, int removed,
+                         int removed_bytes)
 {
-	xmmsc_result_t *mediainfo_result;
-	int32_t id = INVALID_MEDIA_ID;
+	StatsServer *st = server->stats;
 
-	/* if the submission works, we must NOT reset current_id
-	 * because we set it a couple of lines below (to the new
-	 * song's ID). we must not overwrite that value.
-	 */
-	maybe_submit_to_profile (false);
+	if (!st)
+		return;
 
-	/* get the new song's medialib id. */
-	xmmsv_get_int (val, &id);
+	stats_begin (st);
 
-	fprintf (stderr, "now playing %u\n", id);
+	st->sent += count;
 
-	current_id = id;
+	if (server->submission_was_success) {
+		st->acked += count;
+		st->last_success = time (NULL);
+	} else {
+		st->failed += count;
+	}
 
-	/* request information about this song. */
-	mediainfo_result = xmmsc_medialib_get_info (conn, id);
-	xmmsc_result_notifier_set (mediainfo_result,
-	                           on_medialib_get_info, NULL);
-	xmmsc_result_unref (mediainfo_result);
+	st->hard_failures = server->hard_failure_count;
+	st->queue_depth -= removed;
+	st->queued_bytes -= removed_bytes;
 
-	return 1;
+	stats_end (st);
+}
+
+/* returns false if a submission with the same hash is queued already */
+static bool
+mark_queued (Server *server, uint64_t hash)
+{
+	bool ret;
+
+	pthread_mutex_lock (&server->queued_mutex);
+	ret = dedup_set_add (server->queued, hash);
+	pthread_mutex_unlock (&server->queued_mutex);
+
+	return ret;
+}
+
+static void
+unmark_queued (Server *server, Submission *submission)
+{
+	uint64_t hash = submission_hash (submission);
+
+	pthread_mutex_lock (&server->queued_mutex);
+	dedup_set_remove (server->queued, hash);
+	pthread_mutex_unlock (&server->queued_mutex);
 }
 
+/* evaluate the response to a request that was set up by
+ * setup_submission().
+ * returns the number of milliseconds to wait before the next request.
+ */
 static int
-on_playback_status (xmmsv_t *val, void *udata)
+finish_submission (Server *server, SubmissionType type, int count)
 {
-	int s, status;
+	int removed = 0, removed_bytes = 0;
 
-	s = xmmsv_get_int (val, &status);
-	if (!s)
-		return 1;
+	if (!server->submission_was_success &&
+	    !server->need_handshake &&
+	    ++server->hard_failure_count == 3)
+		server->need_handshake = true;
 
-	switch (status) {
-		case XMMS_PLAYBACK_STATUS_STOP:
-		case XMMS_PLAYBACK_STATUS_PAUSE:
-			/* if we could submit this song we need to reset
-			 * 'current_id', so we don't submit it again.
-			 */
-			maybe_submit_to_profile (true);
+	if (type == SUBMISSION_TYPE_NOW_PLAYING) {
+		/* now-playing submissions are never sent again. if this
+		 * one failed, a newer one will come along soon enough.
+		 */
+		submission_unref (server->now_playing_in_flight);
+		server->now_playing_in_flight = NULL;
+	} else if (server->submission_was_success) {
+		/* if a profile submission failed, the whole batch stays
+		 * queued and will be sent again.
+		 */
+		journal_ack (server->journal,
+		             count + take_skipped (server, count));
+
+		__atomic_sub_fetch (&server->pending, count, __ATOMIC_RELEASE);
+
+		for (removed = 0; removed < count; removed++) {
+			Submission *s = queue_pop (&server->submissions);
+
+			removed_bytes += submission_size (s);
+			server->resident_bytes -= resident_size (s);
+			unmark_queued (server, s);
+			submission_unref (s);
+		}
+
+		refill_queue (server);
+
+		journal_commit (server->journal);
+	}
+
+	update_submission_stats (server, count, removed, removed_bytes);
+
+	if (server->submission_was_success) {
+		backoff_reset (&server->retry_backoff);
+		return 0;
+	}
+
+	/* a new session is due, that's delayed by handshake_backoff */
+	if (server->need_handshake)
+		return 0;
+
+	return backoff_next (&server->retry_backoff);
+}
+
+static void *
+curl_thread (void *arg)
+{
+	Server *server = arg;
+
+	log_info ("starting thread for %s\n", server->name);
+
+	server->curl = curl_easy_init ();
+
+	while (!shutting_down (server)) {
+		Submission *submission;
+		int count = 1, delay;
+
+		/* check whether there's data waiting to be
+		 * submitted.
+		 */
+		receive_submissions (server);
+		submission = queue_peek (&server->submissions);
+
+		if (!submission && !has_now_playing (server)) {
+			ring_wait (server->incoming, -1);
+			continue;
+		}
+
+		if (!handshake_if_needed (server))
 			break;
-		case XMMS_PLAYBACK_STATUS_PLAY:
-			last_unpause = time (NULL);
+
+		/* the now-playing submission is only picked up now, so
+		 * that it's the latest one even if the handshake took a
+		 * while.
+		 */
+		server->now_playing_in_flight = take_now_playing (server);
+
+		if (server->now_playing_in_flight)
+			submission = server->now_playing_in_flight;
+		else
+			count = wait_for_batch (server);
+
+		setup_submission (server, submission, count);
+		perform (server);
+		delay = finish_submission (server, submission->type, count);
+
+		if (delay) {
+			log_warning ("[%s] retrying in %i ms\n",
+			             server->name, delay);
+
+			if (!wait_until (server, timer_now () + delay))
+				break;
+		}
+	}
+
+	log_info ("[%s] connections: %lu new, %lu reused\n",
+	          server->name, server->connections_new,
+	          server->connections_reused);
+
+	curl_easy_cleanup (server->curl);
+	server->curl = NULL;
+
+	__atomic_store_n (&server->thread_done, true, __ATOMIC_RELEASE);
+
+	return NULL;
+}
+
+/* the curl_multi engine runs all servers' transfers from main_loop().
+ * each server is a small state machine that's advanced by
+ * multi_step() whenever new submissions are queued, a transfer is
+ * done or one of its timers expires.
+ */
+static void
+multi_start_transfer (Server *server, MultiState state)
+{
+	server->multi_state = state;
+	timer_heap_cancel (&multi_timers, &server->timer);
+
+	curl_multi_add_handle (multi, server->curl);
+}
+
+/* puts 'server' to sleep until 'until'. multi_step() is called then,
+ * but it might be called earlier if new submissions arrive.
+ */
+static void
+multi_sleep (Server *server, MultiState state, int64_t until)
+{
+	server->multi_state = state;
+	timer_heap_schedule (&multi_timers, &server->timer, until);
+}
+
+static void
+multi_step (Server *server)
+{
+	Submission *head;
+	bool complete = true;
+	int count = 1;
+	int64_t now = timer_now ();
+
+	switch (server->multi_state) {
+		case MULTI_HANDSHAKE:
+		case MULTI_SUBMISSION:
+			return;
+		case MULTI_BACKOFF:
+			if (now < server->timer.expires)
+				return;
+			break;
+		default:
 			break;
 	}
 
-	return 1;
+	receive_submissions (server);
+	head = queue_peek (&server->submissions);
+
+	if (!head && !has_now_playing (server)) {
+		server->multi_state = MULTI_IDLE;
+		return;
+	}
+
+	if (server->need_handshake) {
+		setup_handshake (server);
+		multi_start_transfer (server, MULTI_HANDSHAKE);
+		return;
+	}
+
+	server->now_playing_in_flight = take_now_playing (server);
+
+	if (server->now_playing_in_flight)
+		head = server->now_playing_in_flight;
+	else
+		count = count_batchable (server, &complete);
+
+	if (head->type == SUBMISSION_TYPE_PROFILE &&
+	    !complete && server->batch_window) {
+		/* give more submissions a chance to arrive */
+		if (server->multi_state != MULTI_BATCHING)
+			multi_sleep (server, MULTI_BATCHING,
+			             now + server->batch_window);
+
+		if (now < server->timer.expires)
+			return;
+	}
+
+	server->in_flight = count;
+	server->in_flight_type = head->type;
+
+	setup_submission (server, head, count);
+	multi_start_transfer (server, MULTI_SUBMISSION);
+}
+
+static void
+multi_transfer_done (Server *server, CURLcode result)
+{
+	int delay = 0;
+
+	curl_multi_remove_handle (multi, server->curl);
+	count_connections (server);
+	handle_response (server, result);
+
+	if (server->multi_state == MULTI_HANDSHAKE) {
+		if (server->need_handshake)
+			delay = backoff_next (&server->handshake_backoff);
+		else
+			backoff_reset (&server->handshake_backoff);
+	} else {
+		delay = finish_submission (server, server->in_flight_type,
+		                           server->in_flight);
+
+		if (delay)
+			log_warning ("[%s] retrying in %i ms\n",
+			             server->name, delay);
+	}
+
+	if (delay) {
+		multi_sleep (server, MULTI_BACKOFF, timer_now () + delay);
+		return;
+	}
+
+	server->multi_state = MULTI_IDLE;
+
+	multi_step (server);
 }
 
 static int
-on_quit (xmmsv_t *val, void *udata)
+on_multi_socket (CURL *curl, curl_socket_t fd, int what, void *udata,
+                 void *socketp)
 {
-	keep_running = false;
+	int i;
+
+	for (i = 0; i < multi_fds_count; i++)
+		if (multi_fds[i].fd == fd)
+			break;
+
+	if (what == CURL_POLL_REMOVE) {
+		if (i < multi_fds_count)
+			multi_fds[i] = multi_fds[--multi_fds_count];
+
+		return 0;
+	}
+
+	if (i == multi_fds_count) {
+		if (multi_fds_count == multi_fds_allocated) {
+			multi_fds_allocated = multi_fds_allocated * 2 + 4;
+			multi_fds = realloc (multi_fds, multi_fds_allocated *
+			                                sizeof (struct pollfd));
+		}
+
+		multi_fds[multi_fds_count++].fd = fd;
+	}
+
+	multi_fds[i].events = 0;
+
+	if (what & CURL_POLL_IN)
+		multi_fds[i].events |= POLLIN;
+
+	if (what & CURL_POLL_OUT)
+		multi_fds[i].events |= POLLOUT;
+
+	return 0;
+}
+
+static int
+on_multi_timer (CURLM *multi, long timeout_ms, void *udata)
+{
+	multi_timeout_at = (timeout_ms < 0) ? -1 : timer_now () + timeout_ms;
 
 	return 0;
 }
 
 static void
-on_disconnect (void *udata)
+multi_start_server (Server *server)
 {
-	keep_running = false;
+	server->curl = curl_easy_init ();
+
+	/* there might be queued submissions already */
+	multi_step (server);
 }
 
+/* aborts the server's transfer, if there's one. */
 static void
-strchomp (char *s, size_t *length)
+multi_stop_server (Server *server)
 {
-	size_t l = *length;
+	if (server->multi_state == MULTI_HANDSHAKE ||
+	    server->multi_state == MULTI_SUBMISSION)
+		curl_multi_remove_handle (multi, server->curl);
+
+	/* an aborted profile submission stays queued */
+	if (server->multi_state == MULTI_SUBMISSION &&
+	    server->now_playing_in_flight) {
+		submission_unref (server->now_playing_in_flight);
+		server->now_playing_in_flight = NULL;
+	}
 
-	while (l > 0 && isspace (s[l - 1]))
-		s[--l] = 0;
+	if (timer_is_scheduled (&server->timer))
+		timer_heap_cancel (&multi_timers, &server->timer);
+
+	server->multi_state = MULTI_IDLE;
+
+	log_info ("[%s] connections: %lu new, %lu reused\n",
+	          server->name, server->connections_new,
+	          server->connections_reused);
+
+	curl_easy_cleanup (server->curl);
+	server->curl = NULL;
+}
+
+static void
+multi_init ()
+{
+	multi = curl_multi_init ();
+	timer_heap_init (&multi_timers);
+
+	curl_multi_setopt (multi, CURLMOPT_SOCKETFUNCTION, on_multi_socket);
+	curl_multi_setopt (multi, CURLMOPT_TIMERFUNCTION, on_multi_timer);
+}
+
+static void
+multi_cleanup ()
+{
+	for (List *l = servers; l; l = l->next)
+		multi_stop_server (l->data);
+
+	curl_multi_cleanup (multi);
+	timer_heap_clear (&multi_timers);
+
+	free (multi_fds);
+}
+
+/* returns the number of milliseconds until the next timer of the
+ * curl_multi engine expires, or -1 if there's no timer.
+ */
+static int
+multi_get_timeout ()
+{
+	int64_t next = multi_timeout_at, now = timer_now ();
+	Timer *t = timer_heap_peek (&multi_timers);
+
+	if (t && (next == -1 || t->expires < next))
+		next = t->expires;
+
+	if (next == -1)
+		return -1;
+
+	return (next > now) ? next - now : 0;
+}
+
+/* 'fds' are the entries of 'multi_fds' that were passed to poll() */
+static void
+multi_handle_events (struct pollfd *fds, int count)
+{
+	CURLMsg *msg;
+	Timer *t;
+	int running, left;
+	int64_t now;
+
+	for (int i = 0; i < count; i++) {
+		int flags = 0;
+
+		if (fds[i].revents & POLLIN)
+			flags |= CURL_CSELECT_IN;
+
+		if (fds[i].revents & POLLOUT)
+			flags |= CURL_CSELECT_OUT;
+
+		if (fds[i].revents & (POLLERR | POLLHUP))
+			flags |= CURL_CSELECT_ERR;
+
+		if (flags)
+			curl_multi_socket_action (multi, fds[i].fd, flags, &running);
+	}
+
+	now = timer_now ();
+
+	if (multi_timeout_at != -1 && multi_timeout_at <= now) {
+		multi_timeout_at = -1;
+		curl_multi_socket_action (multi, CURL_SOCKET_TIMEOUT, 0, &running);
+	}
+
+	while ((msg = curl_multi_info_read (multi, &left))) {
+		Server *server;
+
+		if (msg->msg != CURLMSG_DONE)
+			continue;
+
+		curl_easy_getinfo (msg->easy_handle, CURLINFO_PRIVATE,
+		                   (char **) &server);
+		multi_transfer_done (server, msg->data.result);
+	}
+
+	while ((t = timer_heap_pop_expired (&multi_timers, now)))
+		multi_step (t->data);
+}
+
+/* the pool engine runs every server as a task on a fixed number of
+ * worker threads, so that servers that have nothing to do don't need
+ * a thread of their own. pool_step() is a blocking version of
+ * multi_step(): a worker runs it whenever new submissions are queued
+ * or the server's timer expires, and it does whatever is due.
+ */
+static void
+free_worker_curl (void *curl)
+{
+	curl_easy_cleanup (curl);
+}
+
+/* connections are shared, so any worker's handle will do */
+static CURL *
+get_worker_curl ()
+{
+	CURL *curl = pthread_getspecific (worker_curl);
+
+	if (!curl) {
+		curl = curl_easy_init ();
+		pthread_setspecific (worker_curl, curl);
+	}
+
+	return curl;
+}
+
+/* like multi_sleep(). only 'expires' of the server's timer is used,
+ * the timer that runs the task again belongs to the pool. that one
+ * is moved to 'until' as well, so pool_step() is never run early and
+ * then left without a timer.
+ */
+static void
+pool_sleep (Server *server, MultiState state, int64_t until)
+{
+	server->multi_state = state;
+	server->timer.expires = until;
+
+	pool_schedule_at (pool, &server->task, until);
+}
+
+static void
+pool_step (PoolTask *task)
+{
+	Server *server = task->data;
+	Submission *head;
+	bool complete = true;
+	int count = 1, delay;
+	int64_t now = timer_now ();
+
+	/* this is the last run, see pool_stop_server() */
+	if (shutting_down (server)) {
+		if (!server->thread_done) {
+			pool_cancel (pool, task);
+
+			log_info ("[%s] connections: %lu new, %lu reused\n",
+			          server->name, server->connections_new,
+			          server->connections_reused);
+
+			__atomic_store_n (&server->thread_done, true,
+			                  __ATOMIC_RELEASE);
+		}
+
+		return;
+	}
+
+	receive_submissions (server);
+
+	if (server->multi_state == MULTI_BACKOFF && now < server->timer.expires)
+		return;
+
+	head = queue_peek (&server->submissions);
+
+	if (!head && !has_now_playing (server)) {
+		server->multi_state = MULTI_IDLE;
+		return;
+	}
+
+	server->curl = get_worker_curl ();
+
+	if (server->need_handshake) {
+		if (!do_handshake (server)) {
+			pool_sleep (server, MULTI_BACKOFF, timer_now () +
+			            backoff_next (&server->handshake_backoff));
+			goto out;
+		}
+
+		backoff_reset (&server->handshake_backoff);
+	}
+
+	server->now_playing_in_flight = take_now_playing (server);
+
+	if (server->now_playing_in_flight)
+		head = server->now_playing_in_flight;
+	else
+		count = count_batchable (server, &complete);
+
+	if (head->type == SUBMISSION_TYPE_PROFILE &&
+	    !complete && server->batch_window) {
+		/* give more submissions a chance to arrive */
+		if (server->multi_state != MULTI_BATCHING)
+			pool_sleep (server, MULTI_BATCHING,
+			            now + server->batch_window);
+
+		if (now < server->timer.expires)
+			goto out;
+	}
+
+	setup_submission (server, head, count);
+	perform (server);
+	delay = finish_submission (server, head->type, count);
+
+	if (delay) {
+		log_warning ("[%s] retrying in %i ms\n", server->name, delay);
+		pool_sleep (server, MULTI_BACKOFF, timer_now () + delay);
+	} else {
+		/* there might be more to send */
+		server->multi_state = MULTI_IDLE;
+		pool_schedule (pool, task);
+	}
+
+out:
+	server->curl = NULL;
+}
+
+/* lets the server's task run once more, so that it notices that it
+ * should stop. it's done once its thread_done is set and the task is
+ * idle.
+ */
+static void
+pool_stop_server (Server *server)
+{
+	__atomic_store_n (&server->shutdown_thread, true, __ATOMIC_RELEASE);
+	pool_schedule (pool, &server->task);
+}
+
+static bool
+pool_init ()
+{
+	int count = workers;
+
+	if (count <= 0)
+		count = sysconf (_SC_NPROCESSORS_ONLN);
+
+	if (count <= 0)
+		count = 1;
+
+	pthread_key_create (&worker_curl, free_worker_curl);
+
+	pool = pool_new (count);
+
+	if (!pool) {
+		log_error ("cannot start the workers\n");
+		return false;
+	}
+
+	log_info ("using the pool engine with %i workers\n", pool->count);
+
+	return true;
+}
+
+/* waits until all servers have stopped */
+static void
+pool_cleanup ()
+{
+	for (List *l = servers; l; l = l->next)
+		pool_stop_server (l->data);
+
+	/* the workers' curl handles are cleaned up as they exit */
+	pool_stop (pool);
+
+	log_info ("pool: %lu tasks run, %lu stolen\n", pool->run, pool->stolen);
+
+	pool_free (pool);
+	pthread_key_delete (worker_curl);
+}
+
+/* 'line' is the encoded profile submission for the journal.
+ * the journal must be committed afterwards, see enqueue().
+ */
+static void
+queue_submission (Server *server, Submission *submission,
+                  const char *line, int length)
+{
+	/* the journal must see the submissions in queue order. that's a
+	 * given, as this is the only thread that queues submissions.
+	 */
+	journal_append (server->journal, line, length);
+
+	__atomic_add_fetch (&server->pending, 1, __ATOMIC_RELAXED);
+	update_queue_stats (server, 1, submission_size (submission));
+	ring_push (server->incoming, submission);
+}
+
+static void
+enqueue (Server *server, Submission *submission, StrBuf *line)
+{
+	queue_submission (server, submission, line->buf, line->length);
+
+	journal_commit (server->journal);
+
+	if (engine == ENGINE_MULTI)
+		multi_step (server);
+	else if (engine == ENGINE_POOL)
+		pool_schedule (pool, &server->task);
+}
+
+/* replaces the server's pending now-playing submission, if any. */
+static void
+set_now_playing (Server *server, Submission *submission)
+{
+	Submission *old;
+
+	old = __atomic_exchange_n (&server->now_playing, submission,
+	                           __ATOMIC_ACQ_REL);
+
+	if (old) {
+		log_debug ("[%s] dropping superseded now-playing "
+		           "submission\n", server->name);
+		submission_unref (old);
+
+		if (server->stats) {
+			stats_begin (server->stats);
+			server->stats->now_playing_coalesced++;
+			stats_end (server->stats);
+		}
+	}
+
+	if (engine == ENGINE_MULTI)
+		multi_step (server);
+	else if (engine == ENGINE_POOL)
+		pool_schedule (pool, &server->task);
+	else
+		ring_wake (server->incoming);
+}
+
+static void
+submit_now_playing (xmmsv_t *dict)
+{
+	Submission *submission;
+
+	submission = now_playing_submission_new (dict);
+
+	/* all servers share the same submission. the server threads
+	 * might drop their references right away, so we must keep ours
+	 * until the submission is queued everywhere.
+	 */
+	if (submission) {
+		for (List *l = servers; l; l = l->next)
+			set_now_playing (l->data, submission_ref (submission));
+
+		submission_unref (submission);
+	}
+}
+
+static void
+submit_to_profile (Submission *submission)
+{
+	StrBuf *line = strbuf_new ();
+	uint64_t hash = submission_hash (submission);
+
+	/* this is the only time the submission is encoded before it's
+	 * sent.
+	 */
+	submission_encode (line, submission, 0);
+
+	for (List *l = servers; l; l = l->next) {
+		Server *server = l->data;
+
+		if (!mark_queued (server, hash)) {
+			log_debug ("[%s] submission is queued already\n",
+			           server->name);
+			continue;
+		}
+
+		enqueue (server, submission_ref (submission), line);
+	}
+
+	strbuf_free (line);
+}
+
+/* the time that the xmms2 callbacks see. while a trace is replayed,
+ * it's the time at which the current event was recorded.
+ */
+static time_t
+clock_seconds ()
+{
+	return replayer ? replay_clock : time (NULL);
+}
+
+static void
+record_event (TraceEventType type, int32_t value, xmmsv_t *info)
+{
+	TraceEvent event;
+
+	if (!recorder)
+		return;
+
+	event.type = type;
+	event.time = timer_now () - recording_started;
+	event.value = value;
+	event.info = info;
+
+	if (!trace_write (recorder, &event)) {
+		log_error ("stopped recording\n");
+		trace_writer_free (recorder);
+		recorder = NULL;
+	}
+}
+
+static int
+on_medialib_get_info (xmmsv_t *val, void *udata)
+{
+	int32_t id = XPOINTER_TO_INT (udata);
+	xmmsv_t *dict;
+
+	record_event (TRACE_MEDIALIB_INFO, id, val);
+
+	/* the track might have changed again in the meantime */
+	if (id != current_id)
+		return 0;
+
+	log_debug ("resetting seconds_played\n");
+	last_unpause = started_playing = clock_seconds ();
+	seconds_played = 0;
+
+	dict = xmmsv_propdict_to_dict (val, NULL);
+
+	submit_now_playing (dict);
+
+	/* everything but the playing time is known now, so the profile
+	 * submission can be built right away. that way, the track's
+	 * info doesn't need to be requested again when it has been
+	 * played.
+	 */
+	if (current_track)
+		submission_unref (current_track);
+
+	current_track = profile_submission_new (dict, started_playing);
+
+	xmmsv_unref (dict);
+
+	return 0;
+}
+
+/* submits the current track if it has been played long enough. */
+static void
+maybe_submit_to_profile ()
+{
+	/* check whether we're interesting in this track at all */
+	if (!current_track)
+		return;
+
+	seconds_played += clock_seconds () - last_unpause;
+
+	if (!profile_submission_is_due (current_track, seconds_played)) {
+		log_debug ("seconds_played FAIL: %u\n", seconds_played);
+		return;
+	}
+
+	log_debug ("submitting: seconds_played %i\n", seconds_played);
+
+	submit_to_profile (current_track);
+
+	/* make sure it isn't submitted again */
+	submission_unref (current_track);
+	current_track = NULL;
+}
+
+static int
+on_playback_current_id (xmmsv_t *val, void *udata)
+{
+	xmmsc_result_t *mediainfo_result;
+	int32_t id = INVALID_MEDIA_ID;
+
+	maybe_submit_to_profile ();
+
+	if (current_track) {
+		submission_unref (current_track);
+		current_track = NULL;
+	}
+
+	/* get the new song's medialib id. */
+	xmmsv_get_int (val, &id);
+
+	record_event (TRACE_CURRENT_ID, id, NULL);
+
+	log_info ("now playing %u\n", id);
+
+	current_id = id;
+
+	/* a replayed trace has the reply already */
+	if (!conn)
+		return 1;
+
+	/* request information about this song. */
+	mediainfo_result = xmmsc_medialib_get_info (conn, id);
+	xmmsc_result_notifier_set (mediainfo_result,
+	                           on_medialib_get_info,
+	                           XINT_TO_POINTER (id));
+	xmmsc_result_unref (mediainfo_result);
+
+	return 1;
+}
+
+static int
+on_playback_status (xmmsv_t *val, void *udata)
+{
+	int s, status;
+
+	s = xmmsv_get_int (val, &status);
+	if (!s)
+		return 1;
+
+	record_event (TRACE_PLAYBACK_STATUS, status, NULL);
+
+	switch (status) {
+		case XMMS_PLAYBACK_STATUS_STOP:
+		case XMMS_PLAYBACK_STATUS_PAUSE:
+			maybe_submit_to_profile ();
+			break;
+		case XMMS_PLAYBACK_STATUS_PLAY:
+			last_unpause = clock_seconds ();
+			break;
+	}
+
+	return 1;
+}
+
+static int
+on_quit (xmmsv_t *val, void *udata)
+{
+	keep_running = false;
+
+	return 0;
+}
+
+static void
+on_disconnect (void *udata)
+{
+	keep_running = false;
+}
+
+static void
+replay_event (TraceEvent *event)
+{
+	xmmsv_t *val;
+
+	replay_clock = (replayer->started + event->time) / 1000;
+
+	switch (event->type) {
+		case TRACE_CURRENT_ID:
+			val = xmmsv_new_int (event->value);
+			on_playback_current_id (val, NULL);
+			xmmsv_unref (val);
+			break;
+		case TRACE_PLAYBACK_STATUS:
+			val = xmmsv_new_int (event->value);
+			on_playback_status (val, NULL);
+			xmmsv_unref (val);
+			break;
+		case TRACE_MEDIALIB_INFO:
+			on_medialib_get_info (event->info,
+			                      XINT_TO_POINTER (event->value));
+			xmmsv_unref (event->info);
+			break;
+	}
+
+	replayed++;
+}
+
+static void
+finish_replay ()
+{
+	struct timespec end;
+	double elapsed;
+
+	clock_gettime (CLOCK_MONOTONIC, &end);
+
+	elapsed = (end.tv_sec - replay_begin.tv_sec) +
+	          (end.tv_nsec - replay_begin.tv_nsec) / 1e9;
+
+	printf ("replayed %lu events in %.3f s, %.0f events/s\n",
+	        replayed, elapsed, elapsed > 0 ? replayed / elapsed : 0);
+	printf ("sending...\n");
+
+	trace_reader_free (replayer);
+	replayer = NULL;
+}
+
+/* feeds the events that are due to the callbacks. returns the number
+ * of milliseconds until the next one is due, or -1 once the trace is
+ * done.
+ */
+static int
+replay_step ()
+{
+	int64_t now = timer_now ();
+
+	if (replay_started == -1) {
+		replay_started = now;
+		clock_gettime (CLOCK_MONOTONIC, &replay_begin);
+	}
+
+	for (int i = 0; i < REPLAY_BATCH; i++) {
+		int64_t due;
+
+		if (!replay_pending)
+			replay_pending = trace_read (replayer, &replay_next);
+
+		if (!replay_pending) {
+			finish_replay ();
+			return -1;
+		}
+
+		due = replay_started + replay_next.time;
+
+		if (!replay_fast && due > now)
+			return due - now;
+
+		replay_pending = false;
+		replay_event (&replay_next);
+	}
+
+	/* let the main loop do its thing before going on */
+	return 0;
+}
+
+static void
+strchomp (char *s, size_t *length)
+{
+	size_t l = *length;
+
+	while (l > 0 && isspace (s[l - 1]))
+		s[--l] = 0;
+
+	*length = l;
+}
+
+static void
+for_each_line (FILE *fp,
+               void (*callback) (const char *line, void *user_data),
+               void *user_data)
+{
+	char buf[4096];
+
+	while (fgets (buf, sizeof (buf), fp)) {
+		size_t length = strlen (buf);
+
+		if (length < 2)
+			continue;
+
+		strchomp (buf, &length);
+
+		callback (buf, user_data);
+	}
+}
+
+static void
+handle_config_line (const char *line, void *user_data)
+{
+	if (!strncmp (line, "proxy: ", 7)) {
+		strncpy (proxy_host, &line[7], sizeof (proxy_host));
+		proxy_host[sizeof (proxy_host) - 1] = 0;
+	} else if (!strncmp (line, "proxy_port: ", 12)) {
+		proxy_port = atoi (&line[12]);
+	} else if (!strncmp (line, "proxy_userpwd: ", 15)) {
+        strncpy(proxy_userpwd, &line[15], sizeof (proxy_userpwd));
+        proxy_userpwd[sizeof (proxy_userpwd) - 1] = 0;
+	} else if (!strncmp (line, "journal_sync_interval: ", 23)) {
+		journal_sync_interval = atoi (&line[23]);
+	} else if (!strncmp (line, "request_timeout: ", 17)) {
+		request_timeout = atoi (&line[17]);
+	} else if (!strncmp (line, "log_size: ", 10)) {
+		log_size = atoi (&line[10]);
+	} else if (!strncmp (line, "log_files: ", 11)) {
+		log_files = atoi (&line[11]);
+	} else if (!strcmp (line, "engine: threads")) {
+		engine = ENGINE_THREADS;
+	} else if (!strcmp (line, "engine: multi")) {
+		engine = ENGINE_MULTI;
+	} else if (!strcmp (line, "engine: pool")) {
+		engine = ENGINE_POOL;
+	} else if (!strncmp (line, "workers: ", 9)) {
+		workers = atoi (&line[9]);
+	}
+}
+
+static void
+handle_server_config_line (const char *line, void *user_data)
+{
+	Server *server = user_data;
+
+	if (!strncmp (line, "handshake_url: ", 15)) {
+		strncpy (server->handshake_url, &line[15],
+		         sizeof (server->handshake_url));
+		server->handshake_url[sizeof (server->handshake_url) - 1] = 0;
+	} else if (!strncmp (line, "user: ", 6)) {
+		strncpy (server->user, &line[6], sizeof (server->user));
+		server->user[sizeof (server->user) - 1] = 0;
+	} else if (!strncmp (line, "password: ", 10)) {
+		/* we only ever need the hashed password :) */
+		md5 (&line[10], server->hashed_password);
+	} else if (!strncmp (line, "batch_size: ", 12)) {
+		server->batch_size = atoi (&line[12]);
+	} else if (!strncmp (line, "batch_window: ", 14)) {
+		server->batch_window = atoi (&line[14]);
+	} else if (!strncmp (line, "max_age: ", 9)) {
+		server->max_age = atoi (&line[9]);
+	} else if (!strncmp (line, "queue_memory: ", 14)) {
+		server->memory_limit = atoi (&line[14]) * 1024;
+	}
+}
+
+typedef struct {
+	time_t created;
+	char user[64], handshake_url[256];
+	char session_id[256], np_url[256], subm_url[256];
+} SavedSession;
+
+static void
+copy_value (char *dest, const char *value, size_t size)
+{
+	strncpy (dest, value, size);
+	dest[size - 1] = 0;
+}
+
+static void
+handle_session_line (const char *line, void *user_data)
+{
+	SavedSession *s = user_data;
+
+	if (!strncmp (line, "created: ", 9))
+		s->created = atol (&line[9]);
+	else if (!strncmp (line, "user: ", 6))
+		copy_value (s->user, &line[6], sizeof (s->user));
+	else if (!strncmp (line, "handshake_url: ", 15))
+		copy_value (s->handshake_url, &line[15],
+		            sizeof (s->handshake_url));
+	else if (!strncmp (line, "session_id: ", 12))
+		copy_value (s->session_id, &line[12], sizeof (s->session_id));
+	else if (!strncmp (line, "np_url: ", 8))
+		copy_value (s->np_url, &line[8], sizeof (s->np_url));
+	else if (!strncmp (line, "subm_url: ", 10))
+		copy_value (s->subm_url, &line[10], sizeof (s->subm_url));
+}
+
+/* picks up the session that was saved by save_session(), so that the
+ * first request after a restart doesn't need to wait for a handshake.
+ * if the session turns out to be invalid, the server answers with
+ * BADSESSION and a new handshake is done.
+ */
+static void
+load_session (Server *server)
+{
+	SavedSession s;
+	FILE *fp;
+	long age;
+
+	fp = fopen (server->session_file, "r");
+
+	if (!fp)
+		return;
+
+	memset (&s, 0, sizeof (s));
+	for_each_line (fp, handle_session_line, &s);
+	fclose (fp);
+
+	age = time (NULL) - s.created;
+
+	/* the account or server might have been changed since */
+	if (strcmp (s.user, server->user) ||
+	    strcmp (s.handshake_url, server->handshake_url) ||
+	    !s.session_id[0] || !s.np_url[0] || !s.subm_url[0] ||
+	    age < 0 || age > SESSION_MAX_AGE) {
+		forget_session (server);
+		return;
+	}
+
+	strcpy (server->session_id, s.session_id);
+	strcpy (server->np_url, s.np_url);
+	strcpy (server->subm_url, s.subm_url);
+
+	server->need_handshake = false;
+
+	log_info ("[%s] reusing the session from %li seconds ago\n",
+	          server->name, age);
+}
+
+/* profile submissions that are older than the returned time aren't
+ * sent to the server anymore.
+ */
+static time_t
+oldest_timestamp (Server *server)
+{
+	if (server->max_age <= 0)
+		return 0;
+
+	return time (NULL) - (time_t) server->max_age * 24 * 60 * 60;
+}
+
+typedef struct {
+	Submission *submission;
+	int index;
+} QueueItem;
+
+/* sort by timestamp, keeping the queue order of equal timestamps */
+static int
+compare_queue_items (const void *a, const void *b)
+{
+	const QueueItem *x = a, *y = b;
+
+	if (x->submission->timestamp != y->submission->timestamp)
+		return x->submission->timestamp < y->submission->timestamp
+		       ? -1 : 1;
+
+	return x->index - y->index;
+}
+
+/* the state of a server's queue while it's read from disk */
+typedef struct {
+	Server *server;
+	time_t oldest, latest;
+	int duplicates, expired;
+	bool sorted;
+} QueueLoader;
+
+/* queues a submission that was read from disk, unless it's a duplicate
+ * or has expired. returns false if the submission was dropped.
+ */
+static bool
+load_submission (QueueLoader *loader, Submission *submission)
+{
+	Server *server = loader->server;
+
+	if (submission->timestamp < loader->oldest) {
+		loader->expired++;
+	} else if (!dedup_set_add (server->queued,
+	                           submission_hash (submission))) {
+		loader->duplicates++;
+	} else {
+		if (submission->timestamp < loader->latest)
+			loader->sorted = false;
+		else
+			loader->latest = submission->timestamp;
+
+		server->pending++;
+		update_queue_stats (server, 1, submission_size (submission));
+		keep_submission (server, submission);
+
+		return true;
+	}
+
+	submission_unref (submission);
+
+	return false;
+}
+
+/* sorts the queue by timestamp and rewrites the journal to match.
+ * unlike loading, this needs all submissions in memory at once, but
+ * it's only necessary if older submissions were queued after newer
+ * ones.
+ */
+static void
+sort_queue (Server *server)
+{
+	int count = 0, spilled = server->spill->count;
+	QueueItem *items;
+	Submission *s;
+	StrBuf *lines;
+	const char *line;
+	int length;
+
+	items = malloc ((queue_length (&server->submissions) + spilled) *
+	                sizeof (QueueItem));
+
+	while ((s = queue_pop (&server->submissions))) {
+		items[count].submission = s;
+		items[count].index = count;
+		count++;
+	}
+
+	while ((line = spill_read (server->spill, &length))) {
+		s = submission_parse (NULL, line, length);
+
+		/* the journal is rewritten without it */
+		if (!s) {
+			drop_unreadable (server);
+			continue;
+		}
+
+		items[count].submission = s;
+		items[count].index = count;
+		count++;
+	}
+
+	update_spill_stats (server, -spilled);
+
+	qsort (items, count, sizeof (QueueItem), compare_queue_items);
+
+	lines = strbuf_new ();
+
+	for (int i = 0; i < count; i++) {
+		submission_encode (lines, items[i].submission, 0);
+		strbuf_append (lines, "\n");
+	}
+
+	journal_replace (server->journal, lines->buf, lines->length);
+	strbuf_free (lines);
+
+	server->resident_bytes = 0;
+
+	for (int i = 0; i < count; i++)
+		keep_submission (server, items[i].submission);
+
+	free (items);
+}
+
+/* reports what was dropped while the queue was loaded */
+static void
+finish_loading (QueueLoader *loader)
+{
+	Server *server = loader->server;
+
+	if (loader->duplicates || loader->expired || !loader->sorted)
+		log_warning ("[%s] dropped %i duplicate and %i expired "
+		             "submissions%s\n", server->name, loader->duplicates,
+		             loader->expired, loader->sorted ? "" :
+		             ", sorting the others by timestamp");
+
+	if (!loader->sorted)
+		sort_queue (server);
+}
+
+/* reads the generic config file. on reload, the settings that are
+ * only used on startup keep their values.
+ */
+static void
+read_global_config (bool reload)
+{
+	FILE *fp;
+	Engine old_engine = engine;
+	int old_workers = workers;
+	int old_sync_interval = journal_sync_interval;
+	char filename[PATH_MAX];
+
+	snprintf (filename, sizeof (filename), "%s/config", config_dir);
+
+	pthread_mutex_lock (&config_mutex);
+
+	proxy_host[0] = proxy_userpwd[0] = 0;
+	proxy_port = 0;
+	request_timeout = DEFAULT_REQUEST_TIMEOUT;
+	journal_sync_interval = DEFAULT_JOURNAL_SYNC_INTERVAL;
+	log_size = DEFAULT_LOG_SIZE;
+	log_files = DEFAULT_LOG_FILES;
+	engine = ENGINE_THREADS;
+	workers = 0;
+
+	fp = fopen (filename, "r");
+
+	if (fp) {
+		for_each_line (fp, handle_config_line, NULL);
+		fclose (fp);
+	}
+
+	if (reload && (engine != old_engine || workers != old_workers ||
+	               journal_sync_interval != old_sync_interval)) {
+		log_warning ("engine, workers and journal_sync_interval only "
+		             "change on restart\n");
+
+		engine = old_engine;
+		workers = old_workers;
+		journal_sync_interval = old_sync_interval;
+	}
+
+	pthread_mutex_unlock (&config_mutex);
+
+	log_set_rotation ((long) log_size * 1024, log_files);
+}
+
+/* the server is reloaded if this changes. 'digest' is left empty if
+ * the file cannot be read.
+ */
+static void
+digest_config (const char *filename, char digest[33])
+{
+	FILE *fp;
+	char buf[8192];
+	size_t length;
+
+	digest[0] = 0;
+
+	fp = fopen (filename, "r");
+
+	if (!fp)
+		return;
+
+	length = fread (buf, 1, sizeof (buf) - 1, fp);
+	buf[length] = 0;
+
+	fclose (fp);
+
+	md5 (buf, digest);
+}
+
+/* set if a server was skipped because another instance has it */
+static bool servers_in_use;
+
+/* two instances that use the same journal would send its entries twice
+ * and ack each other's records away, so the first one to come along
+ * gets the server.
+ */
+static bool
+lock_server (Server *server)
+{
+	char dirname[PATH_MAX];
+
+	snprintf (dirname, sizeof (dirname), "%s/%s",
+	          config_dir, server->name);
+
+	server->lock_fd = open (dirname, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+	if (server->lock_fd > -1 &&
+	    !flock (server->lock_fd, LOCK_EX | LOCK_NB))
+		return true;
+
+	if (errno == EWOULDBLOCK) {
+		log_error ("[%s] in use by another xmms2-scrobbler\n",
+		           server->name);
+		servers_in_use = true;
+	} else {
+		log_error ("cannot lock '%s': %s\n", dirname, strerror (errno));
+	}
+
+	return false;
+}
+
+/* returns NULL if 'name' isn't a server's directory, if its config
+ * is broken or if another instance uses it.
+ */
+static Server *
+load_server (const char *name)
+{
+	FILE *fp;
+	Server *server;
+	QueueLoader loader;
+	struct stat st;
+	char filename[PATH_MAX];
+	int e;
+
+	if (name[0] == '.')
+		return NULL;
+
+	snprintf (filename, sizeof (filename), "%s/%s", config_dir, name);
+
+	e = stat (filename, &st);
+
+	if (e || !S_ISDIR (st.st_mode))
+		return NULL;
+
+	/* watched even if the config is broken, so that fixing it
+	 * brings the server in.
+	 */
+	if (config_watch)
+		config_watch_add_server (config_watch, filename);
+
+	snprintf (filename, sizeof (filename), "%s/%s/config",
+	          config_dir, name);
+
+	server = server_new (name);
+
+	if (!server)
+		return NULL;
+
+	fp = fopen (filename, "r");
+
+	if (!fp) {
+		log_error ("cannot open config file: '%s'\n",
+		           filename);
+		server_free (server);
+		return NULL;
+	}
+
+	for_each_line (fp, handle_server_config_line, server);
+
+	fclose (fp);
+
+	if (!server_check_config (server)) {
+		log_warning ("ignoring %s\n", server->name);
+		server_free (server);
+		return NULL;
+	}
+
+	if (!lock_server (server)) {
+		server_free (server);
+		return NULL;
+	}
+
+	digest_config (filename, server->config_digest);
+
+	log_info ("registering %s\n", server->name);
+
+	snprintf (server->session_file, sizeof (server->session_file),
+	          "%s/%s/session", config_dir, name);
+
+	load_session (server);
+
+	server->stats = stats_add_server (server->name);
+
+	if (!server->stats && !drain_only)
+		log_warning ("[%s] not publishing stats\n",
+		             server->name);
+
+	snprintf (filename, sizeof (filename), "%s/%s/spill",
+	          config_dir, name);
+
+	server->spill = spill_new (filename);
+
+	snprintf (filename, sizeof (filename), "%s/%s/journal",
+	          config_dir, name);
+
+	loader.server = server;
+	loader.oldest = oldest_timestamp (server);
+	loader.latest = 0;
+	loader.duplicates = loader.expired = 0;
+	loader.sorted = true;
+
+	server->journal = journal_open (filename, handle_journal_entry,
+	                                &loader);
+
+	/* older versions saved the queue to a plain file on
+	 * shutdown. move its contents to the journal.
+	 */
+	snprintf (filename, sizeof (filename), "%s/%s/queue",
+	          config_dir, name);
+
+	fp = fopen (filename, "r");
+
+	if (fp) {
+		for_each_line (fp, handle_legacy_queue_line, &loader);
+		fclose (fp);
+
+		/* keep the old queue until its entries are journaled */
+		if (journal_flush (server->journal, true))
+			unlink (filename);
+	}
+
+	finish_loading (&loader);
+
+	return server;
+}
+
+static bool
+load_config ()
+{
+	DIR *dp;
+	struct dirent *dirent;
+	char buf[XMMS_PATH_MAX];
+
+	if (!xmmsc_userconfdir_get (buf, sizeof (buf))) {
+		log_error ("cannot get userconfdir\n");
+		return false;
+	}
+
+	snprintf (config_dir, sizeof (config_dir),
+	          "%s/clients/xmms2-scrobbler",
+	          buf);
+
+	read_global_config (false);
+
+	journal_init (journal_sync_interval);
+
+	dp = opendir (config_dir);
+
+	if (!dp) {
+		log_error ("cannot open config directory '%s'\n",
+		           config_dir);
+
+		return false;
+	}
+
+	/* --drain and --import exit soon, so they don't reload */
+	if (!drain_only) {
+		config_watch = config_watch_new (config_dir);
+
+		if (!config_watch)
+			log_warning ("cannot watch '%s', config changes "
+			             "need a restart\n", config_dir);
+	}
+
+	while ((dirent = readdir (dp))) {
+		Server *server = load_server (dirent->d_name);
+
+		if (server)
+			servers = list_prepend (servers, server);
+	}
+
+	closedir (dp);
+
+	return true;
+}
+
+static bool
+handle_journal_entry (Mapping *mapping, const char *line, int length,
+                      void *user_data)
+{
+	QueueLoader *loader = user_data;
+	Submission *submission;
+
+	/* submissions that point into the mapping keep their part of it
+	 * in memory, and the ones that are allocated from it live as long
+	 * as the mapping. only the head of the journal fits into the
+	 * queue, so the entries past that get copies, which are freed
+	 * when they're spilled.
+	 */
+	if (line + length - mapping->data > loader->server->memory_limit)
+		mapping = NULL;
+
+	submission = submission_parse (mapping, line, length);
+
+	if (!submission) {
+		log_warning ("[%s] dropping invalid journal entry '%.*s'\n",
+		             loader->server->name, length, line);
+		return false;
+	}
+
+	return load_submission (loader, submission);
+}
+
+static void
+handle_legacy_queue_line (const char *line, void *user_data)
+{
+	QueueLoader *loader = user_data;
+	Submission *submission;
+	int length = strlen (line);
+
+	submission = submission_parse (NULL, line, length);
+
+	if (!submission) {
+		log_warning ("[%s] dropping invalid queue entry '%s'\n",
+		             loader->server->name, line);
+		return;
+	}
+
+	if (load_submission (loader, submission))
+		journal_append (loader->server->journal, line, length);
+}
+
+
+/* the profile submissions are in the journal already, so all that's
+ * left to do is to compact and close it.
+ */
+static void
+save_profile_submissions_queue (Server *server)
+{
+	receive_submissions (server);
+
+	while (true) {
+		Submission *s;
+
+		s = queue_pop (&server->submissions);
+		if (!s)
+			break;
+
+		submission_unref (s);
+	}
+
+	journal_close (server->journal);
+	server->journal = NULL;
+}
+
+/* true if all queued submissions have been sent */
+static bool
+all_drained ()
+{
+	for (List *l = servers; l; l = l->next) {
+		Server *server = l->data;
+
+		if (__atomic_load_n (&server->pending, __ATOMIC_ACQUIRE))
+			return false;
+	}
+
+	return true;
+}
+
+static void
+start_server (Server *server)
+{
+	if (engine == ENGINE_MULTI)
+		multi_start_server (server);
+	else if (engine == ENGINE_POOL)
+		/* there might be queued submissions already */
+		pool_schedule (pool, &server->task);
+	else
+		pthread_create (&server->thread, NULL, curl_thread, server);
+}
+
+/* writes back the queue of a server whose thread or transfers are
+ * gone, and frees it.
+ */
+static void
+finish_server (Server *server)
+{
+	/* the slot is taken over if the server comes back */
+	if (server->stats) {
+		stats_begin (server->stats);
+		server->stats->queue_depth = 0;
+		server->stats->queued_bytes = 0;
+		server->stats->spilled = 0;
+		server->stats->hard_failures = 0;
+		stats_end (server->stats);
+	}
 
-	*length = l;
+	save_profile_submissions_queue (server);
+	server_free (server);
 }
 
+/* takes a server out of service. its queue stays in the journal, so
+ * nothing is lost if it comes back.
+ * a curl thread or pool worker might be in the middle of a transfer,
+ * that's aborted and the server is finished by reap_servers() once the
+ * thread or task is done.
+ */
 static void
-for_each_line (FILE *fp,
-               void (*callback) (const char *line, void *user_data),
-               void *user_data)
+stop_server (Server *server)
 {
-	char buf[4096];
+	List **link;
 
-	while (fgets (buf, sizeof (buf), fp)) {
-		size_t length = strlen (buf);
+	for (link = &servers; *link; link = &(*link)->next) {
+		if ((*link)->data == server) {
+			*link = list_remove_head (*link);
+			break;
+		}
+	}
 
-		if (length < 2)
-			continue;
+	log_info ("unregistering %s\n", server->name);
 
-		strchomp (buf, &length);
+	if (engine == ENGINE_MULTI) {
+		multi_stop_server (server);
+		finish_server (server);
+		return;
+	}
 
-		callback (buf, user_data);
+	__atomic_store_n (&server->removed, true, __ATOMIC_RELEASE);
+
+	if (engine == ENGINE_POOL) {
+		pool_stop_server (server);
+	} else {
+		__atomic_store_n (&server->shutdown_thread, true,
+		                  __ATOMIC_RELEASE);
+		ring_wake (server->incoming);
 	}
+
+	retired = list_prepend (retired, server);
 }
 
+static void reload_config ();
+
 static void
-handle_config_line (const char *line, void *user_data)
+reap_servers ()
 {
-	if (!strncmp (line, "proxy: ", 7)) {
-		strncpy (proxy_host, &line[7], sizeof (proxy_host));
-		proxy_host[sizeof (proxy_host) - 1] = 0;
-	} else if (!strncmp (line, "proxy_port: ", 12)) {
-		proxy_port = atoi (&line[12]);
-	} else if (!strncmp (line, "proxy_userpwd: ", 15)) {
-        strncpy(proxy_userpwd, &line[15], sizeof (proxy_userpwd));
-        proxy_userpwd[sizeof (proxy_userpwd) - 1] = 0;
+	List **link = &retired;
+
+	while (*link) {
+		Server *server = (*link)->data;
+
+		if (!__atomic_load_n (&server->thread_done, __ATOMIC_ACQUIRE) ||
+		    (engine == ENGINE_POOL &&
+		     !pool_task_is_idle (&server->task))) {
+			link = &(*link)->next;
+			continue;
+		}
+
+		if (engine != ENGINE_POOL)
+			pthread_join (server->thread, NULL);
+
+		finish_server (server);
+
+		*link = list_remove_head (*link);
+	}
+
+	/* a server that was changed can only come back once its old
+	 * thread has closed the journal.
+	 */
+	if (reload_deferred && !retired) {
+		reload_deferred = false;
+		reload_config ();
 	}
 }
 
-static void
-handle_server_config_line (const char *line, void *user_data)
+static Server *
+find_server (List *list, const char *name)
 {
-	Server *server = user_data;
+	for (List *l = list; l; l = l->next) {
+		Server *server = l->data;
 
-	if (!strncmp (line, "handshake_url: ", 15)) {
-		strncpy (server->handshake_url, &line[15],
-		         sizeof (server->handshake_url));
-		server->handshake_url[sizeof (server->handshake_url) - 1] = 0;
-	} else if (!strncmp (line, "user: ", 6)) {
-		strncpy (server->user, &line[6], sizeof (server->user));
-		server->user[sizeof (server->user) - 1] = 0;
-	} else if (!strncmp (line, "password: ", 10)) {
-		/* we only ever need the hashed password :) */
-		md5 (&line[10], server->hashed_password);
+		if (!strcmp (server->name, name))
+			return server;
 	}
+
+	return NULL;
 }
 
-static bool
-load_config ()
+/* brings the servers in line with the config directory. servers whose
+ * config didn't change are left alone, so they keep their sessions
+ * and connections.
+ */
+static void
+reload_config ()
 {
-	FILE *fp;
 	DIR *dp;
 	struct dirent *dirent;
-	const char *dir;
-	char buf[XMMS_PATH_MAX], config_dir[PATH_MAX], filename[PATH_MAX];
+	List *names = NULL;
+	List **link;
+	char filename[PATH_MAX];
 
-	dir = xmmsc_userconfdir_get (buf, sizeof (buf));
+	log_info ("reloading the config\n");
 
-	if (!dir) {
-		fprintf (stderr, "cannot get userconfdir\n");
-		return false;
-	}
+	read_global_config (true);
 
-	snprintf (config_dir, sizeof (config_dir),
-	          "%s/clients/xmms2-scrobbler",
-	          buf);
+	dp = opendir (config_dir);
 
-	snprintf (filename, sizeof (filename), "%s/config", config_dir);
+	if (!dp) {
+		log_error ("cannot open config directory '%s'\n",
+		           config_dir);
+		return;
+	}
 
-	fp = fopen (filename, "r");
+	while ((dirent = readdir (dp))) {
+		if (dirent->d_name[0] == '.')
+			continue;
 
-	if (fp) {
-		for_each_line (fp, handle_config_line, NULL);
-		fclose (fp);
+		names = list_prepend (names, strdup (dirent->d_name));
 	}
 
-	dp = opendir (config_dir);
+	closedir (dp);
 
-	if (!dp) {
-		fprintf (stderr, "cannot open config directory '%s'\n",
-		         config_dir);
+	/* stop the servers that are gone or changed */
+	link = &servers;
 
-		return false;
-	}
+	while (*link) {
+		Server *server = (*link)->data;
+		char digest[33];
+		bool found = false;
 
-	while ((dirent = readdir (dp))) {
-		Server *server;
-		struct stat st;
-		int e;
+		for (List *l = names; l; l = l->next)
+			if (!strcmp (l->data, server->name))
+				found = true;
 
-		if (dirent->d_name[0] == '.')
+		snprintf (filename, sizeof (filename), "%s/%s/config",
+		          config_dir, server->name);
+
+		digest_config (filename, digest);
+
+		if (found && !strcmp (digest, server->config_digest)) {
+			link = &(*link)->next;
 			continue;
+		}
+
+		/* removes the server from the list */
+		stop_server (server);
+	}
 
-		snprintf (filename, sizeof (filename), "%s/%s",
-		          config_dir, dirent->d_name);
+	/* and start the new ones */
+	while (names) {
+		char *name = names->data;
+		Server *server;
 
-		e = stat (filename, &st);
+		names = list_remove_head (names);
 
-		if (e || !S_ISDIR (st.st_mode))
+		if (find_server (servers, name)) {
+			free (name);
 			continue;
+		}
 
-		snprintf (filename, sizeof (filename), "%s/%s/config",
-		          config_dir, dirent->d_name);
+		if (find_server (retired, name)) {
+			reload_deferred = true;
+			free (name);
+			continue;
+		}
 
-		server = server_new (dirent->d_name);
+		server = load_server (name);
+		free (name);
 
 		if (!server)
 			continue;
 
-		fp = fopen (filename, "r");
+		servers = list_prepend (servers, server);
+		start_server (server);
+	}
+}
+
+/* with --drain, there's no xmms2 connection and the loop ends once all
+ * queues are empty.
+ */
+static void
+main_loop ()
+{
+	struct pollfd *fds = NULL;
+	int allocated = 0;
+
+	while (keep_running) {
+		int count = 2, timeout = -1;
+		int64_t now;
 
-		if (!fp) {
-			fprintf (stderr, "cannot open config file: '%s'\n",
-			         filename);
-			server_free (server);
-			continue;
+		/* the first entry is the xmms2 connection, the second one
+		 * the config watch and the rest are the sockets of the
+		 * curl_multi engine, if it's used.
+		 */
+		if (engine == ENGINE_MULTI) {
+			count += multi_fds_count;
+			timeout = multi_get_timeout ();
 		}
 
-		for_each_line (fp, handle_server_config_line, server);
+		now = timer_now ();
 
-		fclose (fp);
+		if (reload_at != -1) {
+			int until = (reload_at > now) ? reload_at - now : 0;
 
-		if (!server_check_config (server)) {
-			fprintf (stderr, "ignoring %s\n", server->name);
-			server_free (server);
-			continue;
+			if (timeout < 0 || timeout > until)
+				timeout = until;
 		}
 
-		fprintf (stderr, "registering %s\n", server->name);
-		servers = list_prepend (servers, server);
+		if (retired && (timeout < 0 || timeout > RETIRE_CHECK_INTERVAL))
+			timeout = RETIRE_CHECK_INTERVAL;
+
+		if (replayer) {
+			int until = replay_step ();
+
+			if (until >= 0 && (timeout < 0 || timeout > until))
+				timeout = until;
+		}
+
+		if (drain_only) {
+			if (!replayer && all_drained ())
+				break;
+
+			if (timeout < 0 || timeout > DRAIN_CHECK_INTERVAL)
+				timeout = DRAIN_CHECK_INTERVAL;
+		}
+
+		if (count > allocated) {
+			allocated = count;
+			fds = realloc (fds, allocated * sizeof (struct pollfd));
+		}
+
+		/* poll() skips negative fds */
+		fds[0].fd = conn ? xmmsc_io_fd_get (conn) : -1;
+		fds[0].events = POLLIN | POLLHUP | POLLERR;
+		fds[0].revents = 0;
+
+		if (conn && xmmsc_io_want_out (conn))
+			fds[0].events |= POLLOUT;
+
+		fds[1].fd = config_watch ? config_watch->fd : -1;
+		fds[1].events = POLLIN;
+		fds[1].revents = 0;
 
-		snprintf (filename, sizeof (filename), "%s/%s/queue",
-		          config_dir, dirent->d_name);
+		for (int i = 2; i < count; i++) {
+			fds[i] = multi_fds[i - 2];
+			fds[i].revents = 0;
+		}
 
-		fp = fopen (filename, "r");
+		int e = poll (fds, count, timeout);
 
-		if (!fp)
-			fprintf (stderr,
-			         "warning: cannot open queue '%s' for reading\n",
-			         filename);
+		if (!conn)
+			;
+		else if (e == -1)
+			xmmsc_io_disconnect (conn);
+		else if ((fds[0].revents & POLLERR) == POLLERR)
+			xmmsc_io_disconnect (conn);
+		else if ((fds[0].revents & POLLHUP) == POLLHUP)
+			xmmsc_io_disconnect (conn);
 		else {
-			for_each_line (fp, handle_queue_line, server);
+			if ((fds[0].revents & POLLOUT) == POLLOUT)
+				xmmsc_io_out_handle (conn);
 
-			fclose (fp);
+			if ((fds[0].revents & POLLIN) == POLLIN)
+				xmmsc_io_in_handle (conn);
 		}
-	}
 
-	closedir (dp);
+		if (engine == ENGINE_MULTI && keep_running)
+			multi_handle_events (&fds[2], count - 2);
 
-	return true;
-}
+		/* wait for the changes to settle before reloading */
+		if (e > 0 && (fds[1].revents & POLLIN) &&
+		    config_watch_read (config_watch))
+			reload_at = timer_now () + RELOAD_DELAY;
 
-static void
-handle_queue_line (const char *line, void *user_data)
-{
-	Server *server = user_data;
-	StrBuf *sb;
+		if (reload_at != -1 && reload_at <= timer_now () &&
+		    keep_running) {
+			reload_at = -1;
+			reload_config ();
+		}
 
-	sb = strbuf_new ();
-	strbuf_append (sb, line);
+		reap_servers ();
+	}
 
-	queue_push (&server->submissions,
-	            submission_new (sb, SUBMISSION_TYPE_PROFILE));
+	free (fds);
 }
 
+typedef struct {
+	ImportStats stats;
+
+	/* entries that no server took, because they were queued already
+	 * or because they were too old for all of them.
+	 */
+	unsigned long duplicates, expired;
+	int64_t started, reported;
+} ImportProgress;
+
 static void
-save_profile_submissions_queue (Server *server)
+on_import_entry (Submission *submission, uint64_t hash, const char *line,
+                 int length, void *user_data)
 {
-	FILE *fp;
-	const char *dir;
-	char buf[XMMS_PATH_MAX];
-	char filename[PATH_MAX];
+	ImportProgress *progress = user_data;
+	bool queued = false, fresh = false;
 
-	dir = xmmsc_userconfdir_get (buf, sizeof (buf));
+	for (List *l = servers; l; l = l->next) {
+		Server *server = l->data;
 
-	if (!dir) {
-		fprintf (stderr, "cannot get userconfdir\n");
-		return;
-	}
+		if (submission->timestamp < oldest_timestamp (server))
+			continue;
 
-	snprintf (filename, sizeof (filename),
-	          "%s/clients/xmms2-scrobbler/%s/queue",
-	          buf, server->name);
+		fresh = true;
 
-	fp = fopen (filename, "w");
+		if (!mark_queued (server, hash))
+			continue;
 
-	if (!fp) {
-		fprintf (stderr, "cannot open queue '%s' for writing\n", filename);
-		return;
+		queue_submission (server, submission_ref (submission),
+		                  line, length);
+		queued = true;
 	}
 
-	while (true) {
-		Submission *s;
+	if (!fresh)
+		progress->expired++;
+	else if (!queued)
+		progress->duplicates++;
+}
 
-		s = queue_pop (&server->submissions);
-		if (!s)
-			break;
+static void
+print_import_progress (ImportProgress *progress, const char *what)
+{
+	int64_t elapsed = timer_now () - progress->started;
+
+	printf ("%s %lu entries: %lu new, %lu duplicates, %lu expired,"
+	        " %lu invalid (%.0f entries/s)\n",
+	        what, progress->stats.lines,
+	        progress->stats.entries - progress->duplicates -
+	        progress->expired,
+	        progress->duplicates, progress->expired,
+	        progress->stats.invalid,
+	        progress->stats.lines * 1000.0 / (elapsed ? elapsed : 1));
+	fflush (stdout);
+
+	progress->reported = timer_now ();
+}
+
+static void
+on_import_chunk (ImportStats *stats, void *user_data)
+{
+	ImportProgress *progress = user_data;
+
+	progress->stats = *stats;
+
+	/* let the servers start sending what has been read so far */
+	for (List *l = servers; l; l = l->next) {
+		Server *server = l->data;
 
-		if (s->type == SUBMISSION_TYPE_PROFILE)
-			fprintf (fp, "%s\n", s->sb->buf);
+		journal_commit (server->journal);
 
-		submission_free (s);
+		if (engine == ENGINE_MULTI)
+			multi_step (server);
+		else if (engine == ENGINE_POOL)
+			pool_schedule (pool, &server->task);
 	}
 
-	fclose (fp);
+	if (timer_now () - progress->reported >= 1000)
+		print_import_progress (progress, "read");
 }
 
 static void
-main_loop ()
+import ()
 {
-	struct pollfd fds;
+	ImportProgress progress;
+	long workers = sysconf (_SC_NPROCESSORS_ONLN);
 
-	fds.fd = xmmsc_io_fd_get (conn);
+	if (workers < 1)
+		workers = 1;
+	else if (workers > IMPORT_MAX_WORKERS)
+		workers = IMPORT_MAX_WORKERS;
 
-	while (keep_running) {
-		fds.events = POLLIN | POLLHUP | POLLERR;
-		fds.revents = 0;
-
-		if (xmmsc_io_want_out (conn))
-			fds.events |= POLLOUT;
+	memset (&progress, 0, sizeof (progress));
+	progress.started = progress.reported = timer_now ();
 
-		int e = poll (&fds, 1, -1);
+	import_run (import_mapping->data, import_mapping->length, workers,
+	            on_import_entry, on_import_chunk, &progress,
+	            &progress.stats);
 
-		if (e == -1)
-			xmmsc_io_disconnect (conn);
-		else if ((fds.revents & POLLERR) == POLLERR)
-			xmmsc_io_disconnect (conn);
-		else if ((fds.revents & POLLHUP) == POLLHUP)
-			xmmsc_io_disconnect (conn);
-		else {
-			if ((fds.revents & POLLOUT) == POLLOUT)
-				xmmsc_io_out_handle (conn);
+	print_import_progress (&progress, "done, read");
+	printf ("sending...\n");
 
-			if ((fds.revents & POLLIN) == POLLIN)
-				xmmsc_io_in_handle (conn);
-		}
-	}
+	mapping_unref (import_mapping);
+	import_mapping = NULL;
 }
 
 static void
 start_logging ()
 {
-	int fd;
 	const char *dir;
 	char buf[XMMS_PATH_MAX];
 
 	dir = xmmsc_userconfdir_get (buf, sizeof (buf));
 
 	if (!dir) {
-		fprintf (stderr, "cannot get userconfdir\n");
+		log_error ("cannot get userconfdir\n");
 		return;
 	}
 
 	chdir (dir);
 
-	fd = creat ("clients/xmms2-scrobbler/logfile.log", 0640);
+	/* stderr is redirected to the log file, which is kept across
+	 * restarts and rotated by size.
+	 */
+	log_set_rotation (DEFAULT_LOG_SIZE * 1024, DEFAULT_LOG_FILES);
+
+	if (!log_start ("clients/xmms2-scrobbler/logfile.log"))
+		log_error ("cannot open the log file\n");
 
-	if (fd > -1) {
-		/* redirect stderr to the log file. */
-		dup2 (fd, 2);
-	}
+	/* messages that are still buffered are written on exit */
+	atexit (log_stop);
+}
+
+static void
+usage (const char *argv0)
+{
+	fprintf (stderr, "usage: %s [--drain | --import FILE | "
+	         "--replay FILE [--fast]] [--record FILE]\n", argv0);
 }
 
 int
@@ -953,85 +3144,192 @@ main (int argc, char **argv)
 	xmmsc_result_t *quit_broadcast;
 	int s;
 
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp (argv[i], "--drain")) {
+			drain_only = true;
+		} else if (!strcmp (argv[i], "--import") && i + 1 < argc &&
+		           !import_mapping) {
+			/* the file must be opened before start_logging()
+			 * changes the working directory.
+			 */
+			import_mapping = mapping_open (argv[++i]);
+
+			if (!import_mapping) {
+				fprintf (stderr, "cannot read %s\n", argv[i]);
+				return EXIT_FAILURE;
+			}
+
+			/* exit once everything has been sent */
+			drain_only = true;
+		} else if (!strcmp (argv[i], "--replay") && i + 1 < argc &&
+		           !replayer) {
+			replayer = trace_reader_new (argv[++i]);
+
+			if (!replayer) {
+				fprintf (stderr, "cannot read %s\n", argv[i]);
+				return EXIT_FAILURE;
+			}
+
+			/* the events come from the trace, not from xmms2d */
+			drain_only = true;
+		} else if (!strcmp (argv[i], "--fast")) {
+			replay_fast = true;
+		} else if (!strcmp (argv[i], "--record") && i + 1 < argc &&
+		           !recorder) {
+			recorder = trace_writer_new (argv[++i],
+			                             (int64_t) time (NULL) * 1000);
+			recording_started = timer_now ();
+
+			if (!recorder) {
+				fprintf (stderr, "cannot write %s\n", argv[i]);
+				return EXIT_FAILURE;
+			}
+		} else {
+			usage (argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	/* only the daemon gets events to record */
+	if ((recorder && drain_only) || (replay_fast && !replayer)) {
+		usage (argv[0]);
+		return EXIT_FAILURE;
+	}
+
 	sig.sa_handler = &signal_handler;
 	sigaction (SIGINT, &sig, 0);
 
 	start_logging ();
 
+	/* --drain and --import don't publish stats. they won't run while
+	 * the daemon has the servers (see lock_server()), but they'd get
+	 * to its segment before finding out.
+	 * the segment is removed on exit, including the early ones below.
+	 */
+	if (drain_only)
+		;
+	else if (stats_open ())
+		atexit (stats_close);
+	else
+		log_error ("cannot create stats segment\n");
+
 	if (!load_config ())
 		return EXIT_FAILURE;
 
-	if (!servers) {
-		fprintf (stderr,
-		         "*** No subdirectories found in "
-		              ".../clients/xmms2-scrobbler\n"
-		         "*** See README for how to configure XMMS2-Scrobbler.\n");
+	if (drain_only && servers_in_use) {
+		log_error ("*** XMMS2-Scrobbler is running already, stop it "
+		           "before using --drain or --import.\n");
 
 		return EXIT_FAILURE;
 	}
 
-	conn = xmmsc_init ("XMMS2-Scrobbler");
-
-	if (!conn) {
-		fprintf (stderr, "OOM\n");
+	if (!servers) {
+		log_error ("*** No subdirectories found in "
+		                ".../clients/xmms2-scrobbler\n"
+		           "*** See README for how to configure XMMS2-Scrobbler.\n");
 
 		return EXIT_FAILURE;
 	}
 
-	s = xmmsc_connect (conn, NULL);
+	/* nothing new will arrive, so there's no point in waiting for it.
+	 * --import and --replay keep queueing while they send.
+	 */
+	if (drain_only && !import_mapping && !replayer)
+		for (List *l = servers; l; l = l->next)
+			((Server *) l->data)->batch_window = 0;
 
-	if (!s) {
-		fprintf (stderr, "cannot connect to xmms2d\n");
+	if (!drain_only) {
+		conn = xmmsc_init ("XMMS2-Scrobbler");
 
-		xmmsc_unref (conn);
+		if (!conn) {
+			log_error ("OOM\n");
 
-		return EXIT_FAILURE;
+			return EXIT_FAILURE;
+		}
+
+		s = xmmsc_connect (conn, NULL);
+
+		if (!s) {
+			log_error ("cannot connect to xmms2d\n");
+
+			xmmsc_unref (conn);
+
+			return EXIT_FAILURE;
+		}
 	}
 
 	curl_global_init (CURL_GLOBAL_NOTHING);
+	share_init ();
 
-	for (List *l = servers; l; l = l->next) {
-		Server *server = l->data;
-
-		pthread_create (&server->thread, NULL, curl_thread, server);
+	if (engine == ENGINE_MULTI) {
+		log_info ("using the curl_multi engine\n");
+		multi_init ();
+	} else if (engine == ENGINE_POOL && !pool_init ()) {
+		return EXIT_FAILURE;
 	}
 
-	/* register the various broadcasts that we're interested in */
-	current_id_broadcast = xmmsc_broadcast_playback_current_id (conn);
-	xmmsc_result_notifier_set (current_id_broadcast,
-	                           on_playback_current_id, NULL);
-	xmmsc_result_unref (current_id_broadcast);
+	for (List *l = servers; l; l = l->next)
+		start_server (l->data);
+
+	if (conn) {
+		/* register the various broadcasts that we're interested in */
+		current_id_broadcast =
+			xmmsc_broadcast_playback_current_id (conn);
+		xmmsc_result_notifier_set (current_id_broadcast,
+		                           on_playback_current_id, NULL);
+		xmmsc_result_unref (current_id_broadcast);
 
-	playback_status_broadcast = xmmsc_broadcast_playback_status (conn);
-	xmmsc_result_notifier_set (playback_status_broadcast,
-	                           on_playback_status, NULL);
-	xmmsc_result_unref (playback_status_broadcast);
+		playback_status_broadcast =
+			xmmsc_broadcast_playback_status (conn);
+		xmmsc_result_notifier_set (playback_status_broadcast,
+		                           on_playback_status, NULL);
+		xmmsc_result_unref (playback_status_broadcast);
 
-	quit_broadcast = xmmsc_broadcast_quit (conn);
-	xmmsc_result_notifier_set (quit_broadcast, on_quit, NULL);
-	xmmsc_result_unref (quit_broadcast);
+		quit_broadcast = xmmsc_broadcast_quit (conn);
+		xmmsc_result_notifier_set (quit_broadcast, on_quit, NULL);
+		xmmsc_result_unref (quit_broadcast);
 
-	xmmsc_disconnect_callback_set (conn, on_disconnect, NULL);
+		xmmsc_disconnect_callback_set (conn, on_disconnect, NULL);
+	}
+
+	if (import_mapping)
+		import ();
 
 	main_loop ();
 
-	/* tell the curl threads to stop working */
-	for (List *l = servers; l; l = l->next) {
-		Server *server = l->data;
+	if (engine == ENGINE_MULTI) {
+		multi_cleanup ();
+	} else if (engine == ENGINE_POOL) {
+		pool_cleanup ();
+	} else {
+		/* tell the curl threads to stop working */
+		for (List *l = servers; l; l = l->next) {
+			Server *server = l->data;
 
-		pthread_mutex_lock (&server->submissions_mutex);
-		server->shutdown_thread = true;
-		pthread_cond_signal (&server->cond);
-		pthread_mutex_unlock (&server->submissions_mutex);
-	}
+			__atomic_store_n (&server->shutdown_thread, true,
+			                  __ATOMIC_RELEASE);
+			ring_wake (server->incoming);
+		}
 
-	/* and wait until they are gone */
-	for (List *l = servers; l; l = l->next) {
-		Server *server = l->data;
+		/* and wait until they are gone */
+		for (List *l = servers; l; l = l->next) {
+			Server *server = l->data;
+
+			pthread_join (server->thread, NULL);
+		}
 
-		pthread_join (server->thread, NULL);
+		/* the removed ones have been told to stop already */
+		for (List *l = retired; l; l = l->next) {
+			Server *server = l->data;
+
+			pthread_join (server->thread, NULL);
+		}
 	}
 
+	if (config_watch)
+		config_watch_free (config_watch);
+
+	share_cleanup ();
 	curl_global_cleanup ();
 
 #if 0
@@ -1041,7 +3339,20 @@ main (int argc, char **argv)
 	xmmsc_result_disconnect (quit_broadcast);
 #endif
 
-	xmmsc_unref (conn);
+	if (conn)
+		xmmsc_unref (conn);
+
+	if (recorder)
+		trace_writer_free (recorder);
+
+	if (replayer) {
+		if (replay_pending && replay_next.info)
+			xmmsv_unref (replay_next.info);
+
+		trace_reader_free (replayer);
+	}
+
+	journal_shutdown ();
 
 	while (servers) {
 		Server *server = servers->data;
@@ -1052,5 +3363,10 @@ main (int argc, char **argv)
 		servers = list_remove_head (servers);
 	}
 
+	while (retired) {
+		finish_server (retired->data);
+		retired = list_remove_head (retired);
+	}
+
 	return EXIT_SUCCESS;
 }